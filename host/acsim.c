@@ -0,0 +1,1004 @@
+/* Simulated indoor units: the far end of the IR link, for testing on Linux
+
+   Each unit takes Panasonic frames, checks and applies them as an indoor
+   unit does, and runs a room on a first order thermal model. The clock is
+   simulated, so a scenario with hundreds of units and a day of weather
+   runs in seconds, and the unit reports how long its room took to settle
+   after a change and how many frames it took.
+
+     ./acsim -f scenario.txt
+     ./acsim -s /tmp/acsim.sock -r 60 &
+     socat - UNIX-CONNECT:/tmp/acsim.sock
+
+   Commands come one per line, from the -f file ('-' for stdin) and from
+   clients of the -s socket ('#' starts a comment). Every command is
+   answered with a line starting "ok" or "error"; get prints a line per
+   unit before it. <units> is a unit name or a shell pattern ("*",
+   "floor2-*").
+
+     add <name>                 add a unit
+     units <count> [<prefix>]   add <prefix>000 and on
+     outdoor <C>                outdoor temperature, for all units
+     room <units> <C>           set the room temperature
+     frame <units> <hex>        receive a data frame, such as "02 20 e0 ..."
+     send <units> <json>        change fields of the remote's state, as
+                                /state/set, and send it with
+                                panasonic_build_frame()
+     command <units> <names>    send a command list, as /command/set, in
+                                one transmission; "state" sends the
+                                remote's state
+     attach <unit> <fifo>       receive "pulse"/"space" text from a FIFO,
+                                such as panasonicd's pipe transport sends
+     step <seconds>             run the clock
+     settle <seconds>           run the clock until every room has settled
+     get <units>                state and counters
+     stats                      totals over all units
+     clear                      zero the counters
+     quit                       close the connection, or end the script
+
+   Frames take their air time and are ignored while the unit processes
+   the transmission before (-b), as a real unit beeps once and ignores a
+   repeat sent too soon. The frames of one transmission, IDLE_US apart,
+   are all taken, as a real unit takes the state and Powerful frames its
+   remote sends for one button; panasonic_transmit_list() sends a command
+   list the same way. Special commands are ignored while the unit is off.
+   Powerful runs at more than full capacity for POWERFUL_S, Quiet at less;
+   a new mode or power state ends both. The compressor keeps a restart
+   delay and, heating, blows no warm air until it has warmed up.
+
+   A room counts as settled within SETTLE_BAND of the set temperature;
+   units that are off, drying or only running the fan settle as soon as
+   the frame is applied.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <getopt.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "esp_log.h"
+#include "mqtt_topics.h"
+#include "panasonic_frame.h"
+#include "panasonic_ir.h"
+#include "panasonic_pulse.h"
+#include "panasonic_state.h"
+
+#define UNIT_NAME_MAX  32
+#define CLIENTS_MAX    16
+#define CMD_LINE_MAX   512
+#define RX_IDLE_US     4000             /*!< Longer spaces end a frame, as in panasonicd */
+#define STEP_S         1.0              /*!< Thermal model time step */
+
+/* Room and unit, roughly a 25 m2 room with a 2.5 kW split unit */
+#define ROOM_J_PER_K   1.0e6            /*!< Air, walls and furniture */
+#define ROOM_W_PER_K   60.0             /*!< Loss to the outside */
+#define COOL_W         2500.0
+#define HEAT_W         3200.0
+#define DRY_FACTOR     0.4
+#define POWERFUL_FACTOR 1.3
+#define QUIET_FACTOR   0.7
+#define POWERFUL_S     (20 * 60)
+#define RESTART_S      180              /*!< Compressor restart delay */
+#define HOT_START_S    60               /*!< Heating, no output while warming up */
+#define HYST_OFF       1.0              /*!< Past the set temperature, the compressor stops */
+#define HYST_ON        0.5              /*!< Short of it, the compressor starts again */
+#define AUTO_SWITCH    2.0              /*!< Auto changes between heating and cooling */
+#define SETTLE_BAND    0.5
+
+static const char TAG[] = "acsim";
+
+int host_log_level = 3;
+
+struct unit {
+	char name[UNIT_NAME_MAX];
+	struct panasonic_command state;         /*!< As the unit runs */
+	struct panasonic_command remote;        /*!< As last sent by send */
+	bool powerful;
+	bool quiet;
+	double powerful_end;
+	double room;                            /*!< Room temperature, C */
+	bool compressor;
+	double compressor_changed;
+	enum mode active;                       /*!< Heating or cooling, for auto */
+	double link_free;                       /*!< The last frame on the way ends */
+	double busy_end;                        /*!< Processing the last transmission accepted */
+	bool lost;                              /*!< The transmission on the way was ignored */
+	double changed;                         /*!< Last change of power, mode or temperature, or -1 */
+	double settled;                         /*!< The room settled after it, or -1 */
+	unsigned int frames;
+	unsigned int accepted;
+	unsigned int busy;
+	unsigned int invalid;
+	unsigned int ignored;
+	double thermal_j;
+
+	/* attach */
+	int fd;
+	struct panasonic_parser parser;
+	uint32_t mark;
+	bool follows;                           /*!< The next frame is part of the same transmission */
+	char line[64];
+	size_t line_len;
+};
+
+struct client {
+	int fd;
+	char line[CMD_LINE_MAX];
+	size_t line_len;
+};
+
+static struct {
+	double outdoor;
+	double process_s;
+	double rate;
+	const char *script;
+	const char *socket;
+} opt = {
+	.outdoor = 30.0,
+	.process_s = 0.6,
+};
+
+static struct unit *units;
+static int unit_count;
+static int unit_size;
+static struct client clients[CLIENTS_MAX];
+static double sim_time;
+static volatile sig_atomic_t stopping;
+
+/* The firmware is linked in for its frame and JSON formats only */
+int mqtt_pub(const char *topic, const char *data, int len, int qos, int retain)
+{
+	return 0;
+}
+
+int mqtt_pub_state(const char *data, int len)
+{
+	return 0;
+}
+
+int panasonic_transmit(const struct panasonic_command *cmd)
+{
+	return 0;
+}
+
+int panasonic_transmit_list(const struct panasonic_command *cmds, int count)
+{
+	return 0;
+}
+
+static double now_s(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void reply(int fd, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void reply(int fd, const char *fmt, ...)
+{
+	char buf[CMD_LINE_MAX];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(buf, sizeof(buf) - 1, fmt, ap);
+	va_end(ap);
+	if (len > (int)sizeof(buf) - 2) {
+		len = sizeof(buf) - 2;
+	}
+	buf[len++] = '\n';
+	if (write(fd, buf, len) != len) {
+		ESP_LOGD(TAG, "Reply to %d lost", fd);
+	}
+}
+
+/* The constant frame sent before every data frame */
+static const uint8_t header[PANASONIC_HEADER_LEN] = { 0x02, 0x20, 0xE0, 0x04, 0x00, 0x00, 0x00, 0x06 };
+
+/*
+ * @brief Air time of a frame and the header frame before it
+ */
+static double frame_air_s(const uint8_t *data, int len)
+{
+	struct panasonic_pulse pulses[PANASONIC_PULSES_MAX];
+	uint32_t us = IDLE_US;
+	int n;
+
+	n = panasonic_pulse_encode(pulses, PANASONIC_PULSES_MAX, header, sizeof(header));
+	for (int i = 0; i < n; i++) {
+		us += pulses[i].mark + pulses[i].space;
+	}
+	n = panasonic_pulse_encode(pulses, PANASONIC_PULSES_MAX, data, len);
+	for (int i = 0; i < n; i++) {
+		us += pulses[i].mark + pulses[i].space;
+	}
+	return us / 1e6;
+}
+
+/* -- units ------------------------------------------------------------- */
+
+static void unit_defaults(struct unit *u)
+{
+	u->state = (struct panasonic_command){
+		.cmd = CMD_STATE,
+		.mode = MODE_AUTO,
+		.temp = 25,
+		.fan = FAN_AUTO,
+		.swing = SWING_AUTO,
+	};
+	u->powerful = false;
+	u->quiet = false;
+	u->active = MODE_COOL;
+}
+
+static struct unit *unit_add(const char *name)
+{
+	struct unit *u;
+
+	if (strlen(name) >= UNIT_NAME_MAX) {
+		return NULL;
+	}
+	for (int i = 0; i < unit_count; i++) {
+		if (strcmp(units[i].name, name) == 0) {
+			return NULL;
+		}
+	}
+	if (unit_count == unit_size) {
+		int size = unit_size ? unit_size * 2 : 64;
+		struct unit *p = realloc(units, size * sizeof(*units));
+
+		if (p == NULL) {
+			return NULL;
+		}
+		units = p;
+		unit_size = size;
+	}
+
+	u = &units[unit_count++];
+	memset(u, 0, sizeof(*u));
+	strcpy(u->name, name);
+	unit_defaults(u);
+	u->remote = u->state;
+	u->room = opt.outdoor;
+	u->compressor_changed = -RESTART_S;
+	u->changed = -1;
+	u->settled = -1;
+	u->fd = -1;
+	return u;
+}
+
+static enum mode unit_mode(const struct unit *u)
+{
+	return u->state.mode == MODE_AUTO ? u->active : u->state.mode;
+}
+
+static void compressor_set(struct unit *u, bool on, double t)
+{
+	if (u->compressor != on) {
+		u->compressor = on;
+		u->compressor_changed = t;
+	}
+}
+
+/*
+ * @brief Whether the room is where it was asked to be
+ */
+static bool unit_settled(const struct unit *u)
+{
+	enum mode mode = unit_mode(u);
+
+	if (!u->state.on || mode == MODE_FAN || mode == MODE_DRY) {
+		return true;
+	}
+	return fabs(u->room - u->state.temp) <= SETTLE_BAND;
+}
+
+static void unit_check_settled(struct unit *u, double t)
+{
+	if (u->changed >= 0 && u->settled < 0 && unit_settled(u)) {
+		u->settled = t > u->changed ? t : u->changed;
+	}
+}
+
+static void unit_state(struct unit *u, const struct panasonic_command *cmd, double t)
+{
+	struct panasonic_command old = u->state;
+
+	u->state = *cmd;
+	if (old.on != cmd->on || old.mode != cmd->mode) {
+		u->powerful = false;
+		u->quiet = false;
+	}
+	if (old.on != cmd->on || old.mode != cmd->mode || old.temp != cmd->temp) {
+		u->changed = t;
+		u->settled = -1;
+	}
+	if (cmd->mode == MODE_AUTO && (old.mode != MODE_AUTO || !old.on)) {
+		u->active = u->room > cmd->temp ? MODE_COOL : MODE_HEAT;
+	}
+	unit_check_settled(u, t);
+}
+
+static void unit_special(struct unit *u, enum cmd cmd, double t)
+{
+	switch (cmd) {
+	case CMD_POWERFUL:
+		u->powerful = !u->powerful;
+		u->powerful_end = t + POWERFUL_S;
+		u->quiet = false;
+		break;
+	case CMD_QUIET:
+		u->quiet = !u->quiet;
+		u->powerful = false;
+		break;
+	case CMD_AC_RESET:
+		unit_defaults(u);
+		u->changed = t;
+		u->settled = t;
+		break;
+	default:
+		/* Ion, patrol, check and air direction do not change the room */
+		break;
+	}
+}
+
+/*
+ * @brief Take a frame that starts arriving at time t
+ *
+ * Frames queue up on the link. A frame that starts a transmission and
+ * ends while the unit is still processing the one before is lost, with
+ * the rest of its transmission, as on a real unit. follows is set for
+ * the second and later frames of a transmission.
+ */
+static void unit_receive(struct unit *u, const uint8_t *data, int len, double t, bool follows)
+{
+	struct panasonic_command cmd;
+	double end;
+
+	end = (t > u->link_free ? t : u->link_free) + frame_air_s(data, len);
+	u->link_free = end;
+	u->frames++;
+
+	if (follows ? u->lost : end < u->busy_end) {
+		u->lost = true;
+		u->busy++;
+		return;
+	}
+	u->lost = false;
+	if (panasonic_parse_frame(&cmd, data, len) <= 0) {
+		u->invalid++;
+		return;
+	}
+	if (cmd.cmd != CMD_STATE && cmd.cmd != CMD_AC_RESET && !u->state.on) {
+		u->ignored++;
+		return;
+	}
+
+	u->accepted++;
+	u->busy_end = end + opt.process_s;
+	if (cmd.cmd == CMD_STATE) {
+		unit_state(u, &cmd, end);
+	} else {
+		unit_special(u, cmd.cmd, end);
+	}
+}
+
+/*
+ * @brief Send frames in one transmission, as panasonic_transmit_list()
+ */
+static void unit_send(struct unit *u, const struct panasonic_command *cmds, int count)
+{
+	for (int i = 0; i < count; i++) {
+		uint8_t data[PANASONIC_FRAME_MAXLEN];
+		int len;
+
+		len = panasonic_build_frame(&cmds[i], data, sizeof(data));
+		if (len > 0) {
+			unit_receive(u, data, len, sim_time, i > 0);
+		}
+	}
+}
+
+/*
+ * @brief Run the compressor and the room for dt seconds up to time t
+ */
+static void unit_step(struct unit *u, double t, double dt)
+{
+	enum mode mode = unit_mode(u);
+	double q = (opt.outdoor - u->room) * ROOM_W_PER_K;
+	double demand;
+
+	if (u->powerful && t >= u->powerful_end) {
+		u->powerful = false;
+	}
+
+	if (!u->state.on || mode == MODE_FAN) {
+		compressor_set(u, false, t);
+	} else {
+		demand = mode == MODE_HEAT ? u->state.temp - u->room : u->room - u->state.temp;
+
+		/* Auto changes over only once the compressor has stopped */
+		if (u->state.mode == MODE_AUTO && !u->compressor && demand < -AUTO_SWITCH) {
+			u->active = u->active == MODE_COOL ? MODE_HEAT : MODE_COOL;
+			mode = u->active;
+			demand = -demand;
+		}
+
+		if (u->compressor && demand < -HYST_OFF) {
+			compressor_set(u, false, t);
+		} else if (!u->compressor && demand > HYST_ON && t - u->compressor_changed >= RESTART_S) {
+			compressor_set(u, true, t);
+		}
+
+		if (u->compressor && !(mode == MODE_HEAT && t - u->compressor_changed < HOT_START_S)) {
+			/* An inverter: full power far from the set temperature, a trickle near it */
+			double fraction = fmin(fmax(0.25 + demand / 2, 0.15), 1.0);
+			double w = mode == MODE_HEAT ? HEAT_W : COOL_W;
+
+			if (mode == MODE_DRY) {
+				w *= DRY_FACTOR;
+			}
+			if (u->powerful) {
+				fraction = POWERFUL_FACTOR;
+			} else if (u->quiet) {
+				fraction *= QUIET_FACTOR;
+			}
+			w *= fraction;
+			u->thermal_j += w * dt;
+			q += mode == MODE_HEAT ? w : -w;
+		}
+	}
+
+	u->room += q * dt / ROOM_J_PER_K;
+	unit_check_settled(u, t);
+}
+
+/*
+ * @brief Advance the clock, in steps of at most STEP_S
+ */
+static void sim_run(double seconds)
+{
+	double end = sim_time + seconds;
+
+	while (sim_time < end) {
+		double dt = end - sim_time < STEP_S ? end - sim_time : STEP_S;
+
+		sim_time += dt;
+		for (int i = 0; i < unit_count; i++) {
+			unit_step(&units[i], sim_time, dt);
+		}
+	}
+}
+
+static bool sim_settled(void)
+{
+	for (int i = 0; i < unit_count; i++) {
+		if (units[i].settled < 0 && units[i].changed >= 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* -- attach: text as printed by mode2 ----------------------------------- */
+
+static void unit_feed(struct unit *u, uint32_t mark, uint32_t space)
+{
+	int ret;
+
+	mark = mark > UINT16_MAX ? UINT16_MAX : mark;
+
+	ret = panasonic_pulse_parse(&u->parser, mark, space >= RX_IDLE_US ? 0 : space);
+	/* Special command frames are as long as the header, so compare */
+	if (ret > 0 && (ret != sizeof(header) || memcmp(u->parser.buf, header, ret) != 0)) {
+		/* Frames of one transmission are IDLE_US apart, panasonicd ends it with a timeout */
+		unit_receive(u, u->parser.buf, ret, sim_time, u->follows);
+		u->follows = space != 0 && space <= IDLE_US;
+	} else if (ret < 0) {
+		u->frames++;
+		u->invalid++;
+	}
+}
+
+static void unit_pulse_line(struct unit *u, const char *line)
+{
+	char type[16];
+	unsigned int us;
+
+	if (sscanf(line, "%15s %u", type, &us) != 2) {
+		return;
+	}
+	if (strcmp(type, "pulse") == 0) {
+		u->mark += us;
+	} else if (u->mark != 0 && (strcmp(type, "space") == 0 || strcmp(type, "timeout") == 0)) {
+		unit_feed(u, u->mark, strcmp(type, "space") == 0 ? us : 0);
+		u->mark = 0;
+	}
+}
+
+static void unit_read(struct unit *u)
+{
+	char buf[512];
+	ssize_t n;
+
+	while ((n = read(u->fd, buf, sizeof(buf))) > 0) {
+		for (ssize_t i = 0; i < n; i++) {
+			if (buf[i] == '\n') {
+				u->line[u->line_len] = '\0';
+				unit_pulse_line(u, u->line);
+				u->line_len = 0;
+			} else if (u->line_len < sizeof(u->line) - 1) {
+				u->line[u->line_len++] = buf[i];
+			}
+		}
+	}
+}
+
+/* -- commands ---------------------------------------------------------- */
+
+static void unit_print(int fd, const struct unit *u)
+{
+	char json[128];
+
+	panasonic_state_to_json(json, sizeof(json), &u->state);
+	reply(fd, "%s room=%.2f compressor=%d powerful=%d quiet=%d frames=%u accepted=%u busy=%u "
+	      "invalid=%u ignored=%u settle=%.1f kwh=%.3f state=%s",
+	      u->name, u->room, u->compressor, u->powerful, u->quiet, u->frames, u->accepted, u->busy,
+	      u->invalid, u->ignored, u->settled >= 0 ? u->settled - u->changed : -1.0, u->thermal_j / 3.6e6,
+	      json);
+}
+
+static void stats_print(int fd)
+{
+	unsigned int frames = 0, accepted = 0, busy = 0, invalid = 0, ignored = 0;
+	int changed = 0, settled = 0;
+	double settle_sum = 0, settle_max = 0, thermal_j = 0;
+
+	for (int i = 0; i < unit_count; i++) {
+		const struct unit *u = &units[i];
+
+		frames += u->frames;
+		accepted += u->accepted;
+		busy += u->busy;
+		invalid += u->invalid;
+		ignored += u->ignored;
+		thermal_j += u->thermal_j;
+		if (u->changed >= 0) {
+			changed++;
+		}
+		if (u->changed >= 0 && u->settled >= 0) {
+			double s = u->settled - u->changed;
+
+			settled++;
+			settle_sum += s;
+			settle_max = s > settle_max ? s : settle_max;
+		}
+	}
+	reply(fd, "ok time=%.1f units=%d frames=%u accepted=%u busy=%u invalid=%u ignored=%u "
+	      "settled=%d/%d settle_mean=%.1f settle_max=%.1f kwh=%.3f",
+	      sim_time, unit_count, frames, accepted, busy, invalid, ignored, settled, changed,
+	      settled ? settle_sum / settled : 0.0, settle_max, thermal_j / 3.6e6);
+}
+
+static int parse_hex(uint8_t *data, size_t size, const char *s)
+{
+	size_t len = 0;
+
+	while (*s != '\0') {
+		char *end;
+		unsigned long b;
+
+		while (*s == ' ' || *s == ',') {
+			s++;
+		}
+		if (*s == '\0') {
+			break;
+		}
+		b = strtoul(s, &end, 16);
+		if (end == s || end - s > 2 || len == size) {
+			return -1;
+		}
+		data[len++] = b;
+		s = end;
+	}
+	return len;
+}
+
+static int unit_attach(struct unit *u, const char *path)
+{
+	/* O_RDWR keeps a FIFO open while no writer is attached */
+	int fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+
+	if (fd < 0) {
+		return -1;
+	}
+	if (u->fd >= 0) {
+		close(u->fd);
+	}
+	u->fd = fd;
+	memset(&u->parser, 0, sizeof(u->parser));
+	u->mark = 0;
+	u->line_len = 0;
+	return 0;
+}
+
+/*
+ * @brief Run one command line
+ *
+ * Returns -1 for quit, 0 otherwise.
+ */
+static int command_run(int fd, char *line)
+{
+	char *cmd;
+	char *sel;
+	char *arg;
+	int matched = 0;
+
+	line[strcspn(line, "#\r\n")] = '\0';
+	cmd = strtok(line, " \t");
+	if (cmd == NULL) {
+		return 0;
+	}
+	sel = strtok(NULL, " \t");
+	arg = strtok(NULL, "");
+	if (arg != NULL) {
+		arg += strspn(arg, " \t");
+	}
+
+	if (strcmp(cmd, "quit") == 0) {
+		reply(fd, "ok");
+		return -1;
+	} else if (strcmp(cmd, "add") == 0 && sel != NULL) {
+		if (unit_add(sel) == NULL) {
+			reply(fd, "error cannot add %s", sel);
+		} else {
+			reply(fd, "ok");
+		}
+		return 0;
+	} else if (strcmp(cmd, "units") == 0 && sel != NULL) {
+		int count = atoi(sel);
+		int added = 0;
+
+		for (int i = 0; i < count; i++) {
+			char name[UNIT_NAME_MAX + 16];
+
+			snprintf(name, sizeof(name), "%.24s%03d", arg != NULL && *arg ? arg : "unit", i);
+			added += unit_add(name) != NULL;
+		}
+		reply(fd, "ok %d", added);
+		return 0;
+	} else if (strcmp(cmd, "outdoor") == 0 && sel != NULL) {
+		opt.outdoor = atof(sel);
+		reply(fd, "ok");
+		return 0;
+	} else if (strcmp(cmd, "step") == 0 && sel != NULL) {
+		sim_run(atof(sel));
+		reply(fd, "ok %.1f", sim_time);
+		return 0;
+	} else if (strcmp(cmd, "settle") == 0 && sel != NULL) {
+		double start = sim_time;
+		double limit = atof(sel);
+
+		while (!sim_settled() && sim_time - start < limit) {
+			sim_run(STEP_S);
+		}
+		if (sim_settled()) {
+			reply(fd, "ok %.1f", sim_time - start);
+		} else {
+			reply(fd, "error not settled after %.1f", sim_time - start);
+		}
+		return 0;
+	} else if (strcmp(cmd, "stats") == 0) {
+		stats_print(fd);
+		return 0;
+	} else if (strcmp(cmd, "clear") == 0) {
+		for (int i = 0; i < unit_count; i++) {
+			units[i].frames = units[i].accepted = units[i].busy = 0;
+			units[i].invalid = units[i].ignored = 0;
+			units[i].thermal_j = 0;
+		}
+		reply(fd, "ok");
+		return 0;
+	} else if (sel == NULL) {
+		reply(fd, "error bad command");
+		return 0;
+	}
+
+	/* Commands for a set of units */
+	for (int i = 0; i < unit_count; i++) {
+		struct unit *u = &units[i];
+
+		if (fnmatch(sel, u->name, 0) != 0) {
+			continue;
+		}
+		matched++;
+
+		if (strcmp(cmd, "get") == 0) {
+			unit_print(fd, u);
+		} else if (strcmp(cmd, "room") == 0 && arg != NULL) {
+			u->room = atof(arg);
+			unit_check_settled(u, sim_time);
+		} else if (strcmp(cmd, "frame") == 0 && arg != NULL) {
+			uint8_t data[PANASONIC_FRAME_MAXLEN];
+			int len = parse_hex(data, sizeof(data), arg);
+
+			if (len <= 0) {
+				reply(fd, "error bad frame");
+				return 0;
+			}
+			unit_receive(u, data, len, sim_time, false);
+		} else if (strcmp(cmd, "send") == 0 && arg != NULL) {
+			struct mqtt_set_request reqs[MQTT_SET_FIELDS];
+			int n = mqtt_parse_state(reqs, arg, strlen(arg));
+
+			if (n <= 0) {
+				reply(fd, "error bad state");
+				return 0;
+			}
+			for (int j = 0; j < n; j++) {
+				panasonic_apply_set(&u->remote, &reqs[j]);
+			}
+			unit_send(u, &u->remote, 1);
+		} else if (strcmp(cmd, "command") == 0 && arg != NULL) {
+			struct panasonic_command cmds[PANASONIC_COMMANDS_MAX];
+			int n = mqtt_parse_commands(cmds, PANASONIC_COMMANDS_MAX, arg, strlen(arg));
+
+			if (n <= 0) {
+				reply(fd, "error bad command list");
+				return 0;
+			}
+			/* As mqtt.c does, "state" sends the state last sent */
+			for (int j = 0; j < n; j++) {
+				if (cmds[j].cmd == CMD_STATE) {
+					cmds[j] = u->remote;
+				}
+			}
+			unit_send(u, cmds, n);
+		} else if (strcmp(cmd, "attach") == 0 && arg != NULL) {
+			if (unit_attach(u, arg) < 0) {
+				reply(fd, "error %s: %s", arg, strerror(errno));
+				return 0;
+			}
+		} else {
+			reply(fd, "error bad command");
+			return 0;
+		}
+	}
+
+	if (matched == 0) {
+		reply(fd, "error no unit %s", sel);
+	} else {
+		reply(fd, "ok %d", matched);
+	}
+	return 0;
+}
+
+static int script_run(const char *path)
+{
+	char line[CMD_LINE_MAX];
+	FILE *f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+
+	if (f == NULL) {
+		perror(path);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (command_run(STDOUT_FILENO, line) < 0) {
+			break;
+		}
+	}
+	if (f != stdin) {
+		fclose(f);
+	}
+	return 0;
+}
+
+/* -- socket ------------------------------------------------------------ */
+
+static int server_open(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+	unlink(path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, CLIENTS_MAX) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void client_accept(int sfd)
+{
+	int fd = accept4(sfd, NULL, NULL, SOCK_CLOEXEC);
+
+	if (fd < 0) {
+		return;
+	}
+	for (int i = 0; i < CLIENTS_MAX; i++) {
+		if (clients[i].fd < 0) {
+			clients[i].fd = fd;
+			clients[i].line_len = 0;
+			return;
+		}
+	}
+	reply(fd, "error too many clients");
+	close(fd);
+}
+
+static void client_read(struct client *c)
+{
+	char buf[CMD_LINE_MAX];
+	ssize_t n = read(c->fd, buf, sizeof(buf));
+
+	if (n <= 0) {
+		close(c->fd);
+		c->fd = -1;
+		return;
+	}
+	for (ssize_t i = 0; i < n && c->fd >= 0; i++) {
+		if (buf[i] != '\n') {
+			if (c->line_len < sizeof(c->line) - 1) {
+				c->line[c->line_len++] = buf[i];
+			}
+			continue;
+		}
+		c->line[c->line_len] = '\0';
+		c->line_len = 0;
+		if (command_run(c->fd, c->line) < 0) {
+			close(c->fd);
+			c->fd = -1;
+		}
+	}
+}
+
+/*
+ * @brief Serve the socket and attached FIFOs until SIGINT or SIGTERM
+ *
+ * With -r, the clock runs by itself at that many times real time.
+ */
+static void serve(int sfd)
+{
+	struct pollfd *fds = NULL;
+	double last = now_s();
+
+	while (!stopping) {
+		int nfds = 0;
+		struct pollfd *p;
+		double t;
+
+		p = realloc(fds, (1 + CLIENTS_MAX + unit_count) * sizeof(*fds));
+		if (p == NULL) {
+			break;
+		}
+		fds = p;
+		fds[nfds++] = (struct pollfd){ .fd = sfd, .events = POLLIN };
+		for (int i = 0; i < CLIENTS_MAX; i++) {
+			fds[nfds++] = (struct pollfd){ .fd = clients[i].fd, .events = POLLIN };
+		}
+		for (int i = 0; i < unit_count; i++) {
+			fds[nfds++] = (struct pollfd){ .fd = units[i].fd, .events = POLLIN };
+		}
+
+		if (poll(fds, nfds, 100) < 0 && errno != EINTR) {
+			break;
+		}
+
+		t = now_s();
+		if (opt.rate > 0) {
+			sim_run((t - last) * opt.rate);
+		}
+		last = t;
+
+		if (fds[0].revents & POLLIN) {
+			client_accept(sfd);
+		}
+		for (int i = 0; i < CLIENTS_MAX; i++) {
+			if (clients[i].fd >= 0 && fds[1 + i].revents) {
+				client_read(&clients[i]);
+			}
+		}
+		/* Units added by a client since the poll have no entry yet */
+		for (int i = 0; i < unit_count && 1 + CLIENTS_MAX + i < nfds; i++) {
+			if (units[i].fd >= 0 && fds[1 + CLIENTS_MAX + i].revents) {
+				unit_read(&units[i]);
+			}
+		}
+	}
+	free(fds);
+}
+
+static void on_signal(int sig)
+{
+	stopping = 1;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+	        "usage: %s [options]\n"
+	        "  -f file     run commands from file, '-' for stdin\n"
+	        "  -s path     then take commands on a UNIX socket\n"
+	        "  -r rate     with -s, run the clock at rate times real time (0)\n"
+	        "  -o celsius  outdoor temperature (%.1f)\n"
+	        "  -b ms       a unit ignores frames for this long after a transmission (%d)\n"
+	        "  -v          verbose logging\n",
+	        prog, opt.outdoor, (int)(opt.process_s * 1000));
+	exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+	int sfd;
+	int c;
+
+	while ((c = getopt(argc, argv, "f:s:r:o:b:v")) != -1) {
+		switch (c) {
+		case 'f': opt.script = optarg; break;
+		case 's': opt.socket = optarg; break;
+		case 'r': opt.rate = atof(optarg); break;
+		case 'o': opt.outdoor = atof(optarg); break;
+		case 'b': opt.process_s = atoi(optarg) / 1000.0; break;
+		case 'v': host_log_level = 5; break;
+		default: usage(argv[0]);
+		}
+	}
+	if ((opt.script == NULL && opt.socket == NULL) || opt.rate < 0 || opt.process_s < 0) {
+		usage(argv[0]);
+	}
+
+	for (int i = 0; i < CLIENTS_MAX; i++) {
+		clients[i].fd = -1;
+	}
+
+	if (opt.script != NULL && script_run(opt.script) < 0) {
+		return 1;
+	}
+	if (opt.socket == NULL) {
+		return 0;
+	}
+
+	sfd = server_open(opt.socket);
+	if (sfd < 0) {
+		perror(opt.socket);
+		return 1;
+	}
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	signal(SIGPIPE, SIG_IGN);
+	ESP_LOGI(TAG, "Listening on %s, %d units", opt.socket, unit_count);
+
+	serve(sfd);
+
+	close(sfd);
+	unlink(opt.socket);
+	for (int i = 0; i < unit_count; i++) {
+		if (units[i].fd >= 0) {
+			close(units[i].fd);
+		}
+	}
+	free(units);
+	return 0;
+}
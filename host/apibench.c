@@ -0,0 +1,462 @@
+/* Local API benchmark: HTTP control against the MQTT round trip
+
+   Runs the firmware's state code and HTTP API in one process, together
+   with a proxy MQTT connection that handles /set the way mqtt.c does and
+   a simulated IR transmission time. Then it changes the temperature over
+   each path in turn and times how long the new state takes to show up
+   where a client would see it:
+
+     mqtt   publish panasonic/<id>/temperature/set, until panasonic/<id>
+     http   POST /state, until the response
+     sse    POST /state, until the /events stream carries it
+
+   Point it at a local broker; load that broker to see the HTTP path stay
+   flat while the MQTT one does not.
+
+     ./apibench -p 1883 -P 8080 -n 500 -t 20
+*/
+
+#include <errno.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "http_api.h"
+#include "mem_budget.h"
+#include "mqtt_lite.h"
+#include "mqtt_topics.h"
+#include "panasonic_state.h"
+
+#define DEVICE_ID  "fe0000a91bec"
+#define TIMEOUT_US 2000000
+
+int host_log_level = 1;
+
+struct samples {
+	uint32_t *v;
+	size_t n;
+	size_t size;
+};
+
+static struct {
+	const char *host;
+	const char *port;
+	uint16_t http_port;
+	int count;
+	int tx_delay_ms;
+} opt = {
+	.host = "127.0.0.1",
+	.port = "1883",
+	.http_port = 8080,
+	.count = 200,
+	.tx_delay_ms = 0,
+};
+
+static struct addrinfo *broker;
+
+/* The proxy connection is shared by the MQTT and HTTP threads, as the
+   esp-mqtt client is on the target */
+static struct mqtt_lite proxy;
+static pthread_mutex_t proxy_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct mqtt_set_request pending[8];
+static int pending_count;
+
+static struct mqtt_lite ctl;
+static char ctl_state[STATE_JSON_MAXLEN];
+static bool ctl_ready;
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sample_add(struct samples *s, uint64_t v)
+{
+	if (s->n == s->size) {
+		s->size = s->size ? s->size * 2 : 1024;
+		s->v = realloc(s->v, s->size * sizeof(*s->v));
+		if (s->v == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	s->v[s->n++] = v > UINT32_MAX ? UINT32_MAX : v;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void sample_report(const char *name, struct samples *s)
+{
+	if (s->n == 0) {
+		printf("%-6s no samples\n", name);
+		return;
+	}
+
+	qsort(s->v, s->n, sizeof(*s->v), cmp_u32);
+#define PCT(p) (s->v[(size_t)((s->n - 1) * (p) / 100.0)] / 1000.0)
+	printf("%-6s n=%zu min=%.2fms p50=%.2fms p90=%.2fms p99=%.2fms max=%.2fms\n",
+	       name, s->n, s->v[0] / 1000.0, PCT(50), PCT(90), PCT(99), s->v[s->n - 1] / 1000.0);
+#undef PCT
+}
+
+int mqtt_pub(const char *topic, const char *data, int len, int qos, int retain)
+{
+	char full[64];
+	int ret;
+
+	snprintf(full, sizeof(full), TOPIC_PREFIX DEVICE_ID "%s", topic);
+	pthread_mutex_lock(&proxy_lock);
+	ret = mqtt_lite_publish(&proxy, full, data, len, qos, retain);
+	mqtt_lite_flush(&proxy);
+	pthread_mutex_unlock(&proxy_lock);
+	return ret;
+}
+
+/* Not retained, to leave the broker as it was */
+int mqtt_pub_state(const char *data, int len)
+{
+	return mqtt_pub("", data, len, 1, 0);
+}
+
+static void simulate_airtime(int frames)
+{
+	if (opt.tx_delay_ms > 0) {
+		usleep(opt.tx_delay_ms * 1000 * frames);
+	}
+}
+
+int panasonic_transmit(const struct panasonic_command *cmd)
+{
+	simulate_airtime(1);
+	return 0;
+}
+
+int panasonic_transmit_list(const struct panasonic_command *cmds, int count)
+{
+	simulate_airtime(count);
+	return 0;
+}
+
+static void proxy_on_publish(struct mqtt_lite *m, const char *topic, size_t topic_len,
+                             const uint8_t *payload, size_t len, int qos, bool retain)
+{
+	struct mqtt_set_request req;
+
+	if (mqtt_parse_set(&req, topic, topic_len, (const char *)payload, len) > 0 &&
+	    pending_count < (int)(sizeof(pending) / sizeof(pending[0]))) {
+		pending[pending_count++] = req;
+	}
+}
+
+/*
+ * @brief Proxy MQTT loop, standing in for the esp-mqtt task
+ *
+ * Set requests are applied after the connection lock is dropped, since
+ * applying them publishes the new state.
+ */
+static void *proxy_thread(void *arg)
+{
+	for (;;) {
+		struct mqtt_set_request reqs[8];
+		struct pollfd pfd = { .fd = proxy.fd, .events = POLLIN };
+		int count;
+
+		pthread_mutex_lock(&proxy_lock);
+		if (mqtt_lite_want_write(&proxy)) {
+			pfd.events |= POLLOUT;
+		}
+		pthread_mutex_unlock(&proxy_lock);
+
+		if (poll(&pfd, 1, 100) < 0 && errno != EINTR) {
+			perror("poll");
+			exit(1);
+		}
+
+		pthread_mutex_lock(&proxy_lock);
+		if (((pfd.revents & POLLIN) && mqtt_lite_read(&proxy) < 0) || mqtt_lite_flush(&proxy) < 0) {
+			fprintf(stderr, "proxy: connection lost\n");
+			exit(1);
+		}
+		count = pending_count;
+		memcpy(reqs, pending, count * sizeof(reqs[0]));
+		pending_count = 0;
+		pthread_mutex_unlock(&proxy_lock);
+
+		for (int i = 0; i < count; i++) {
+			panasonic_set_fields(&reqs[i], 1, SOURCE_MQTT, NULL);
+		}
+	}
+	return NULL;
+}
+
+static void *http_thread(void *arg)
+{
+	http_api_run();
+	return NULL;
+}
+
+static void ctl_on_suback(struct mqtt_lite *m, uint16_t id)
+{
+	ctl_ready = true;
+}
+
+static void ctl_on_publish(struct mqtt_lite *m, const char *topic, size_t topic_len,
+                           const uint8_t *payload, size_t len, int qos, bool retain)
+{
+	if (len < sizeof(ctl_state)) {
+		memcpy(ctl_state, payload, len);
+		ctl_state[len] = '\0';
+	}
+}
+
+/*
+ * @brief Run the controller connection until done() or the deadline
+ */
+static bool ctl_wait(bool (*done)(const void *), const void *arg, uint64_t until)
+{
+	while (!done(arg)) {
+		struct pollfd pfd = { .fd = ctl.fd, .events = POLLIN };
+		int64_t left = (int64_t)(until - now_us());
+
+		if (mqtt_lite_want_write(&ctl)) {
+			pfd.events |= POLLOUT;
+		}
+		if (left <= 0) {
+			return false;
+		}
+		poll(&pfd, 1, left / 1000 + 1);
+		if (((pfd.revents & POLLIN) && mqtt_lite_read(&ctl) < 0) || mqtt_lite_flush(&ctl) < 0) {
+			fprintf(stderr, "controller: connection lost\n");
+			exit(1);
+		}
+	}
+	return true;
+}
+
+static bool is_ready(const void *arg)
+{
+	return ctl_ready;
+}
+
+static bool has_temperature(const void *arg)
+{
+	return strstr(ctl_state, arg) != NULL;
+}
+
+static int http_connect(void)
+{
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(opt.http_port),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	struct timeval timeout = { .tv_sec = TIMEOUT_US / 1000000 };
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+	if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("http connect");
+		exit(1);
+	}
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	return fd;
+}
+
+/*
+ * @brief Read from fd until buf holds needle; the buffer is reset first
+ */
+static bool read_until(int fd, char *buf, size_t size, const char *needle)
+{
+	size_t len = 0;
+
+	buf[0] = '\0';
+	while (strstr(buf, needle) == NULL) {
+		ssize_t n = recv(fd, buf + len, size - 1 - len, 0);
+
+		if (n <= 0) {
+			return false;
+		}
+		len += n;
+		buf[len] = '\0';
+		if (len == size - 1) {
+			/* Keep the tail in case the needle straddles it */
+			memmove(buf, buf + len / 2, len - len / 2 + 1);
+			len -= len / 2;
+		}
+	}
+	return true;
+}
+
+static bool http_post(int fd, const char *body, char *buf, size_t size, const char *expect)
+{
+	char req[256];
+	int n;
+
+	n = snprintf(req, sizeof(req),
+	             "POST /state HTTP/1.1\r\n"
+	             "Host: localhost\r\n"
+	             "Content-Type: application/json\r\n"
+	             "Content-Length: %zu\r\n"
+	             "\r\n"
+	             "%s", strlen(body), body);
+	return send(fd, req, n, 0) == n && read_until(fd, buf, size, expect);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+	        "usage: %s [options]\n"
+	        "  -H host      broker host (%s)\n"
+	        "  -p port      broker port (%s)\n"
+	        "  -P port      HTTP API port (%u)\n"
+	        "  -n count     changes per path (%d)\n"
+	        "  -t ms        simulated IR airtime per frame (%d)\n",
+	        prog, opt.host, opt.port, opt.http_port, opt.count, opt.tx_delay_ms);
+}
+
+int main(int argc, char *argv[])
+{
+	struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+	struct samples mqtt_lat = { 0 }, http_lat = { 0 }, sse_lat = { 0 };
+	char topic[64], expect[32], body[32];
+	char buf[1024], sse[1024];
+	pthread_t thread;
+	int lost = 0;
+	int post_fd, sse_fd;
+	int c;
+
+	while ((c = getopt(argc, argv, "H:p:P:n:t:v")) != -1) {
+		switch (c) {
+		case 'H':
+			opt.host = optarg;
+			break;
+		case 'p':
+			opt.port = optarg;
+			break;
+		case 'P':
+			opt.http_port = atoi(optarg);
+			break;
+		case 'n':
+			opt.count = atoi(optarg);
+			break;
+		case 't':
+			opt.tx_delay_ms = atoi(optarg);
+			break;
+		case 'v':
+			host_log_level++;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if ((c = getaddrinfo(opt.host, opt.port, &hints, &broker)) != 0) {
+		fprintf(stderr, "%s: %s\n", opt.host, gai_strerror(c));
+		return 1;
+	}
+
+	panasonic_state_init();
+	if (http_api_init(opt.http_port, NULL) < 0) {
+		return 1;
+	}
+
+	/* Proxy: subscribed to its /set topics, like mqtt.c on connect */
+	proxy.on_publish = proxy_on_publish;
+	if (mqtt_lite_open(&proxy, broker) < 0 ||
+	    mqtt_lite_send_connect(&proxy, "apibench-proxy", 0, true, NULL) < 0) {
+		perror("proxy connect");
+		return 1;
+	}
+	for (size_t i = 0; i < mqtt_set_topic_count; i++) {
+		snprintf(topic, sizeof(topic), TOPIC_PREFIX DEVICE_ID "%s", mqtt_set_topics[i]);
+		mqtt_lite_subscribe(&proxy, topic, 0);
+	}
+
+	/* Controller: Home Assistant, watching the state topic */
+	ctl.on_suback = ctl_on_suback;
+	ctl.on_publish = ctl_on_publish;
+	if (mqtt_lite_open(&ctl, broker) < 0 ||
+	    mqtt_lite_send_connect(&ctl, "apibench-ctl", 0, true, NULL) < 0) {
+		perror("controller connect");
+		return 1;
+	}
+	mqtt_lite_subscribe(&ctl, TOPIC_PREFIX DEVICE_ID, 0);
+
+	pthread_create(&thread, NULL, proxy_thread, NULL);
+	pthread_create(&thread, NULL, http_thread, NULL);
+
+	if (!ctl_wait(is_ready, NULL, now_us() + TIMEOUT_US)) {
+		fprintf(stderr, "controller: no SUBACK\n");
+		return 1;
+	}
+	/* The proxy subscribed first; give its SUBACKs a moment as well */
+	usleep(100000);
+
+	post_fd = http_connect();
+	sse_fd = http_connect();
+	if (send(sse_fd, "GET /events HTTP/1.1\r\n\r\n", 24, 0) != 24 ||
+	    !read_until(sse_fd, sse, sizeof(sse), "\n\n")) {
+		fprintf(stderr, "no event stream\n");
+		return 1;
+	}
+
+	snprintf(topic, sizeof(topic), TOPIC_PREFIX DEVICE_ID "%s", mqtt_set_topics[SET_TEMPERATURE]);
+	for (int i = 0; i < opt.count; i++) {
+		/* Alternate values, so that every change differs from the last */
+		int t_mqtt = 16 + (2 * i) % 14;
+		int t_http = 17 + (2 * i) % 14;
+		uint64_t start;
+		int len;
+
+		snprintf(expect, sizeof(expect), "\"temperature\":\"%d\"", t_mqtt);
+		len = snprintf(body, sizeof(body), "%d", t_mqtt);
+		start = now_us();
+		mqtt_lite_publish(&ctl, topic, body, len, 0, false);
+		if (ctl_wait(has_temperature, expect, start + TIMEOUT_US)) {
+			sample_add(&mqtt_lat, now_us() - start);
+		} else {
+			lost++;
+		}
+		read_until(sse_fd, sse, sizeof(sse), expect);
+
+		snprintf(expect, sizeof(expect), "\"temperature\":\"%d\"", t_http);
+		snprintf(body, sizeof(body), "{\"temperature\":%d}", t_http);
+		start = now_us();
+		if (!http_post(post_fd, body, buf, sizeof(buf), expect)) {
+			fprintf(stderr, "POST failed\n");
+			return 1;
+		}
+		sample_add(&http_lat, now_us() - start);
+		if (read_until(sse_fd, sse, sizeof(sse), expect)) {
+			sample_add(&sse_lat, now_us() - start);
+		} else {
+			lost++;
+		}
+		ctl_wait(has_temperature, expect, now_us() + TIMEOUT_US);
+	}
+
+	sample_report("mqtt", &mqtt_lat);
+	sample_report("http", &http_lat);
+	sample_report("sse", &sse_lat);
+	if (lost > 0) {
+		printf("lost   %d\n", lost);
+	}
+	return 0;
+}
@@ -0,0 +1,318 @@
+/* History ring check on a simulated NOR flash
+
+   Runs main/history.c, task and queue included, against a partition
+   kept in RAM that behaves like NOR flash: an erase sets a whole sector
+   to ones, and a write can only clear bits, so writing a slot that was
+   not erased since its last write stops the run.
+
+   Changes are logged until the ring has wrapped several times, stopping
+   one before, at and one after every sector boundary. At each stop the
+   records are asked for with "0 <all>", "<from> <count>" and "-<count>",
+   and the answers must be exactly the valid records in flash, in
+   sequence order. Every few stops the unit reboots and must carry on
+   with the next sequence number; one reboot follows a torn write, a
+   last record whose CRC never made it to flash.
+
+     ./historysim            3 sector partition
+     ./historysim -s 8
+
+   Exits non-zero on the first mismatch.
+*/
+
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_partition.h"
+#include "esp_system.h"
+#include "history.h"
+#include "mem_budget.h"
+#include "mqtt.h"
+
+#define SLOTS_PER_SECTOR (SPI_FLASH_SEC_SIZE / HISTORY_RECORD_SIZE)
+#define SEQ_ERASED       0xffffffff
+
+int host_log_level = 1;
+
+static esp_partition_t part = {
+	.type = ESP_PARTITION_TYPE_DATA,
+	.label = HISTORY_PARTITION,
+};
+static uint8_t *flash;
+static uint32_t slots;
+
+/* The answer to the last query, collected from mqtt_pub() */
+static pthread_mutex_t answer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t answer_done = PTHREAD_COND_INITIALIZER;
+static struct history_record *answer;
+static size_t answer_len;
+static bool answered;
+
+/* Sequence number the next record must get */
+static uint32_t next_seq;
+
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype,
+                                                const char *label)
+{
+	return strcmp(label, part.label) == 0 ? &part : NULL;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *p, size_t offset, void *dst, size_t size)
+{
+	if (offset + size > p->size) {
+		return ESP_ERR_INVALID_SIZE;
+	}
+	memcpy(dst, flash + offset, size);
+	return ESP_OK;
+}
+
+esp_err_t esp_partition_write(const esp_partition_t *p, size_t offset, const void *src, size_t size)
+{
+	const uint8_t *s = src;
+
+	if (offset + size > p->size) {
+		return ESP_ERR_INVALID_SIZE;
+	}
+	for (size_t i = 0; i < size; i++) {
+		if ((flash[offset + i] & s[i]) != s[i]) {
+			fprintf(stderr, "write at %zu over data that was not erased\n", offset + i);
+			exit(1);
+		}
+		flash[offset + i] &= s[i];
+	}
+	return ESP_OK;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t *p, size_t offset, size_t size)
+{
+	if (offset % SPI_FLASH_SEC_SIZE != 0 || size % SPI_FLASH_SEC_SIZE != 0 || offset + size > p->size) {
+		return ESP_ERR_INVALID_ARG;
+	}
+	memset(flash + offset, 0xff, size);
+	return ESP_OK;
+}
+
+esp_reset_reason_t esp_reset_reason(void)
+{
+	return ESP_RST_POWERON;
+}
+
+void mem_register_task(TaskHandle_t task, uint32_t stack_size)
+{
+}
+
+int mqtt_pub(const char *topic, const char *data, int len, int qos, int retain)
+{
+	pthread_mutex_lock(&answer_lock);
+	if (len == 0) {
+		answered = true;
+		pthread_cond_signal(&answer_done);
+	} else {
+		answer = realloc(answer, (answer_len + len / HISTORY_RECORD_SIZE) * sizeof(*answer));
+		memcpy(answer + answer_len, data, len);
+		answer_len += len / HISTORY_RECORD_SIZE;
+	}
+	pthread_mutex_unlock(&answer_lock);
+	return 0;
+}
+
+/*
+ * @brief Send a query and wait for the empty message that ends it
+ */
+static void query(const char *q)
+{
+	pthread_mutex_lock(&answer_lock);
+	answer_len = 0;
+	answered = false;
+	pthread_mutex_unlock(&answer_lock);
+
+	history_query(q, strlen(q));
+
+	pthread_mutex_lock(&answer_lock);
+	while (!answered) {
+		pthread_cond_wait(&answer_done, &answer_lock);
+	}
+	pthread_mutex_unlock(&answer_lock);
+}
+
+static struct history_record *slot_record(uint32_t slot)
+{
+	return (struct history_record *)(flash + slot * HISTORY_RECORD_SIZE);
+}
+
+static int cmp_seq(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * @brief Sequence numbers of the valid records in flash, in order
+ *
+ * torn is the slot of a record left incomplete by tear(), or slots; once
+ * its sector has been erased and rewritten, it holds a valid one again.
+ */
+static size_t stored(uint32_t *seqs, uint32_t torn)
+{
+	size_t n = 0;
+
+	for (uint32_t i = 0; i < slots; i++) {
+		const struct history_record *r = slot_record(i);
+
+		if (r->seq != SEQ_ERASED && (i != torn || r->crc != 0xffff)) {
+			seqs[n++] = r->seq;
+		}
+	}
+	qsort(seqs, n, sizeof(*seqs), cmp_seq);
+	return n;
+}
+
+static void expect(const char *q, const uint32_t *seqs, size_t n)
+{
+	query(q);
+	for (size_t i = 0; i < n && i < answer_len; i++) {
+		if (answer[i].seq != seqs[i]) {
+			fprintf(stderr, "\"%s\": record %zu is %u, expected %u\n", q, i, answer[i].seq, seqs[i]);
+			exit(1);
+		}
+	}
+	if (answer_len != n) {
+		fprintf(stderr, "\"%s\": %zu records, expected %zu\n", q, answer_len, n);
+		exit(1);
+	}
+}
+
+/*
+ * @brief Ask for everything, a range and the latest, and compare
+ */
+static void check(uint32_t torn)
+{
+	static uint32_t *seqs;
+	char q[32];
+	size_t n, from;
+
+	seqs = realloc(seqs, slots * sizeof(*seqs));
+	query("-1");
+	n = stored(seqs, torn);
+	if (n == 0 || seqs[n - 1] != next_seq - 1) {
+		fprintf(stderr, "newest record is %u, expected %u\n", n ? seqs[n - 1] : 0, next_seq - 1);
+		exit(1);
+	}
+
+	snprintf(q, sizeof(q), "0 %u", slots);
+	expect(q, seqs, n);
+
+	from = n / 3;
+	snprintf(q, sizeof(q), "%u 20", seqs[from]);
+	expect(q, seqs + from, n - from < 20 ? n - from : 20);
+
+	from = n < 10 ? 0 : n - 10;
+	expect("-10", seqs + from, n - from);
+}
+
+/*
+ * @brief Start the log as after a reset; it adds its boot record
+ */
+static void boot(void)
+{
+	history_init();
+	next_seq++;
+}
+
+/*
+ * @brief Log changes until next_seq reaches until
+ *
+ * A query now and then keeps the queue from filling up, which would
+ * drop changes, as it would on the target.
+ */
+static void log_until(uint32_t until)
+{
+	struct panasonic_command old = { .cmd = CMD_STATE, .mode = MODE_COOL, .temp = 20, .fan = FAN_AUTO,
+	                                 .swing = SWING_AUTO, .no_time = true };
+	struct panasonic_command cmd = old;
+
+	while (next_seq < until) {
+		cmd.temp = 16 + next_seq % 14;
+		history_log(SOURCE_MQTT, &old, &cmd);
+		old = cmd;
+		if (++next_seq % (HISTORY_QUEUE_LEN - 1) == 0) {
+			query("-1");
+		}
+	}
+}
+
+/*
+ * @brief Make the newest record look like a write cut short by a reset
+ */
+static uint32_t tear(void)
+{
+	for (uint32_t i = 0; i < slots; i++) {
+		if (slot_record(i)->seq == next_seq - 1) {
+			slot_record(i)->crc = 0xffff;
+			/* The reboot hands its number to the boot record */
+			next_seq--;
+			return i;
+		}
+	}
+	fprintf(stderr, "newest record not in flash\n");
+	exit(1);
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [-s sectors]\n", argv0);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t torn;
+	int sectors = 3;
+	int stops = 0;
+	int c;
+
+	while ((c = getopt(argc, argv, "s:")) != -1) {
+		switch (c) {
+		case 's':
+			sectors = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc || sectors < 2) {
+		usage(argv[0]);
+	}
+
+	part.size = sectors * SPI_FLASH_SEC_SIZE;
+	slots = sectors * SLOTS_PER_SECTOR;
+	flash = malloc(part.size);
+	memset(flash, 0xff, part.size);
+
+	boot();
+	check(slots);
+
+	for (uint32_t s = SLOTS_PER_SECTOR; s <= 4 * slots; s += SLOTS_PER_SECTOR) {
+		for (uint32_t until = s - 1; until <= s + 1; until++) {
+			log_until(until);
+			check(slots);
+			if (++stops % 4 == 0) {
+				boot();
+				check(slots);
+			}
+		}
+	}
+	printf("ring     %u records in %d sectors, %d stops, %u records logged\n", slots, sectors, stops, next_seq);
+
+	torn = tear();
+	boot();
+	check(torn);
+	log_until(next_seq + SLOTS_PER_SECTOR);
+	check(torn);
+	printf("torn     newest record skipped after a reboot\n");
+	return 0;
+}
@@ -0,0 +1,19 @@
+#ifndef HOST_ESP_ERR_H
+#define HOST_ESP_ERR_H
+
+/* Host stand-in for the ESP-IDF error codes */
+
+typedef int esp_err_t;
+
+#define ESP_OK                0
+#define ESP_FAIL              -1
+#define ESP_ERR_INVALID_ARG   0x102
+#define ESP_ERR_INVALID_SIZE  0x104
+
+static inline const char *esp_err_to_name(esp_err_t err)
+{
+	return err == ESP_OK ? "ESP_OK" : err == ESP_ERR_INVALID_ARG ? "ESP_ERR_INVALID_ARG" :
+	       err == ESP_ERR_INVALID_SIZE ? "ESP_ERR_INVALID_SIZE" : "ESP_FAIL";
+}
+
+#endif /* HOST_ESP_ERR_H */
@@ -0,0 +1,93 @@
+#ifndef HOST_QUEUE_H
+#define HOST_QUEUE_H
+
+/* FreeRTOS queues on a pthread mutex and condition variable */
+
+#include "FreeRTOS.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct host_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	UBaseType_t len;
+	UBaseType_t item_size;
+	UBaseType_t head;
+	UBaseType_t count;
+	unsigned char data[];
+};
+
+typedef struct host_queue *QueueHandle_t;
+
+static inline QueueHandle_t xQueueCreate(UBaseType_t len, UBaseType_t item_size)
+{
+	QueueHandle_t q = calloc(1, sizeof(*q) + len * item_size);
+
+	if (q != NULL) {
+		pthread_mutex_init(&q->lock, NULL);
+		pthread_cond_init(&q->changed, NULL);
+		q->len = len;
+		q->item_size = item_size;
+	}
+	return q;
+}
+
+/*
+ * @brief Wait on the queue's condition until ticks (milliseconds) pass;
+ * returns false on timeout
+ */
+static inline int host_queue_wait(QueueHandle_t q, TickType_t ticks)
+{
+	struct timespec ts;
+
+	if (ticks == portMAX_DELAY) {
+		pthread_cond_wait(&q->changed, &q->lock);
+		return 1;
+	}
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += ticks / 1000;
+	ts.tv_nsec += ticks % 1000 * 1000000L;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+	return pthread_cond_timedwait(&q->changed, &q->lock, &ts) != ETIMEDOUT;
+}
+
+static inline BaseType_t xQueueSend(QueueHandle_t q, const void *item, TickType_t ticks)
+{
+	pthread_mutex_lock(&q->lock);
+	while (q->count == q->len) {
+		if (ticks == 0 || !host_queue_wait(q, ticks)) {
+			pthread_mutex_unlock(&q->lock);
+			return pdFALSE;
+		}
+	}
+	memcpy(q->data + (q->head + q->count) % q->len * q->item_size, item, q->item_size);
+	q->count++;
+	pthread_cond_broadcast(&q->changed);
+	pthread_mutex_unlock(&q->lock);
+	return pdTRUE;
+}
+
+static inline BaseType_t xQueueReceive(QueueHandle_t q, void *item, TickType_t ticks)
+{
+	pthread_mutex_lock(&q->lock);
+	while (q->count == 0) {
+		if (ticks == 0 || !host_queue_wait(q, ticks)) {
+			pthread_mutex_unlock(&q->lock);
+			return pdFALSE;
+		}
+	}
+	memcpy(item, q->data + q->head * q->item_size, q->item_size);
+	q->head = (q->head + 1) % q->len;
+	q->count--;
+	pthread_cond_broadcast(&q->changed);
+	pthread_mutex_unlock(&q->lock);
+	return pdTRUE;
+}
+
+#endif /* HOST_QUEUE_H */
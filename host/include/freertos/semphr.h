@@ -0,0 +1,33 @@
+#ifndef HOST_SEMPHR_H
+#define HOST_SEMPHR_H
+
+/* FreeRTOS mutexes mapped onto pthreads */
+
+#include "FreeRTOS.h"
+#include <pthread.h>
+#include <stdlib.h>
+
+typedef pthread_mutex_t *SemaphoreHandle_t;
+
+static inline SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+	SemaphoreHandle_t m = malloc(sizeof(*m));
+
+	if (m != NULL) {
+		pthread_mutex_init(m, NULL);
+	}
+	return m;
+}
+
+static inline BaseType_t xSemaphoreTake(SemaphoreHandle_t m, TickType_t ticks)
+{
+	(void)ticks;
+	return pthread_mutex_lock(m) == 0 ? pdTRUE : pdFALSE;
+}
+
+static inline BaseType_t xSemaphoreGive(SemaphoreHandle_t m)
+{
+	return pthread_mutex_unlock(m) == 0 ? pdTRUE : pdFALSE;
+}
+
+#endif /* HOST_SEMPHR_H */
@@ -0,0 +1,56 @@
+#ifndef HOST_TASK_H
+#define HOST_TASK_H
+
+/* Task handles, and tasks run as detached pthreads */
+
+#include "FreeRTOS.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+typedef void *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+
+struct host_task {
+	TaskFunction_t fn;
+	void *arg;
+};
+
+static inline void *host_task_run(void *p)
+{
+	struct host_task t = *(struct host_task *)p;
+
+	free(p);
+	t.fn(t.arg);
+	return NULL;
+}
+
+static inline BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack_size,
+                                     void *arg, UBaseType_t priority, TaskHandle_t *handle)
+{
+	struct host_task *t = malloc(sizeof(*t));
+	pthread_t thread;
+
+	(void)name;
+	(void)stack_size;
+	(void)priority;
+	if (handle != NULL) {
+		*handle = NULL;
+	}
+	if (t == NULL) {
+		return pdFALSE;
+	}
+	t->fn = fn;
+	t->arg = arg;
+	if (pthread_create(&thread, NULL, host_task_run, t) != 0) {
+		free(t);
+		return pdFALSE;
+	}
+	pthread_detach(thread);
+	if (handle != NULL) {
+		*handle = (TaskHandle_t)thread;
+	}
+	return pdTRUE;
+}
+
+#endif /* HOST_TASK_H */
@@ -0,0 +1,728 @@
+/* Fleet load test: many simulated proxies against one MQTT broker
+
+   Each simulated proxy runs the same connect sequence as the firmware's
+   MQTT_EVENT_CONNECTED handler (subscriptions followed by the retained
+   discovery message), publishes IR-originated state changes at random
+   intervals and echoes state after every /set command it receives.
+   State goes out retained at QoS 1, at most STATE_PUB_INFLIGHT publishes
+   unacknowledged, as from mqtt_pub_state(). On its first connect a proxy
+   reads its retained state back from the broker, as after a reboot, and
+   on a reconnect it publishes its state again. A
+   single controller connection plays Home Assistant: it sends /set
+   commands and times how long it takes for the state echo to come back.
+
+   Point it at a local broker only; it publishes (and afterwards clears)
+   retained discovery, availability and state topics for every simulated
+   proxy.
+
+     ./loadtest -n 2000 -i 10 -r 200 -d 60 -R
+*/
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "mqtt_lite.h"
+#include "mqtt_topics.h"
+#include "panasonic_state.h"
+
+#define ID_BASE 0xfe0000000000ull
+#define SW_VERSION "loadtest"
+
+/* As in mqtt.c */
+#define STATE_PUB_INFLIGHT 2
+
+int host_log_level = 1;
+
+enum conn_kind {
+	CONN_PROXY,
+	CONN_CONTROLLER,
+};
+
+struct conn {
+	struct mqtt_lite m;
+	enum conn_kind kind;
+	bool pollout;
+};
+
+struct proxy {
+	struct conn conn;
+	char id[13];
+	struct panasonic_command state;
+	bool state_known;               /*!< Read back or published, as panasonic_state_known() */
+	bool state_sync;                /*!< Subscribed to its own state topic */
+	bool state_pending;             /*!< A state waits for a free slot */
+	uint16_t state_inflight[STATE_PUB_INFLIGHT];
+	int subacks;
+	int subscriptions;
+	bool ready;
+	bool failed;
+	uint64_t open_us;
+	uint64_t next_ir_us;
+	uint64_t echo_us;
+	uint64_t cmd_us;
+	uint64_t ping_us;
+	int cmd_temp;
+};
+
+struct samples {
+	uint32_t *v;
+	size_t n;
+	size_t size;
+};
+
+static struct {
+	const char *host;
+	const char *port;
+	int proxies;
+	double ir_interval;
+	double set_rate;
+	double duration;
+	int tx_delay_ms;
+	int keepalive;
+	bool reconnect;
+	bool mqtt5;
+} opt = {
+	.host = "127.0.0.1",
+	.port = "1883",
+	.proxies = 100,
+	.ir_interval = 30,
+	.set_rate = 10,
+	.duration = 30,
+	.tx_delay_ms = 0,
+	.keepalive = 4,
+};
+
+static int epfd;
+static struct addrinfo *broker;
+static struct proxy *proxies;
+static struct conn controller;
+static int ready_count;
+static int failed_count;
+static bool shutting_down;
+
+static struct samples connect_lat;
+static struct samples echo_lat;
+static uint64_t proxy_pubs;
+static uint64_t ctl_rx;
+static uint64_t ctl_cmds;
+static uint64_t lost_cmds;
+
+/* The firmware is linked in for its JSON format only */
+int mqtt_pub(const char *topic, const char *data, int len, int qos, int retain)
+{
+	return 0;
+}
+
+int mqtt_pub_state(const char *data, int len)
+{
+	return 0;
+}
+
+int panasonic_transmit(const struct panasonic_command *cmd)
+{
+	return 0;
+}
+
+int panasonic_transmit_list(const struct panasonic_command *cmds, int count)
+{
+	return 0;
+}
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sample_add(struct samples *s, uint64_t v)
+{
+	if (s->n == s->size) {
+		s->size = s->size ? s->size * 2 : 1024;
+		s->v = realloc(s->v, s->size * sizeof(*s->v));
+		if (s->v == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	s->v[s->n++] = v > UINT32_MAX ? UINT32_MAX : v;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void sample_report(const char *name, struct samples *s)
+{
+	if (s->n == 0) {
+		printf("%-16s no samples\n", name);
+		return;
+	}
+
+	qsort(s->v, s->n, sizeof(*s->v), cmp_u32);
+#define PCT(p) (s->v[(size_t)((s->n - 1) * (p) / 100.0)] / 1000.0)
+	printf("%-16s n=%zu p50=%.2fms p90=%.2fms p99=%.2fms p99.9=%.2fms max=%.2fms\n",
+	       name, s->n, PCT(50), PCT(90), PCT(99), PCT(99.9), s->v[s->n - 1] / 1000.0);
+#undef PCT
+	s->n = 0;
+}
+
+static double frand(void)
+{
+	return rand() / (RAND_MAX + 1.0);
+}
+
+static void conn_update(struct conn *c)
+{
+	struct epoll_event ev = { .data.ptr = c };
+	int ret;
+
+	if (c->m.fd < 0) {
+		return;
+	}
+
+	ret = mqtt_lite_flush(&c->m);
+	if (ret < 0) {
+		return;
+	}
+	if ((ret > 0) != c->pollout) {
+		c->pollout = ret > 0;
+		ev.events = EPOLLIN | (c->pollout ? EPOLLOUT : 0);
+		epoll_ctl(epfd, EPOLL_CTL_MOD, c->m.fd, &ev);
+	}
+}
+
+/*
+ * @brief Publish the pending state if a slot is free, as state_pub_flush()
+ */
+static void proxy_state_flush(struct proxy *p)
+{
+	char topic[32];
+	char s[100];
+	int len, id;
+
+	for (int i = 0; i < STATE_PUB_INFLIGHT; i++) {
+		if (!p->state_pending || p->state_inflight[i] != 0) {
+			continue;
+		}
+		len = panasonic_state_to_json(s, sizeof(s), &p->state);
+		snprintf(topic, sizeof(topic), TOPIC_PREFIX"%s", p->id);
+		id = mqtt_lite_publish(&p->conn.m, topic, s, len, 1, true);
+		if (id > 0) {
+			p->state_inflight[i] = id;
+			p->state_pending = false;
+			proxy_pubs++;
+			p->ping_us = now_us() + opt.keepalive * 1000000ull;
+		}
+		return;
+	}
+}
+
+/*
+ * @brief Publish the state, or replace one waiting for a slot
+ */
+static void proxy_publish_state(struct proxy *p)
+{
+	p->state_known = true;
+	p->state_pending = true;
+	proxy_state_flush(p);
+}
+
+static void proxy_on_connack(struct mqtt_lite *m, int rc, bool session_present)
+{
+	struct proxy *p = m->priv;
+	char topic[64];
+	char buf[MQTT_DISCOVERY_MAXLEN];
+
+	if (rc != 0) {
+		fprintf(stderr, "%s: CONNACK rc=%d\n", p->id, rc);
+		return;
+	}
+
+	/* Same sequence as mqtt_event_handler_cb() on MQTT_EVENT_CONNECTED */
+	snprintf(topic, sizeof(topic), TOPIC_PREFIX"%s"AVAILABILITY_TOPIC, p->id);
+	mqtt_lite_publish(m, topic, AVAILABILITY_ONLINE, -1, 1, true);
+
+	p->subscriptions = 3 + mqtt_set_topic_count;
+	if (!p->state_known) {
+		p->state_sync = true;
+		p->subscriptions++;
+		snprintf(topic, sizeof(topic), TOPIC_PREFIX"%s", p->id);
+		mqtt_lite_subscribe(m, topic, 1);
+	}
+
+	mqtt_lite_subscribe(m, TOPIC_PREFIX"restart", 0);
+	for (size_t i = 0; i < mqtt_set_topic_count; i++) {
+		snprintf(topic, sizeof(topic), TOPIC_PREFIX"%s%s", p->id, mqtt_set_topics[i]);
+		mqtt_lite_subscribe(m, topic, 0);
+	}
+	snprintf(topic, sizeof(topic), TOPIC_PREFIX"%s"COMMAND_SET_TOPIC, p->id);
+	mqtt_lite_subscribe(m, topic, 0);
+	snprintf(topic, sizeof(topic), TOPIC_PREFIX"%s"OTA_TOPIC, p->id);
+	mqtt_lite_subscribe(m, topic, 0);
+
+	if (p->state_known) {
+		proxy_publish_state(p);
+	}
+
+	mqtt_discovery_topic(topic, sizeof(topic), p->id);
+	mqtt_discovery_payload(buf, sizeof(buf), p->id, SW_VERSION);
+	mqtt_lite_publish(m, topic, buf, -1, 0, true);
+}
+
+static void proxy_on_suback(struct mqtt_lite *m, uint16_t id)
+{
+	struct proxy *p = m->priv;
+
+	if (++p->subacks == p->subscriptions && !p->ready) {
+		p->ready = true;
+		ready_count++;
+		sample_add(&connect_lat, now_us() - p->open_us);
+	}
+}
+
+static void proxy_on_puback(struct mqtt_lite *m, uint16_t id)
+{
+	struct proxy *p = m->priv;
+
+	for (int i = 0; i < STATE_PUB_INFLIGHT; i++) {
+		if (p->state_inflight[i] == id) {
+			p->state_inflight[i] = 0;
+		}
+	}
+	proxy_state_flush(p);
+}
+
+static void proxy_on_publish(struct mqtt_lite *m, const char *topic, size_t topic_len,
+                             const uint8_t *payload, size_t len, int qos, bool retain)
+{
+	struct proxy *p = m->priv;
+	struct mqtt_set_request req;
+	struct mqtt_set_request reqs[MQTT_SET_FIELDS];
+	char state_topic[32];
+
+	snprintf(state_topic, sizeof(state_topic), TOPIC_PREFIX"%s", p->id);
+	if (p->state_sync && topic_len == strlen(state_topic) && memcmp(topic, state_topic, topic_len) == 0) {
+		/* As state_sync_receive(): take over the first state, then stop listening */
+		if (mqtt_parse_state(reqs, (const char *)payload, len) == MQTT_SET_FIELDS) {
+			for (int i = 0; i < MQTT_SET_FIELDS; i++) {
+				panasonic_apply_set(&p->state, &reqs[i]);
+			}
+			p->state_known = true;
+		}
+		p->state_sync = false;
+		mqtt_lite_unsubscribe(m, state_topic);
+	} else if (mqtt_parse_set(&req, topic, topic_len, (const char *)payload, len) > 0) {
+		panasonic_apply_set(&p->state, &req);
+		/* The real proxy blocks on IR airtime before publishing */
+		p->echo_us = now_us() + opt.tx_delay_ms * 1000;
+	}
+}
+
+static void controller_on_publish(struct mqtt_lite *m, const char *topic, size_t topic_len,
+                                  const uint8_t *payload, size_t len, int qos, bool retain)
+{
+	const size_t prefix = sizeof(TOPIC_PREFIX) - 1;
+	char id[13];
+	char expect[32];
+	struct proxy *p;
+	uint64_t n;
+
+	if (retain || topic_len != prefix + 12) {
+		return;
+	}
+	ctl_rx++;
+
+	memcpy(id, topic + prefix, 12);
+	id[12] = '\0';
+	n = strtoull(id, NULL, 16) - ID_BASE;
+	if (n >= (uint64_t)opt.proxies) {
+		return;
+	}
+	p = &proxies[n];
+	if (p->cmd_us == 0) {
+		return;
+	}
+
+	snprintf(expect, sizeof(expect), "\"temperature\":\"%d\"", p->cmd_temp);
+	if (memmem(payload, len, expect, strlen(expect)) != NULL) {
+		sample_add(&echo_lat, now_us() - p->cmd_us);
+		p->cmd_us = 0;
+	}
+}
+
+static void conn_open(struct conn *c, const char *client_id, const struct mqtt_lite_will *will)
+{
+	struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT, .data.ptr = c };
+
+	if (mqtt_lite_open(&c->m, broker) < 0) {
+		perror("connect");
+		exit(1);
+	}
+	c->pollout = true;
+	mqtt_lite_send_connect(&c->m, client_id, will ? opt.keepalive : 60, true, will);
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, c->m.fd, &ev) < 0) {
+		perror("epoll_ctl");
+		exit(1);
+	}
+}
+
+static void controller_open(void)
+{
+	conn_open(&controller, "loadtest-controller", NULL);
+	mqtt_lite_subscribe(&controller.m, TOPIC_PREFIX"+", 0);
+}
+
+static bool controller_connected(void)
+{
+	return controller.m.connected;
+}
+
+static void proxy_open(struct proxy *p)
+{
+	char client_id[32];
+	char topic[40];
+	struct mqtt_lite_will will = {
+		.topic = topic,
+		.msg = AVAILABILITY_OFFLINE,
+		.len = sizeof(AVAILABILITY_OFFLINE) - 1,
+		.qos = 1,
+		.retain = true,
+	};
+
+	snprintf(client_id, sizeof(client_id), "loadtest-%s", p->id);
+	snprintf(topic, sizeof(topic), TOPIC_PREFIX"%s"AVAILABILITY_TOPIC, p->id);
+	p->subacks = 0;
+	p->state_sync = false;
+	/* esp-mqtt would resend these from its outbox; the newest state goes out again instead */
+	memset(p->state_inflight, 0, sizeof(p->state_inflight));
+	p->ready = false;
+	p->failed = false;
+	p->cmd_us = 0;
+	p->echo_us = 0;
+	p->open_us = now_us();
+	p->ping_us = p->open_us + opt.keepalive * 1000000ull;
+	conn_open(&p->conn, client_id, &will);
+}
+
+static void conn_fail(struct conn *c)
+{
+	epoll_ctl(epfd, EPOLL_CTL_DEL, c->m.fd, NULL);
+	mqtt_lite_close(&c->m);
+
+	if (c->kind == CONN_CONTROLLER) {
+		if (shutting_down) {
+			return;
+		}
+		/* Refused at level 5, mqtt_lite has dropped to 3.1.1 */
+		if (opt.mqtt5 && c->m.version != 5 && proxies == NULL) {
+			fprintf(stderr, "no MQTT 5 at the broker, falling back to 3.1.1\n");
+			controller_open();
+			return;
+		}
+		fprintf(stderr, "controller connection lost\n");
+		exit(1);
+	}
+
+	struct proxy *p = c->m.priv;
+	if (p->ready) {
+		ready_count--;
+	}
+	p->ready = false;
+	if (!p->failed) {
+		p->failed = true;
+		failed_count++;
+	}
+}
+
+/*
+ * @brief Run the event loop until the deadline or until cond() is true
+ */
+static void run(uint64_t deadline, bool (*cond)(void), void (*tick)(uint64_t now))
+{
+	struct epoll_event events[256];
+
+	while (now_us() < deadline && (cond == NULL || !cond())) {
+		int n = epoll_wait(epfd, events, sizeof(events) / sizeof(events[0]), 1);
+
+		if (n < 0 && errno != EINTR) {
+			perror("epoll_wait");
+			exit(1);
+		}
+		for (int i = 0; i < n; i++) {
+			struct conn *c = events[i].data.ptr;
+
+			if (c->m.fd < 0) {
+				continue;
+			}
+			if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+				conn_fail(c);
+				continue;
+			}
+			if ((events[i].events & EPOLLIN) && mqtt_lite_read(&c->m) < 0) {
+				conn_fail(c);
+				continue;
+			}
+			conn_update(c);
+		}
+
+		if (tick) {
+			tick(now_us());
+		}
+	}
+}
+
+static bool all_ready(void)
+{
+	return ready_count + failed_count >= opt.proxies;
+}
+
+static void connect_storm(const char *name)
+{
+	uint64_t start = now_us();
+
+	ready_count = 0;
+	failed_count = 0;
+	for (int i = 0; i < opt.proxies; i++) {
+		proxy_open(&proxies[i]);
+	}
+	run(start + 60 * 1000000ull, all_ready, NULL);
+
+	printf("%s: %d/%d proxies subscribed in %.3f s, %d failed\n",
+	       name, ready_count, opt.proxies, (now_us() - start) / 1e6, failed_count);
+	sample_report("connect", &connect_lat);
+}
+
+static uint64_t steady_start;
+
+static void steady_tick(uint64_t now)
+{
+	for (int i = 0; i < opt.proxies; i++) {
+		struct proxy *p = &proxies[i];
+
+		if (!p->ready) {
+			continue;
+		}
+		if (p->echo_us != 0 && now >= p->echo_us) {
+			p->echo_us = 0;
+			proxy_publish_state(p);
+			conn_update(&p->conn);
+		}
+		if (now >= p->next_ir_us) {
+			/* Someone used the remote; leave the temperature alone so it
+			 * cannot be mistaken for a command echo. */
+			p->state.fan = (enum fan[]){ FAN_AUTO, FAN_1, FAN_3, FAN_5 }[rand() % 4];
+			p->state.swing = (enum swing[]){ SWING_AUTO, SWING_1, SWING_3, SWING_5 }[rand() % 4];
+			p->next_ir_us = now + (uint64_t)(opt.ir_interval * 2e6 * frand());
+			proxy_publish_state(p);
+			conn_update(&p->conn);
+		}
+		if (now >= p->ping_us) {
+			p->ping_us = now + opt.keepalive * 1000000ull;
+			mqtt_lite_ping(&p->conn.m);
+			conn_update(&p->conn);
+		}
+	}
+
+	uint64_t due = (now - steady_start) * opt.set_rate / 1e6;
+	while (ctl_cmds < due) {
+		struct proxy *p = &proxies[rand() % opt.proxies];
+		char topic[64];
+		char s[8];
+
+		ctl_cmds++;
+		if (!p->ready) {
+			continue;
+		}
+		if (p->cmd_us != 0) {
+			lost_cmds++;
+		}
+		p->cmd_temp = p->state.temp == 20 ? 24 : 20 + rand() % 10;
+		p->cmd_us = now;
+		snprintf(topic, sizeof(topic), TOPIC_PREFIX"%s/temperature/set", p->id);
+		snprintf(s, sizeof(s), "%d", p->cmd_temp);
+		mqtt_lite_publish(&controller.m, topic, s, -1, 0, false);
+	}
+	conn_update(&controller);
+}
+
+static void steady_state(void)
+{
+	uint64_t proxy_tx = 0, proxy_rx = 0;
+	uint64_t ctl_tx = -controller.m.tx_bytes;
+
+	steady_start = now_us();
+	for (int i = 0; i < opt.proxies; i++) {
+		proxies[i].next_ir_us = steady_start + (uint64_t)(opt.ir_interval * 1e6 * frand());
+		proxy_tx -= proxies[i].conn.m.tx_bytes;
+		proxy_rx -= proxies[i].conn.m.rx_bytes;
+	}
+	proxy_pubs = ctl_rx = ctl_cmds = lost_cmds = 0;
+
+	run(steady_start + (uint64_t)(opt.duration * 1e6), NULL, steady_tick);
+
+	for (int i = 0; i < opt.proxies; i++) {
+		proxy_tx += proxies[i].conn.m.tx_bytes;
+		proxy_rx += proxies[i].conn.m.rx_bytes;
+	}
+	ctl_tx += controller.m.tx_bytes;
+
+	double secs = (now_us() - steady_start) / 1e6;
+	printf("steady state: %.1f s\n", secs);
+	printf("  proxy publishes  %" PRIu64 " (%.1f/s), controller received %" PRIu64 " (%.1f/s)\n",
+	       proxy_pubs, proxy_pubs / secs, ctl_rx, ctl_rx / secs);
+	printf("  commands sent    %" PRIu64 " (%.1f/s), superseded before echo %" PRIu64 "\n",
+	       ctl_cmds, ctl_cmds / secs, lost_cmds);
+	printf("  proxy bytes      tx %.1f kB/s, rx %.1f kB/s\n",
+	       proxy_tx / secs / 1e3, proxy_rx / secs / 1e3);
+	/* Includes keepalives and acknowledgements */
+	printf("  bytes/message    proxy tx %.1f per publish, controller tx %.1f per command\n",
+	       proxy_pubs ? (double)proxy_tx / proxy_pubs : 0.0, ctl_cmds ? (double)ctl_tx / ctl_cmds : 0.0);
+	sample_report("command->echo", &echo_lat);
+}
+
+static void disconnect_all(void)
+{
+	for (int i = 0; i < opt.proxies; i++) {
+		struct conn *c = &proxies[i].conn;
+
+		if (c->m.fd >= 0) {
+			epoll_ctl(epfd, EPOLL_CTL_DEL, c->m.fd, NULL);
+			mqtt_lite_close(&c->m);
+		}
+		proxies[i].ready = false;
+	}
+	ready_count = 0;
+}
+
+static void clear_retained(void)
+{
+	char topic[64];
+
+	for (int i = 0; i < opt.proxies; i++) {
+		mqtt_discovery_topic(topic, sizeof(topic), proxies[i].id);
+		mqtt_lite_publish(&controller.m, topic, "", 0, 0, true);
+		snprintf(topic, sizeof(topic), TOPIC_PREFIX"%s"AVAILABILITY_TOPIC, proxies[i].id);
+		mqtt_lite_publish(&controller.m, topic, "", 0, 0, true);
+		snprintf(topic, sizeof(topic), TOPIC_PREFIX"%s", proxies[i].id);
+		mqtt_lite_publish(&controller.m, topic, "", 0, 0, true);
+	}
+	mqtt_lite_disconnect(&controller.m);
+	shutting_down = true;
+	conn_update(&controller);
+	run(now_us() + 1000000, NULL, NULL);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+	        "usage: %s [options]\n"
+	        "  -H host     broker host (%s)\n"
+	        "  -p port     broker port (%s)\n"
+	        "  -n count    number of simulated proxies (%d)\n"
+	        "  -i seconds  mean interval between IR state changes per proxy (%g)\n"
+	        "  -r rate     /set commands per second across the fleet (%g)\n"
+	        "  -d seconds  steady state duration (%g)\n"
+	        "  -t ms       simulated IR transmit time before the state echo (%d)\n"
+	        "  -k seconds  proxy keepalive, as CONFIG_MQTT_KEEPALIVE (%d)\n"
+	        "  -R          drop all connections afterwards and measure a reconnect storm\n"
+	        "  -5          MQTT 5 with topic aliases, falling back to 3.1.1\n"
+	        "  -v          verbose logging\n",
+	        prog, opt.host, opt.port, opt.proxies, opt.ir_interval, opt.set_rate,
+	        opt.duration, opt.tx_delay_ms, opt.keepalive);
+	exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+	struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+	struct rlimit rl;
+	int c;
+
+	while ((c = getopt(argc, argv, "H:p:n:i:r:d:t:k:R5v")) != -1) {
+		switch (c) {
+		case 'H': opt.host = optarg; break;
+		case 'p': opt.port = optarg; break;
+		case 'n': opt.proxies = atoi(optarg); break;
+		case 'i': opt.ir_interval = atof(optarg); break;
+		case 'r': opt.set_rate = atof(optarg); break;
+		case 'd': opt.duration = atof(optarg); break;
+		case 't': opt.tx_delay_ms = atoi(optarg); break;
+		case 'k': opt.keepalive = atoi(optarg); break;
+		case 'R': opt.reconnect = true; break;
+		case '5': opt.mqtt5 = true; break;
+		case 'v': host_log_level = 5; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (opt.proxies <= 0 || opt.keepalive <= 0) {
+		usage(argv[0]);
+	}
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+	if (rl.rlim_cur < (rlim_t)opt.proxies + 16) {
+		fprintf(stderr, "warning: file descriptor limit %lu is too low for %d proxies\n",
+		        (unsigned long)rl.rlim_cur, opt.proxies);
+	}
+
+	if ((c = getaddrinfo(opt.host, opt.port, &hints, &broker)) != 0) {
+		fprintf(stderr, "%s: %s\n", opt.host, gai_strerror(c));
+		return 1;
+	}
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	srand(time(NULL));
+
+	controller.kind = CONN_CONTROLLER;
+	controller.m.priv = &controller;
+	controller.m.on_publish = controller_on_publish;
+	controller.m.version = opt.mqtt5 ? 5 : 4;
+	controller_open();
+	/* The proxies speak whatever the controller settled on */
+	run(now_us() + 5000000, controller_connected, NULL);
+
+	proxies = calloc(opt.proxies, sizeof(*proxies));
+	for (int i = 0; i < opt.proxies; i++) {
+		struct proxy *p = &proxies[i];
+
+		snprintf(p->id, sizeof(p->id), "%012" PRIx64, (uint64_t)(ID_BASE + i));
+		p->conn.kind = CONN_PROXY;
+		p->conn.m.fd = -1;
+		p->conn.m.priv = p;
+		p->conn.m.on_connack = proxy_on_connack;
+		p->conn.m.on_suback = proxy_on_suback;
+		p->conn.m.on_puback = proxy_on_puback;
+		p->conn.m.on_publish = proxy_on_publish;
+		p->conn.m.version = controller.m.version;
+		p->state = (struct panasonic_command){
+			.cmd = CMD_STATE, .on = true, .mode = MODE_HEAT, .temp = 21,
+			.fan = FAN_AUTO, .swing = SWING_AUTO,
+		};
+	}
+
+	connect_storm("connect storm");
+	steady_state();
+
+	if (opt.reconnect) {
+		disconnect_all();
+		connect_storm("reconnect storm");
+	}
+
+	clear_retained();
+	freeaddrinfo(broker);
+	return 0;
+}
@@ -0,0 +1,633 @@
+#include "mqtt_lite.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+enum {
+	CONNECT     = 1,
+	CONNACK     = 2,
+	PUBLISH     = 3,
+	PUBACK      = 4,
+	SUBSCRIBE   = 8,
+	SUBACK      = 9,
+	UNSUBSCRIBE = 10,
+	UNSUBACK    = 11,
+	PINGREQ     = 12,
+	PINGRESP    = 13,
+	DISCONNECT  = 14,
+};
+
+/* MQTT 5 properties used here */
+enum {
+	PROP_RESPONSE_TOPIC     = 0x08,
+	PROP_CORRELATION_DATA   = 0x09,
+	PROP_TOPIC_ALIAS_MAX    = 0x22,
+	PROP_TOPIC_ALIAS        = 0x23,
+};
+
+#define RC_BAD_VERSION          0x01    /*!< CONNACK of a 3.1.1 broker to a level 5 CONNECT */
+#define RC_BAD_VERSION_5        0x84
+
+struct props {
+	uint16_t topic_alias;
+	uint16_t topic_alias_max;
+	const uint8_t *response_topic;
+	size_t response_topic_len;
+	const uint8_t *correlation;
+	size_t correlation_len;
+};
+
+static int reserve(struct mqtt_lite *c, size_t len)
+{
+	if (c->out_len + len <= c->out_size) {
+		return 0;
+	}
+
+	size_t size = c->out_size ? c->out_size : 256;
+	while (size < c->out_len + len) {
+		size *= 2;
+	}
+
+	uint8_t *out = realloc(c->out, size);
+	if (out == NULL) {
+		return -1;
+	}
+	c->out = out;
+	c->out_size = size;
+	return 0;
+}
+
+static void put_u8(struct mqtt_lite *c, uint8_t v)
+{
+	c->out[c->out_len++] = v;
+}
+
+static void put_u16(struct mqtt_lite *c, uint16_t v)
+{
+	put_u8(c, v >> 8);
+	put_u8(c, v);
+}
+
+static void put_bytes(struct mqtt_lite *c, const void *data, size_t len)
+{
+	memcpy(c->out + c->out_len, data, len);
+	c->out_len += len;
+}
+
+static void put_string(struct mqtt_lite *c, const char *s, size_t len)
+{
+	put_u16(c, len);
+	put_bytes(c, s, len);
+}
+
+static void put_varint(struct mqtt_lite *c, size_t v)
+{
+	do {
+		uint8_t b = v & 0x7F;
+		v >>= 7;
+		put_u8(c, b | (v ? 0x80 : 0));
+	} while (v);
+}
+
+static size_t varint_len(size_t v)
+{
+	return v < 128 ? 1 : v < 16384 ? 2 : v < 2097152 ? 3 : 4;
+}
+
+/*
+ * @brief Reserve room for a packet and write its fixed header
+ */
+static int put_header(struct mqtt_lite *c, uint8_t type, size_t remaining)
+{
+	if (remaining > 268435455 || reserve(c, 5 + remaining) < 0) {
+		return -1;
+	}
+
+	put_u8(c, type);
+	put_varint(c, remaining);
+	return 0;
+}
+
+static int get_varint(const uint8_t *p, size_t len, size_t *pos, size_t *v)
+{
+	int shift = 0;
+	uint8_t b;
+
+	*v = 0;
+	do {
+		if (*pos >= len || shift > 21) {
+			return -1;
+		}
+		b = p[(*pos)++];
+		*v |= (size_t)(b & 0x7F) << shift;
+		shift += 7;
+	} while (b & 0x80);
+	return 0;
+}
+
+/*
+ * @brief Parse the properties at p[*pos], keeping the ones used here
+ */
+static int get_props(const uint8_t *p, size_t len, size_t *pos, struct props *props)
+{
+	size_t end;
+	size_t n;
+
+	memset(props, 0, sizeof(*props));
+	if (get_varint(p, len, pos, &n) < 0 || n > len - *pos) {
+		return -1;
+	}
+	end = *pos + n;
+
+	while (*pos < end) {
+		uint8_t id = p[(*pos)++];
+		size_t size;
+
+		switch (id) {
+		case 0x01: case 0x17: case 0x19: case 0x24: case 0x25: case 0x28: case 0x29: case 0x2A:
+			size = 1;
+			break;
+		case 0x13: case PROP_TOPIC_ALIAS_MAX: case PROP_TOPIC_ALIAS: case 0x21:
+			size = 2;
+			break;
+		case 0x02: case 0x11: case 0x18: case 0x27:
+			size = 4;
+			break;
+		case 0x0B:
+			if (get_varint(p, end, pos, &size) < 0) {
+				return -1;
+			}
+			continue;
+		case 0x26:
+			/* A user property, two strings */
+			for (int i = 0; i < 2; i++) {
+				if (end - *pos < 2 || end - *pos - 2 < (size_t)(p[*pos] << 8 | p[*pos + 1])) {
+					return -1;
+				}
+				*pos += 2 + (p[*pos] << 8 | p[*pos + 1]);
+			}
+			continue;
+		case 0x03: case PROP_RESPONSE_TOPIC: case PROP_CORRELATION_DATA: case 0x12: case 0x15:
+		case 0x16: case 0x1A: case 0x1C: case 0x1F:
+			if (end - *pos < 2) {
+				return -1;
+			}
+			size = 2 + (p[*pos] << 8 | p[*pos + 1]);
+			break;
+		default:
+			return -1;
+		}
+		if (end - *pos < size) {
+			return -1;
+		}
+
+		if (id == PROP_TOPIC_ALIAS) {
+			props->topic_alias = p[*pos] << 8 | p[*pos + 1];
+		} else if (id == PROP_TOPIC_ALIAS_MAX) {
+			props->topic_alias_max = p[*pos] << 8 | p[*pos + 1];
+		} else if (id == PROP_RESPONSE_TOPIC) {
+			props->response_topic = p + *pos + 2;
+			props->response_topic_len = size - 2;
+		} else if (id == PROP_CORRELATION_DATA) {
+			props->correlation = p + *pos + 2;
+			props->correlation_len = size - 2;
+		}
+		*pos += size;
+	}
+	return 0;
+}
+
+static uint16_t next_id(struct mqtt_lite *c)
+{
+	if (++c->next_id == 0) {
+		c->next_id = 1;
+	}
+	return c->next_id;
+}
+
+int mqtt_lite_open(struct mqtt_lite *c, const struct addrinfo *ai)
+{
+	int one = 1;
+
+	c->fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+	if (c->fd < 0) {
+		return -1;
+	}
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	if (connect(c->fd, ai->ai_addr, ai->ai_addrlen) < 0 && errno != EINPROGRESS) {
+		close(c->fd);
+		c->fd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+int mqtt_lite_send_connect(struct mqtt_lite *c, const char *client_id, int keepalive,
+                           bool clean_session, const struct mqtt_lite_will *will)
+{
+	bool v5 = c->version == 5;
+	size_t id_len = strlen(client_id);
+	size_t remaining = 10 + 2 + id_len;
+	uint8_t flags = clean_session ? 0x02 : 0;
+
+	if (v5) {
+		/* The Topic Alias Maximum property, and empty will properties */
+		remaining += 1 + 3 + (will != NULL);
+	}
+	if (will != NULL) {
+		remaining += 2 + strlen(will->topic) + 2 + will->len;
+		flags |= 0x04 | (will->qos << 3) | (will->retain ? 0x20 : 0);
+	}
+
+	if (put_header(c, CONNECT << 4, remaining) < 0) {
+		return -1;
+	}
+	put_string(c, "MQTT", 4);
+	put_u8(c, v5 ? 5 : 4);
+	put_u8(c, flags);
+	put_u16(c, keepalive);
+	if (v5) {
+		put_varint(c, 3);
+		put_u8(c, PROP_TOPIC_ALIAS_MAX);
+		put_u16(c, MQTT_LITE_ALIASES);
+	}
+	put_string(c, client_id, id_len);
+	if (will != NULL) {
+		if (v5) {
+			put_varint(c, 0);
+		}
+		put_string(c, will->topic, strlen(will->topic));
+		put_string(c, will->msg, will->len);
+	}
+
+	return 0;
+}
+
+int mqtt_lite_subscribe(struct mqtt_lite *c, const char *topic, int qos)
+{
+	size_t len = strlen(topic);
+	uint16_t id = next_id(c);
+
+	if (put_header(c, (SUBSCRIBE << 4) | 0x02, 2 + (c->version == 5) + 2 + len + 1) < 0) {
+		return -1;
+	}
+	put_u16(c, id);
+	if (c->version == 5) {
+		put_varint(c, 0);
+	}
+	put_string(c, topic, len);
+	put_u8(c, qos);
+
+	return id;
+}
+
+int mqtt_lite_unsubscribe(struct mqtt_lite *c, const char *topic)
+{
+	size_t len = strlen(topic);
+	uint16_t id = next_id(c);
+
+	if (put_header(c, (UNSUBSCRIBE << 4) | 0x02, 2 + (c->version == 5) + 2 + len) < 0) {
+		return -1;
+	}
+	put_u16(c, id);
+	if (c->version == 5) {
+		put_varint(c, 0);
+	}
+	put_string(c, topic, len);
+
+	return id;
+}
+
+/*
+ * @brief The alias of a topic, assigning the next free one if need be
+ *
+ * Returns 0 if the topic has none and all are taken. *known tells whether
+ * the broker has already seen the alias with the topic.
+ */
+static uint16_t tx_alias(struct mqtt_lite *c, const char *topic, size_t topic_len, bool *known)
+{
+	int max = c->tx_alias_max < MQTT_LITE_ALIASES ? c->tx_alias_max : MQTT_LITE_ALIASES;
+
+	for (int i = 0; i < max; i++) {
+		if (c->tx_alias[i] == NULL) {
+			c->tx_alias[i] = strndup(topic, topic_len);
+			*known = false;
+			return c->tx_alias[i] != NULL ? i + 1 : 0;
+		}
+		if (strlen(c->tx_alias[i]) == topic_len && memcmp(c->tx_alias[i], topic, topic_len) == 0) {
+			*known = true;
+			return i + 1;
+		}
+	}
+	return 0;
+}
+
+static int publish(struct mqtt_lite *c, const char *topic, size_t topic_len, const void *data, int len,
+                   int qos, bool retain, const uint8_t *correlation, size_t correlation_len)
+{
+	uint16_t id = qos > 0 ? next_id(c) : 0;
+	uint16_t alias = 0;
+	bool known = false;
+	size_t props = 0;
+
+	if (len < 0) {
+		len = strlen(data);
+	}
+	if (c->version == 5) {
+		alias = tx_alias(c, topic, topic_len, &known);
+		props = (alias ? 3 : 0) + (correlation != NULL ? 3 + correlation_len : 0);
+		if (known) {
+			topic_len = 0;
+		}
+	}
+
+	if (put_header(c, (PUBLISH << 4) | (qos << 1) | retain, 2 + topic_len + (qos > 0 ? 2 : 0) +
+	               (c->version == 5 ? varint_len(props) + props : 0) + len) < 0) {
+		return -1;
+	}
+	put_string(c, topic, topic_len);
+	if (qos > 0) {
+		put_u16(c, id);
+	}
+	if (c->version == 5) {
+		put_varint(c, props);
+		if (alias) {
+			put_u8(c, PROP_TOPIC_ALIAS);
+			put_u16(c, alias);
+		}
+		if (correlation != NULL) {
+			put_u8(c, PROP_CORRELATION_DATA);
+			put_u16(c, correlation_len);
+			put_bytes(c, correlation, correlation_len);
+		}
+	}
+	put_bytes(c, data, len);
+
+	return id;
+}
+
+int mqtt_lite_publish(struct mqtt_lite *c, const char *topic, const void *data, int len, int qos, bool retain)
+{
+	return publish(c, topic, strlen(topic), data, len, qos, retain, NULL, 0);
+}
+
+/*
+ * @brief Answer the MQTT 5 request being handled, from on_publish
+ *
+ * Goes to its response topic, with its correlation data. Returns -1 if
+ * the PUBLISH carried no response topic.
+ */
+int mqtt_lite_reply(struct mqtt_lite *c, const void *data, int len, int qos)
+{
+	if (c->response_topic == NULL) {
+		return -1;
+	}
+	return publish(c, c->response_topic, c->response_topic_len, data, len, qos, false,
+	               c->correlation, c->correlation_len);
+}
+
+int mqtt_lite_ping(struct mqtt_lite *c)
+{
+	if (put_header(c, PINGREQ << 4, 0) < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+int mqtt_lite_disconnect(struct mqtt_lite *c)
+{
+	if (put_header(c, DISCONNECT << 4, 0) < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+static int handle_packet(struct mqtt_lite *c, uint8_t type, const uint8_t *p, size_t len)
+{
+	switch (type >> 4) {
+	case CONNACK:
+		if (len < 2) {
+			return -1;
+		}
+		c->connected = p[1] == 0;
+		if (c->version == 5 && len > 2) {
+			size_t pos = 2;
+			struct props props;
+
+			if (get_props(p, len, &pos, &props) < 0) {
+				return -1;
+			}
+			c->tx_alias_max = props.topic_alias_max;
+		}
+		if (c->version == 5 && (p[1] == RC_BAD_VERSION || p[1] == RC_BAD_VERSION_5)) {
+			c->version = 4;
+		}
+		if (c->on_connack) {
+			c->on_connack(c, p[1], p[0] & 1);
+		}
+		break;
+	case PUBLISH: {
+		int qos = (type >> 1) & 3;
+		size_t topic_len;
+		uint16_t id = 0;
+
+		if (len < 2) {
+			return -1;
+		}
+		topic_len = (p[0] << 8) | p[1];
+		if (len < 2 + topic_len + (qos > 0 ? 2 : 0)) {
+			return -1;
+		}
+		const char *topic = (const char *)p + 2;
+		p += 2 + topic_len;
+		len -= 2 + topic_len;
+		if (qos > 0) {
+			id = (p[0] << 8) | p[1];
+			p += 2;
+			len -= 2;
+		}
+		if (c->version == 5) {
+			size_t pos = 0;
+			struct props props;
+
+			if (get_props(p, len, &pos, &props) < 0 || props.topic_alias > MQTT_LITE_ALIASES) {
+				return -1;
+			}
+			p += pos;
+			len -= pos;
+
+			if (props.topic_alias != 0 && topic_len > 0) {
+				char **alias = &c->rx_alias[props.topic_alias - 1];
+
+				free(*alias);
+				*alias = strndup(topic, topic_len);
+			} else if (props.topic_alias != 0) {
+				topic = c->rx_alias[props.topic_alias - 1];
+				if (topic == NULL) {
+					return -1;
+				}
+				topic_len = strlen(topic);
+			}
+			c->response_topic = (const char *)props.response_topic;
+			c->response_topic_len = props.response_topic_len;
+			c->correlation = props.correlation;
+			c->correlation_len = props.correlation_len;
+		}
+		if (c->on_publish) {
+			c->on_publish(c, topic, topic_len, p, len, qos, type & 1);
+		}
+		c->response_topic = NULL;
+		c->correlation = NULL;
+		if (qos == 1) {
+			if (put_header(c, PUBACK << 4, 2) < 0) {
+				return -1;
+			}
+			put_u16(c, id);
+		}
+		break;
+	}
+	case PUBACK:
+		if (len >= 2 && c->on_puback) {
+			c->on_puback(c, (p[0] << 8) | p[1]);
+		}
+		break;
+	case SUBACK:
+		if (len >= 2 && c->on_suback) {
+			c->on_suback(c, (p[0] << 8) | p[1]);
+		}
+		break;
+	case UNSUBACK:
+	case PINGRESP:
+		break;
+	default:
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * @brief Read whatever the socket has and dispatch all complete packets
+ *
+ * Returns -1 when the connection is closed or broken.
+ */
+int mqtt_lite_read(struct mqtt_lite *c)
+{
+	for (;;) {
+		if (c->in_size - c->in_len < 1024) {
+			size_t size = c->in_size ? c->in_size * 2 : 4096;
+			uint8_t *in = realloc(c->in, size);
+			if (in == NULL) {
+				return -1;
+			}
+			c->in = in;
+			c->in_size = size;
+		}
+
+		ssize_t n = read(c->fd, c->in + c->in_len, c->in_size - c->in_len);
+		if (n == 0) {
+			return -1;
+		} else if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				break;
+			} else if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		c->in_len += n;
+		c->rx_bytes += n;
+	}
+
+	size_t pos = 0;
+	while (pos + 2 <= c->in_len) {
+		size_t remaining = 0;
+		size_t hdr = 1;
+		int shift = 0;
+		uint8_t b;
+
+		do {
+			if (pos + hdr >= c->in_len || shift > 21) {
+				goto incomplete;
+			}
+			b = c->in[pos + hdr++];
+			remaining |= (size_t)(b & 0x7F) << shift;
+			shift += 7;
+		} while (b & 0x80);
+
+		if (pos + hdr + remaining > c->in_len) {
+			break;
+		}
+		if (handle_packet(c, c->in[pos], c->in + pos + hdr, remaining) < 0) {
+			return -1;
+		}
+		pos += hdr + remaining;
+	}
+incomplete:
+	memmove(c->in, c->in + pos, c->in_len - pos);
+	c->in_len -= pos;
+
+	return 0;
+}
+
+/*
+ * @brief Write queued output
+ *
+ * Returns 1 if data is still pending, 0 if all was written, -1 on error.
+ */
+int mqtt_lite_flush(struct mqtt_lite *c)
+{
+	size_t pos = 0;
+
+	while (pos < c->out_len) {
+		ssize_t n = send(c->fd, c->out + pos, c->out_len - pos, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOTCONN) {
+				break;
+			} else if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		pos += n;
+		c->tx_bytes += n;
+	}
+	memmove(c->out, c->out + pos, c->out_len - pos);
+	c->out_len -= pos;
+
+	return c->out_len > 0;
+}
+
+bool mqtt_lite_want_write(const struct mqtt_lite *c)
+{
+	return c->out_len > 0;
+}
+
+void mqtt_lite_close(struct mqtt_lite *c)
+{
+	if (c->fd >= 0) {
+		close(c->fd);
+	}
+	c->fd = -1;
+	c->connected = false;
+	c->in_len = 0;
+	c->out_len = 0;
+
+	/* Aliases last as long as the connection */
+	c->tx_alias_max = 0;
+	for (int i = 0; i < MQTT_LITE_ALIASES; i++) {
+		free(c->tx_alias[i]);
+		free(c->rx_alias[i]);
+		c->tx_alias[i] = NULL;
+		c->rx_alias[i] = NULL;
+	}
+}
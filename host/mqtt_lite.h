@@ -0,0 +1,83 @@
+#ifndef MQTT_LITE_H
+#define MQTT_LITE_H
+
+/* Minimal non-blocking MQTT 3.1.1 and 5 client for the host tools
+
+   One struct mqtt_lite per connection, driven from an external event loop:
+   call mqtt_lite_read() when the socket is readable and mqtt_lite_flush()
+   when it is writable (or whenever mqtt_lite_want_write() says so).
+
+   With version set to 5, topics repeated on a connection are sent once
+   and then as a two byte topic alias, up to MQTT_LITE_ALIASES of them and
+   as many as the broker allows, and the broker may do the same towards
+   the client. A broker that refuses MQTT 5 gets its CONNACK passed on as
+   usual, and version drops to 4 for the next connect.
+*/
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define MQTT_LITE_ALIASES 16            /*!< Topic aliases each way, MQTT 5 */
+
+struct addrinfo;
+
+struct mqtt_lite {
+	int fd;
+	bool connected;
+	uint16_t next_id;
+	int version;                    /*!< 5 for MQTT 5, otherwise 3.1.1 */
+
+	/* MQTT 5 topic aliases of the connection, number - 1 as index */
+	uint16_t tx_alias_max;          /*!< As many as the broker takes */
+	char *tx_alias[MQTT_LITE_ALIASES];
+	char *rx_alias[MQTT_LITE_ALIASES];
+
+	/* MQTT 5 request of the PUBLISH being handled, for on_publish;
+	   response_topic is NULL if there is none */
+	const char *response_topic;
+	size_t response_topic_len;
+	const uint8_t *correlation;
+	size_t correlation_len;
+
+	uint8_t *in;
+	size_t in_len;
+	size_t in_size;
+	uint8_t *out;
+	size_t out_len;
+	size_t out_size;
+
+	uint64_t tx_bytes;
+	uint64_t rx_bytes;
+
+	void (*on_connack)(struct mqtt_lite *c, int rc, bool session_present);
+	void (*on_suback)(struct mqtt_lite *c, uint16_t id);
+	void (*on_puback)(struct mqtt_lite *c, uint16_t id);
+	void (*on_publish)(struct mqtt_lite *c, const char *topic, size_t topic_len,
+	                   const uint8_t *payload, size_t len, int qos, bool retain);
+	void *priv;
+};
+
+struct mqtt_lite_will {
+	const char *topic;
+	const char *msg;
+	int len;
+	int qos;
+	bool retain;
+};
+
+int mqtt_lite_open(struct mqtt_lite *c, const struct addrinfo *ai);
+int mqtt_lite_send_connect(struct mqtt_lite *c, const char *client_id, int keepalive,
+                           bool clean_session, const struct mqtt_lite_will *will);
+int mqtt_lite_subscribe(struct mqtt_lite *c, const char *topic, int qos);
+int mqtt_lite_unsubscribe(struct mqtt_lite *c, const char *topic);
+int mqtt_lite_publish(struct mqtt_lite *c, const char *topic, const void *data, int len, int qos, bool retain);
+int mqtt_lite_reply(struct mqtt_lite *c, const void *data, int len, int qos);
+int mqtt_lite_ping(struct mqtt_lite *c);
+int mqtt_lite_disconnect(struct mqtt_lite *c);
+int mqtt_lite_read(struct mqtt_lite *c);
+int mqtt_lite_flush(struct mqtt_lite *c);
+bool mqtt_lite_want_write(const struct mqtt_lite *c);
+void mqtt_lite_close(struct mqtt_lite *c);
+
+#endif /* MQTT_LITE_H */
@@ -0,0 +1,394 @@
+/* Build compressed or delta OTA images for ota_patch.c
+
+     ./otadiff new.bin new.pat               compress only
+     ./otadiff -b old.bin new.bin new.pat    delta against old.bin
+
+   The result can be served at CONFIG_FIRMWARE_UPGRADE_URL instead of the
+   plain image. A delta is only accepted by a proxy running exactly
+   old.bin. Every patch is decoded again with the firmware's own decoder
+   and compared with new.bin before it is written.
+*/
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ota_patch.h"
+
+/* esp_image_header_t + esp_image_segment_header_t + offsetof(esp_app_desc_t, app_elf_sha256) */
+#define APP_ELF_SHA256_OFFSET (24 + 8 + 144)
+
+#define HASH_BITS   16
+#define MIN_MATCH   4
+#define MAX_CHAIN   64
+
+struct buffer {
+	uint8_t *data;
+	size_t len;
+	size_t size;
+};
+
+struct index {
+	const uint8_t *data;
+	size_t len;
+	int32_t head[1 << HASH_BITS];
+	int32_t *prev;
+};
+
+struct match {
+	enum ota_patch_op op;
+	uint32_t len;
+	uint32_t arg;
+	int cost;
+};
+
+static const struct buffer *decode_old;
+static struct buffer decoded;
+
+static int read_file(struct buffer *b, const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	long len;
+
+	if (f == NULL || fseek(f, 0, SEEK_END) < 0 || (len = ftell(f)) < 0) {
+		perror(path);
+		return -1;
+	}
+	rewind(f);
+	b->data = malloc(len + 1);
+	b->len = b->size = len;
+	if (b->data == NULL || fread(b->data, 1, len, f) != (size_t)len) {
+		perror(path);
+		return -1;
+	}
+	fclose(f);
+	return 0;
+}
+
+static void put(struct buffer *b, const void *data, size_t len)
+{
+	if (b->len + len > b->size) {
+		b->size = (b->len + len) * 2;
+		b->data = realloc(b->data, b->size);
+		if (b->data == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+}
+
+static int varint_len(uint32_t v)
+{
+	int n = 1;
+
+	while (v >= 0x80) {
+		v >>= 7;
+		n++;
+	}
+	return n;
+}
+
+static void put_varint(struct buffer *b, uint32_t v)
+{
+	while (v >= 0x80) {
+		uint8_t c = v | 0x80;
+		put(b, &c, 1);
+		v >>= 7;
+	}
+	uint8_t c = v;
+	put(b, &c, 1);
+}
+
+static uint32_t zigzag(int32_t v)
+{
+	return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+static void put_token(struct buffer *b, enum ota_patch_op op, uint32_t len)
+{
+	uint8_t token = op << 6;
+
+	if (len >= 64) {
+		token |= 0x3F;
+		put(b, &token, 1);
+		put_varint(b, len - 64);
+	} else {
+		token |= len - 1;
+		put(b, &token, 1);
+	}
+}
+
+static int token_cost(uint32_t len)
+{
+	return len >= 64 ? 1 + varint_len(len - 64) : 1;
+}
+
+static uint32_t hash(const uint8_t *p)
+{
+	uint32_t v = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+
+	return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static void index_init(struct index *ix, const uint8_t *data, size_t len)
+{
+	ix->data = data;
+	ix->len = len;
+	memset(ix->head, 0xFF, sizeof(ix->head));
+	ix->prev = malloc((len + 1) * sizeof(*ix->prev));
+}
+
+static void index_insert(struct index *ix, size_t pos)
+{
+	if (pos + MIN_MATCH > ix->len) {
+		return;
+	}
+	uint32_t h = hash(ix->data + pos);
+	ix->prev[pos] = ix->head[h];
+	ix->head[h] = pos;
+}
+
+static uint32_t match_len(const uint8_t *a, const uint8_t *b, uint32_t max)
+{
+	uint32_t n = 0;
+
+	while (n < max && a[n] == b[n]) {
+		n++;
+	}
+	return n;
+}
+
+static void consider(struct match *best, enum ota_patch_op op, uint32_t len, uint32_t arg)
+{
+	int cost = token_cost(len) + varint_len(arg);
+
+	if (len < MIN_MATCH) {
+		return;
+	}
+	if (best->len == 0 || (int)len - cost > (int)best->len - best->cost) {
+		best->op = op;
+		best->len = len;
+		best->arg = arg;
+		best->cost = cost;
+	}
+}
+
+/*
+ * @brief Find the cheapest copy for new[pos], not crossing limit
+ */
+static void find_match(struct match *best, const struct index *nix, const struct index *oix,
+                       size_t pos, size_t limit, uint32_t old_pos)
+{
+	const uint8_t *cur = nix->data + pos;
+	uint32_t max = limit - pos;
+
+	best->len = 0;
+	if (max < MIN_MATCH) {
+		return;
+	}
+
+	int chain = MAX_CHAIN;
+	for (int32_t j = nix->head[hash(cur)]; j >= 0 && chain--; j = nix->prev[j]) {
+		consider(best, OP_COPY_NEW, match_len(nix->data + j, cur, max), pos - j);
+	}
+
+	if (oix == NULL) {
+		return;
+	}
+
+	/* The continuation of the previous old copy is nearly free */
+	if (old_pos < oix->len) {
+		uint32_t omax = oix->len - old_pos < max ? oix->len - old_pos : max;
+		consider(best, OP_COPY_OLD, match_len(oix->data + old_pos, cur, omax), zigzag(0));
+	}
+
+	chain = MAX_CHAIN;
+	for (int32_t j = oix->head[hash(cur)]; j >= 0 && chain--; j = oix->prev[j]) {
+		uint32_t omax = oix->len - j < max ? oix->len - j : max;
+		consider(best, OP_COPY_OLD, match_len(oix->data + j, cur, omax), zigzag((int32_t)(j - old_pos)));
+	}
+}
+
+static void flush_literals(struct buffer *out, const uint8_t *data, size_t start, size_t end)
+{
+	if (end > start) {
+		put_token(out, OP_LITERAL, end - start);
+		put(out, data + start, end - start);
+	}
+}
+
+static void encode(struct buffer *out, const struct buffer *new, const struct buffer *old)
+{
+	struct index *nix = malloc(sizeof(*nix));
+	struct index *oix = NULL;
+	uint32_t old_pos = 0;
+
+	index_init(nix, new->data, new->len);
+	if (old != NULL) {
+		oix = malloc(sizeof(*oix));
+		index_init(oix, old->data, old->len);
+		for (size_t i = old->len; i-- > 0;) {
+			/* Inserted backwards so chains prefer the lowest offsets */
+			index_insert(oix, i);
+		}
+	}
+
+	for (size_t block = 0; block < new->len; block += OTA_PATCH_BLOCK) {
+		size_t limit = block + OTA_PATCH_BLOCK < new->len ? block + OTA_PATCH_BLOCK : new->len;
+		size_t lit = block;
+		size_t pos = block;
+
+		while (pos < limit) {
+			struct match m;
+
+			find_match(&m, nix, oix, pos, limit, old_pos);
+			if (m.len == 0 || (int)m.len <= m.cost) {
+				index_insert(nix, pos++);
+				continue;
+			}
+
+			flush_literals(out, new->data, lit, pos);
+			put_token(out, m.op, m.len);
+			put_varint(out, m.arg);
+			if (m.op == OP_COPY_OLD) {
+				int32_t delta = (m.arg >> 1) ^ -(int32_t)(m.arg & 1);
+				old_pos += delta + m.len;
+			}
+			for (uint32_t i = 0; i < m.len; i++) {
+				index_insert(nix, pos++);
+			}
+			lit = pos;
+		}
+		flush_literals(out, new->data, lit, limit);
+	}
+
+	free(nix->prev);
+	free(nix);
+	if (oix != NULL) {
+		free(oix->prev);
+		free(oix);
+	}
+}
+
+static int read_old(void *priv, uint32_t offset, void *buf, size_t len)
+{
+	if (decode_old == NULL || offset + len > decode_old->len) {
+		return -1;
+	}
+	memcpy(buf, decode_old->data + offset, len);
+	return 0;
+}
+
+static int read_new(void *priv, uint32_t offset, void *buf, size_t len)
+{
+	if (offset + len > decoded.len) {
+		return -1;
+	}
+	memcpy(buf, decoded.data + offset, len);
+	return 0;
+}
+
+static int write_block(void *priv, uint32_t offset, const void *buf, size_t len)
+{
+	if (offset != decoded.len) {
+		return -1;
+	}
+	put(&decoded, buf, len);
+	return 0;
+}
+
+/*
+ * @brief Decode the patch in small pieces, as the firmware would see it
+ */
+static int verify(const struct buffer *patch, const struct buffer *new, const struct buffer *old)
+{
+	static const struct ota_patch_io io = {
+		.read_old = read_old,
+		.read_new = read_new,
+		.write_block = write_block,
+	};
+	static struct ota_patch p;
+	struct ota_patch_header h;
+	size_t pos = ota_patch_parse_header(&h, patch->data, patch->len);
+
+	decode_old = old;
+	ota_patch_init(&p, &io, OTA_FORMAT_PATCH, h.image_size, 0, 0);
+	while (pos < patch->len) {
+		size_t chunk = patch->len - pos < 1000 ? patch->len - pos : 1000;
+		int n = ota_patch_feed(&p, patch->data + pos, chunk);
+		if (n < 0) {
+			fprintf(stderr, "decode failed at %zu\n", pos);
+			return -1;
+		}
+		pos += n;
+	}
+
+	if (decoded.len != new->len || memcmp(decoded.data, new->data, new->len) != 0) {
+		fprintf(stderr, "decoded image differs\n");
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct buffer old = { 0 }, new = { 0 }, patch = { 0 };
+	struct ota_patch_header h = { 0 };
+	uint8_t header[OTA_PATCH_HEADER_SIZE];
+	const char *base = NULL;
+	FILE *f;
+	int c;
+
+	while ((c = getopt(argc, argv, "b:")) != -1) {
+		switch (c) {
+		case 'b':
+			base = optarg;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (argc - optind != 2) {
+		goto usage;
+	}
+
+	if (read_file(&new, argv[optind]) < 0 || (base && read_file(&old, base) < 0)) {
+		return 1;
+	}
+	if (new.len < APP_ELF_SHA256_OFFSET + 32 || new.data[0] != OTA_PATCH_RAW_MAGIC ||
+	    (base && (old.len < APP_ELF_SHA256_OFFSET + 32 || old.data[0] != OTA_PATCH_RAW_MAGIC))) {
+		fprintf(stderr, "not an application image\n");
+		return 1;
+	}
+
+	h.image_size = new.len;
+	if (base) {
+		h.flags = OTA_PATCH_FLAG_DELTA;
+		h.old_size = old.len;
+		memcpy(h.old_sha256, old.data + APP_ELF_SHA256_OFFSET, sizeof(h.old_sha256));
+	}
+	ota_patch_write_header(header, &h);
+	put(&patch, header, sizeof(header));
+	encode(&patch, &new, base ? &old : NULL);
+
+	if (verify(&patch, &new, base ? &old : NULL) < 0) {
+		return 1;
+	}
+
+	f = fopen(argv[optind + 1], "wb");
+	if (f == NULL || fwrite(patch.data, 1, patch.len, f) != patch.len || fclose(f) != 0) {
+		perror(argv[optind + 1]);
+		return 1;
+	}
+
+	printf("%s: %zu -> %zu bytes (%.1fx)\n", base ? "delta" : "compressed",
+	       new.len, patch.len, (double)new.len / patch.len);
+	return 0;
+
+usage:
+	fprintf(stderr, "usage: %s [-b old.bin] new.bin out.pat\n", argv[0]);
+	return 2;
+}
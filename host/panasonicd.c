@@ -0,0 +1,908 @@
+/* Linux daemon: the proxy core for IR transceivers attached to a gateway
+
+   Every unit is one air conditioner with its own IR transceiver and its
+   own MQTT connection, so topics, discovery and availability (through the
+   will) look exactly like those of a proxy board. All units share one
+   epoll loop in one process.
+
+     ./panasonicd -H broker -u 0a1b2c3d4e5f=lirc:/dev/lirc0
+     ./panasonicd -H broker -c /etc/panasonicd.conf
+
+   A unit is given as <id>=<transport>:<rx>[,<tx>], one per -u option or
+   one per line in the -c file ('#' starts a comment). The id is used in
+   the topics in place of the MAC address of a board.
+
+     lirc:<dev>[,<txdev>]  kernel LIRC device, mode2 receive, pulse send
+     pipe:<rx>[,<tx>]      text as printed by the LIRC mode2 tool
+                           ("pulse 400", "space 1340"), read from a FIFO
+                           and written to a file or FIFO; a stand-in for
+                           testing without hardware
+
+   Frames received from the remote are relayed to the AC and published,
+   /set commands update the unit's state and are transmitted, as on the
+   board.
+
+   With -5 the units speak MQTT 5: the per-unit topics go out as topic
+   aliases after their first use, and a /set that carries a response
+   topic is answered there with the result and its correlation data, in
+   place of the "#<id>" suffix of the board. A broker that only knows
+   3.1.1 refuses the first connect, and the unit falls back to 3.1.1.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <linux/lirc.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/signalfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "esp_log.h"
+#include "mqtt_lite.h"
+#include "mqtt_topics.h"
+#include "panasonic_frame.h"
+#include "panasonic_ir.h"
+#include "panasonic_pulse.h"
+#include "panasonic_state.h"
+
+#define SW_VERSION       "panasonicd"
+#define RX_IDLE_US       4000           /*!< Longer spaces end a frame, as RMT_ITEM32_TIMEOUT_US */
+#define RETRY_MIN_MS     1000
+#define RETRY_MAX_MS     60000
+#define TX_DURATIONS_MAX (PANASONIC_PULSES_MAX * 2 * PANASONIC_COMMANDS_MAX)
+
+static const char TAG[] = "panasonicd";
+
+int host_log_level = 3;
+
+struct unit;
+
+struct transport {
+	const char *name;
+	int (*open)(struct unit *u);
+	/* Called when rx_fd is readable; -1 drops the unit's receiver */
+	int (*read)(struct unit *u);
+	/* Durations alternate pulse and space, starting and ending with a pulse */
+	int (*send)(struct unit *u, const uint32_t *durations, size_t n);
+};
+
+enum watch_kind {
+	WATCH_MQTT,
+	WATCH_IR,
+	WATCH_SIGNAL,
+};
+
+struct watch {
+	enum watch_kind kind;
+	struct unit *unit;
+};
+
+struct unit {
+	char id[13];
+	const struct transport *transport;
+	char rx_path[256];
+	char tx_path[256];
+	int rx_fd;
+	int tx_fd;
+
+	/* pipe transport: partial input line */
+	char line[32];
+	size_t line_len;
+
+	/* lirc transport: write() blocks for the airtime, so it has a thread */
+	pthread_t tx_thread;
+	pthread_mutex_t tx_lock;
+	pthread_cond_t tx_cond;
+	uint32_t tx_buf[TX_DURATIONS_MAX];
+	size_t tx_len;
+
+	struct panasonic_parser parser;
+	uint32_t mark;                  /*!< Pulse waiting for its space, 0 if none */
+	uint64_t mark_us;
+	struct panasonic_command state;
+
+	struct mqtt_lite m;
+	struct watch mqtt_watch;
+	struct watch ir_watch;
+	bool pollout;
+	uint64_t ping_us;
+	uint64_t retry_us;
+	uint32_t retry_ms;
+};
+
+static struct {
+	const char *host;
+	const char *port;
+	int keepalive;
+	bool mqtt5;
+} opt = {
+	.host = "127.0.0.1",
+	.port = "1883",
+	.keepalive = 30,
+};
+
+static int epfd;
+static struct addrinfo *broker;
+static struct unit *units;
+static int unit_count;
+static bool running = true;
+
+/* Units keep their own state; the firmware's single-unit setters are not used */
+int mqtt_pub(const char *topic, const char *data, int len, int qos, int retain)
+{
+	return -1;
+}
+
+int mqtt_pub_state(const char *data, int len)
+{
+	return -1;
+}
+
+int panasonic_transmit(const struct panasonic_command *cmd)
+{
+	return 0;
+}
+
+int panasonic_transmit_list(const struct panasonic_command *cmds, int count)
+{
+	return 0;
+}
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void watch_add(int fd, struct watch *w, uint32_t events)
+{
+	struct epoll_event ev = { .events = events, .data.ptr = w };
+
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		perror("epoll_ctl");
+		exit(1);
+	}
+}
+
+/* -- MQTT -------------------------------------------------------------- */
+
+static void unit_update(struct unit *u)
+{
+	struct epoll_event ev = { .data.ptr = &u->mqtt_watch };
+	int ret;
+
+	if (u->m.fd < 0) {
+		return;
+	}
+
+	ret = mqtt_lite_flush(&u->m);
+	if (ret < 0) {
+		return;
+	}
+	if ((ret > 0) != u->pollout) {
+		u->pollout = ret > 0;
+		ev.events = EPOLLIN | (u->pollout ? EPOLLOUT : 0);
+		epoll_ctl(epfd, EPOLL_CTL_MOD, u->m.fd, &ev);
+	}
+}
+
+static void unit_pub(struct unit *u, const char *suffix, const char *data, int len, int qos, bool retain)
+{
+	char topic[64];
+
+	if (!u->m.connected) {
+		return;
+	}
+	snprintf(topic, sizeof(topic), TOPIC_PREFIX"%s%s", u->id, suffix);
+	mqtt_lite_publish(&u->m, topic, data, len, qos, retain);
+	u->ping_us = now_us() + opt.keepalive * 1000000ull;
+	unit_update(u);
+}
+
+/*
+ * @brief Publish a state or command, as panasonic_send_mqtt() does
+ */
+static void unit_publish(struct unit *u, const struct panasonic_command *cmd)
+{
+	char s[100];
+	int len;
+
+	if (cmd->cmd == CMD_STATE) {
+		len = panasonic_state_to_json(s, sizeof(s), cmd);
+	} else {
+		len = snprintf(s, sizeof(s), "%s", command_to_string(cmd->cmd));
+	}
+	ESP_LOGI(TAG, "%s: publish \"%s\"", u->id, s);
+	unit_pub(u, cmd->cmd == CMD_STATE ? "" : "/command", s, len, 0, false);
+}
+
+/*
+ * @brief Send frames back to back, IDLE_US apart, as panasonic_transmit_list()
+ */
+static int unit_transmit_list(struct unit *u, const struct panasonic_command *cmds, int count)
+{
+	struct panasonic_pulse pulses[PANASONIC_PULSES_MAX];
+	uint32_t durations[TX_DURATIONS_MAX];
+	size_t n = 0;
+
+	for (int c = 0; c < count && c < PANASONIC_COMMANDS_MAX; c++) {
+		uint8_t data[PANASONIC_FRAME_MAXLEN];
+		int len, np;
+
+		len = panasonic_build_frame(&cmds[c], data, sizeof(data));
+		if (len < 0) {
+			return -1;
+		}
+		if (n > 0) {
+			durations[n++] = IDLE_US;
+		}
+		np = panasonic_pulse_encode(pulses, PANASONIC_PULSES_MAX, data, len);
+		for (int i = 0; i < np; i++) {
+			durations[n++] = pulses[i].mark;
+			if (pulses[i].space != 0) {
+				durations[n++] = pulses[i].space;
+			}
+		}
+	}
+
+	if (u->transport->send(u, durations, n) < 0) {
+		ESP_LOGE(TAG, "%s: transmit failed: %s", u->id, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static int unit_transmit(struct unit *u, const struct panasonic_command *cmd)
+{
+	return unit_transmit_list(u, cmd, 1);
+}
+
+/*
+ * @brief Answer an MQTT 5 request on its response topic, if it has one
+ *
+ * The MQTT 5 counterpart of the "#<id>" acknowledgements of mqtt.c: the
+ * correlation data identifies the command, so the payload needs no id.
+ */
+static void unit_reply(struct unit *u, const char *result, uint64_t received_us, uint64_t tx_start_us,
+                       uint64_t tx_done_us)
+{
+	char buf[MQTT_ACK_MAXLEN];
+	int len;
+
+	if (u->m.response_topic == NULL) {
+		return;
+	}
+	len = mqtt_ack_payload(buf, sizeof(buf), NULL, 0, result,
+	                       tx_start_us ? tx_start_us - received_us : 0, tx_done_us - tx_start_us);
+	mqtt_lite_reply(&u->m, buf, len, 1);
+	unit_update(u);
+}
+
+static void unit_on_connack(struct mqtt_lite *m, int rc, bool session_present)
+{
+	struct unit *u = m->priv;
+	char topic[64];
+	char buf[MQTT_DISCOVERY_MAXLEN];
+
+	if (rc != 0 && opt.mqtt5 && m->version != 5) {
+		ESP_LOGW(TAG, "%s: no MQTT 5 at the broker, falling back to 3.1.1", u->id);
+		return;
+	}
+	if (rc != 0) {
+		ESP_LOGE(TAG, "%s: CONNACK rc=%d", u->id, rc);
+		return;
+	}
+	ESP_LOGI(TAG, "%s: connected", u->id);
+	u->retry_ms = RETRY_MIN_MS;
+
+	/* Same sequence as mqtt_event_handler_cb() on MQTT_EVENT_CONNECTED,
+	 * without the restart and OTA topics, which are about the board */
+	unit_pub(u, AVAILABILITY_TOPIC, AVAILABILITY_ONLINE, -1, 1, true);
+
+	for (size_t i = 0; i < mqtt_set_topic_count; i++) {
+		snprintf(topic, sizeof(topic), TOPIC_PREFIX"%s%s", u->id, mqtt_set_topics[i]);
+		mqtt_lite_subscribe(m, topic, 0);
+	}
+	snprintf(topic, sizeof(topic), TOPIC_PREFIX"%s"COMMAND_SET_TOPIC, u->id);
+	mqtt_lite_subscribe(m, topic, 0);
+
+	mqtt_discovery_topic(topic, sizeof(topic), u->id);
+	mqtt_discovery_payload(buf, sizeof(buf), u->id, SW_VERSION);
+	mqtt_lite_publish(m, topic, buf, -1, 0, true);
+}
+
+static void unit_on_publish(struct mqtt_lite *m, const char *topic, size_t topic_len,
+                            const uint8_t *payload, size_t len, int qos, bool retain)
+{
+	struct unit *u = m->priv;
+	struct mqtt_set_request req;
+	struct panasonic_command cmds[PANASONIC_COMMANDS_MAX];
+	uint64_t received = now_us();
+	uint64_t tx_start;
+	int ret;
+	int err;
+
+	if (topic_len > sizeof(COMMAND_SET_TOPIC) &&
+	    memcmp(topic + topic_len - (sizeof(COMMAND_SET_TOPIC) - 1), COMMAND_SET_TOPIC, sizeof(COMMAND_SET_TOPIC) - 1) == 0) {
+		ret = mqtt_parse_commands(cmds, PANASONIC_COMMANDS_MAX, (const char *)payload, len);
+		if (ret <= 0) {
+			ESP_LOGI(TAG, "%s: unknown command \"%.*s\"", u->id, (int)len, (const char *)payload);
+			unit_reply(u, "invalid", received, 0, 0);
+			return;
+		}
+		for (int i = 0; i < ret; i++) {
+			if (cmds[i].cmd == CMD_STATE) {
+				cmds[i] = u->state;
+			}
+		}
+		tx_start = now_us();
+		err = unit_transmit_list(u, cmds, ret);
+		unit_reply(u, err < 0 ? "failed" : "ok", received, tx_start, now_us());
+		for (int i = 0; i < ret; i++) {
+			unit_publish(u, &cmds[i]);
+		}
+		return;
+	}
+
+	ret = mqtt_parse_set(&req, topic, topic_len, (const char *)payload, len);
+	if (ret > 0) {
+		panasonic_apply_set(&u->state, &req);
+		tx_start = now_us();
+		err = unit_transmit(u, &u->state);
+		unit_reply(u, err < 0 ? "failed" : "ok", received, tx_start, now_us());
+		unit_publish(u, &u->state);
+	} else if (ret < 0) {
+		ESP_LOGI(TAG, "%s: unknown value \"%.*s\"", u->id, (int)len, (const char *)payload);
+		unit_reply(u, "invalid", received, 0, 0);
+	}
+}
+
+static void unit_connect(struct unit *u)
+{
+	char client_id[32];
+	char topic[40];
+	struct mqtt_lite_will will = {
+		.topic = topic,
+		.msg = AVAILABILITY_OFFLINE,
+		.len = sizeof(AVAILABILITY_OFFLINE) - 1,
+		.qos = 1,
+		.retain = true,
+	};
+
+	snprintf(client_id, sizeof(client_id), "panasonicd-%s", u->id);
+	snprintf(topic, sizeof(topic), TOPIC_PREFIX"%s"AVAILABILITY_TOPIC, u->id);
+
+	if (mqtt_lite_open(&u->m, broker) < 0) {
+		ESP_LOGW(TAG, "%s: connect: %s", u->id, strerror(errno));
+		u->retry_us = now_us() + u->retry_ms * 1000ull;
+		return;
+	}
+	mqtt_lite_send_connect(&u->m, client_id, opt.keepalive, true, &will);
+	u->pollout = true;
+	u->ping_us = now_us() + opt.keepalive * 1000000ull;
+	watch_add(u->m.fd, &u->mqtt_watch, EPOLLIN | EPOLLOUT);
+}
+
+static void unit_disconnected(struct unit *u)
+{
+	epoll_ctl(epfd, EPOLL_CTL_DEL, u->m.fd, NULL);
+	mqtt_lite_close(&u->m);
+
+	/* Jittered exponential back-off, so a broker restart is not a storm */
+	u->retry_us = now_us() + (u->retry_ms / 2 + rand() % (u->retry_ms / 2 + 1)) * 1000ull;
+	ESP_LOGW(TAG, "%s: connection lost, retrying in %u ms", u->id, u->retry_ms);
+	u->retry_ms = u->retry_ms * 2 > RETRY_MAX_MS ? RETRY_MAX_MS : u->retry_ms * 2;
+}
+
+/* -- IR ---------------------------------------------------------------- */
+
+static void unit_frame(struct unit *u, int len)
+{
+	struct panasonic_command cmd;
+	char s[PANASONIC_FRAME_MAXLEN * 3 + 1];
+	size_t n = 0;
+	bool corrected;
+
+	for (int i = 0; i < len; i++) {
+		n += snprintf(s + n, sizeof(s) - n, "%02x ", u->parser.buf[i]);
+	}
+	ESP_LOGI(TAG, "%s: RCV %s", u->id, s);
+
+	if (panasonic_parse_received(&cmd, &u->parser, len, &corrected) > 0) {
+		/* Relay to the AC, as set_state() in app_main.c does */
+		if (cmd.cmd == CMD_STATE) {
+			u->state = cmd;
+		}
+		unit_transmit(u, &cmd);
+		unit_publish(u, &cmd);
+	}
+}
+
+static void unit_feed(struct unit *u, uint32_t mark, uint32_t space)
+{
+	int ret;
+
+	mark = mark > UINT16_MAX ? UINT16_MAX : mark;
+	space = space >= RX_IDLE_US ? 0 : space;
+
+	ret = panasonic_pulse_parse(&u->parser, mark, space);
+	if (ret > 0) {
+		unit_frame(u, ret);
+	} else if (ret < 0) {
+		ESP_LOGD(TAG, "%s: bad pulse %u/%u", u->id, mark, space);
+	}
+}
+
+/*
+ * @brief Take one duration from the receiver
+ */
+static void unit_pulse(struct unit *u, bool pulse, uint32_t us)
+{
+	if (pulse) {
+		/* Some receivers split a pulse; join them */
+		u->mark += us;
+		u->mark_us = now_us();
+	} else if (u->mark != 0) {
+		unit_feed(u, u->mark, us);
+		u->mark = 0;
+	}
+}
+
+/*
+ * @brief The line went quiet after a pulse: end of frame
+ */
+static void unit_idle(struct unit *u)
+{
+	if (u->mark != 0) {
+		unit_feed(u, u->mark, 0);
+		u->mark = 0;
+	}
+}
+
+/* -- pipe transport ---------------------------------------------------- */
+
+static int pipe_open(struct unit *u)
+{
+	/* O_RDWR keeps a FIFO open while no writer is attached */
+	u->rx_fd = open(u->rx_path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (u->rx_fd < 0) {
+		return -1;
+	}
+	if (u->tx_path[0] != '\0') {
+		u->tx_fd = open(u->tx_path, O_WRONLY | O_APPEND | O_CREAT | O_NONBLOCK | O_CLOEXEC, 0644);
+		if (u->tx_fd < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void pipe_line(struct unit *u, const char *line)
+{
+	char type[16];
+	unsigned int us;
+
+	if (sscanf(line, "%15s %u", type, &us) != 2) {
+		return;
+	}
+	if (strcmp(type, "pulse") == 0) {
+		unit_pulse(u, true, us);
+	} else if (strcmp(type, "space") == 0) {
+		unit_pulse(u, false, us);
+	} else if (strcmp(type, "timeout") == 0) {
+		unit_idle(u);
+	}
+}
+
+static int pipe_read(struct unit *u)
+{
+	char buf[512];
+	ssize_t n;
+
+	while ((n = read(u->rx_fd, buf, sizeof(buf))) > 0) {
+		for (ssize_t i = 0; i < n; i++) {
+			if (buf[i] == '\n') {
+				u->line[u->line_len] = '\0';
+				pipe_line(u, u->line);
+				u->line_len = 0;
+			} else if (u->line_len < sizeof(u->line) - 1) {
+				u->line[u->line_len++] = buf[i];
+			}
+		}
+	}
+	return n == 0 || errno == EAGAIN ? 0 : -1;
+}
+
+static int pipe_send(struct unit *u, const uint32_t *durations, size_t n)
+{
+	char buf[TX_DURATIONS_MAX * 12];
+	size_t len = 0;
+
+	if (u->tx_fd < 0) {
+		return 0;
+	}
+	for (size_t i = 0; i < n; i++) {
+		len += snprintf(buf + len, sizeof(buf) - len, "%s %u\n", i % 2 ? "space" : "pulse", durations[i]);
+	}
+	len += snprintf(buf + len, sizeof(buf) - len, "timeout %u\n", RX_IDLE_US);
+	return write(u->tx_fd, buf, len) == (ssize_t)len ? 0 : -1;
+}
+
+static const struct transport pipe_transport = {
+	.name = "pipe",
+	.open = pipe_open,
+	.read = pipe_read,
+	.send = pipe_send,
+};
+
+/* -- lirc transport ---------------------------------------------------- */
+
+static void *lirc_tx_thread(void *arg)
+{
+	struct unit *u = arg;
+	uint32_t buf[TX_DURATIONS_MAX];
+	size_t n;
+
+	for (;;) {
+		pthread_mutex_lock(&u->tx_lock);
+		while (u->tx_len == 0) {
+			pthread_cond_wait(&u->tx_cond, &u->tx_lock);
+		}
+		n = u->tx_len;
+		memcpy(buf, u->tx_buf, n * sizeof(*buf));
+		u->tx_len = 0;
+		pthread_mutex_unlock(&u->tx_lock);
+
+		/* Returns once the signal has been sent */
+		if (write(u->tx_fd, buf, n * sizeof(*buf)) < 0) {
+			ESP_LOGE(TAG, "%s: %s: %s", u->id, u->tx_path, strerror(errno));
+		}
+	}
+	return NULL;
+}
+
+static int lirc_open(struct unit *u)
+{
+	uint32_t mode = LIRC_MODE_MODE2;
+	uint32_t timeout = RX_IDLE_US;
+	uint32_t carrier = 38000;
+
+	u->rx_fd = open(u->rx_path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (u->rx_fd < 0) {
+		return -1;
+	}
+	if (ioctl(u->rx_fd, LIRC_SET_REC_MODE, &mode) < 0) {
+		ESP_LOGW(TAG, "%s: %s cannot receive: %s", u->id, u->rx_path, strerror(errno));
+	}
+	/* Not every driver has a configurable timeout; long spaces work too */
+	ioctl(u->rx_fd, LIRC_SET_REC_TIMEOUT, &timeout);
+
+	if (u->tx_path[0] != '\0') {
+		u->tx_fd = open(u->tx_path, O_RDWR | O_CLOEXEC);
+		if (u->tx_fd < 0) {
+			return -1;
+		}
+	} else {
+		u->tx_fd = dup(u->rx_fd);
+		fcntl(u->tx_fd, F_SETFL, 0);
+	}
+	mode = LIRC_MODE_PULSE;
+	if (ioctl(u->tx_fd, LIRC_SET_SEND_MODE, &mode) < 0) {
+		ESP_LOGW(TAG, "%s: cannot transmit: %s", u->id, strerror(errno));
+	}
+	ioctl(u->tx_fd, LIRC_SET_SEND_CARRIER, &carrier);
+
+	pthread_mutex_init(&u->tx_lock, NULL);
+	pthread_cond_init(&u->tx_cond, NULL);
+	return -pthread_create(&u->tx_thread, NULL, lirc_tx_thread, u);
+}
+
+static int lirc_read(struct unit *u)
+{
+	uint32_t buf[64];
+	ssize_t n;
+
+	while ((n = read(u->rx_fd, buf, sizeof(buf))) > 0) {
+		for (size_t i = 0; i < n / sizeof(*buf); i++) {
+			uint32_t us = LIRC_VALUE(buf[i]);
+
+			if (LIRC_IS_PULSE(buf[i])) {
+				unit_pulse(u, true, us);
+			} else if (LIRC_IS_SPACE(buf[i])) {
+				unit_pulse(u, false, us);
+			} else if (LIRC_IS_TIMEOUT(buf[i])) {
+				unit_idle(u);
+			}
+		}
+	}
+	return n == 0 || errno == EAGAIN ? 0 : -1;
+}
+
+/*
+ * @brief Hand the signal to the unit's transmit thread
+ *
+ * Only the latest one is kept. Every frame carries the complete state, so
+ * a frame that was superseded before it went out need not be sent.
+ */
+static int lirc_send(struct unit *u, const uint32_t *durations, size_t n)
+{
+	pthread_mutex_lock(&u->tx_lock);
+	memcpy(u->tx_buf, durations, n * sizeof(*durations));
+	u->tx_len = n;
+	pthread_cond_signal(&u->tx_cond);
+	pthread_mutex_unlock(&u->tx_lock);
+	return 0;
+}
+
+static const struct transport lirc_transport = {
+	.name = "lirc",
+	.open = lirc_open,
+	.read = lirc_read,
+	.send = lirc_send,
+};
+
+static const struct transport *const transports[] = {
+	&lirc_transport,
+	&pipe_transport,
+};
+
+/* -- setup ------------------------------------------------------------- */
+
+/*
+ * @brief Parse <id>=<transport>:<rx>[,<tx>] into a new unit
+ */
+static int unit_add(const char *spec)
+{
+	char id[16], name[16], paths[256];
+	struct unit *u;
+	char *comma;
+
+	if (sscanf(spec, "%15[^=]=%15[^:]:%255s", id, name, paths) != 3) {
+		fprintf(stderr, "bad unit \"%s\"\n", spec);
+		return -1;
+	}
+	if (strlen(id) > 12 || strspn(id, "0123456789abcdefghijklmnopqrstuvwxyz_") != strlen(id)) {
+		fprintf(stderr, "bad unit id \"%s\": up to 12 of [0-9a-z_]\n", id);
+		return -1;
+	}
+
+	units = realloc(units, (unit_count + 1) * sizeof(*units));
+	if (units == NULL) {
+		perror("realloc");
+		exit(1);
+	}
+	u = &units[unit_count];
+	memset(u, 0, sizeof(*u));
+
+	for (size_t i = 0; i < sizeof(transports) / sizeof(transports[0]); i++) {
+		if (strcmp(name, transports[i]->name) == 0) {
+			u->transport = transports[i];
+		}
+	}
+	if (u->transport == NULL) {
+		fprintf(stderr, "unknown transport \"%s\"\n", name);
+		return -1;
+	}
+
+	comma = strchr(paths, ',');
+	if (comma != NULL) {
+		*comma = '\0';
+		snprintf(u->tx_path, sizeof(u->tx_path), "%s", comma + 1);
+	}
+	snprintf(u->rx_path, sizeof(u->rx_path), "%s", paths);
+	snprintf(u->id, sizeof(u->id), "%s", id);
+	unit_count++;
+	return 0;
+}
+
+static int read_config(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	char line[512];
+
+	if (f == NULL) {
+		perror(path);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+		char spec[512];
+
+		line[strcspn(line, "#")] = '\0';
+		if (sscanf(line, "%511s", spec) == 1 && unit_add(spec) < 0) {
+			fclose(f);
+			return -1;
+		}
+	}
+	fclose(f);
+	return 0;
+}
+
+static void unit_start(struct unit *u)
+{
+	u->rx_fd = u->tx_fd = u->m.fd = -1;
+	u->mqtt_watch = (struct watch){ WATCH_MQTT, u };
+	u->ir_watch = (struct watch){ WATCH_IR, u };
+	u->m.priv = u;
+	u->m.on_connack = unit_on_connack;
+	u->m.on_publish = unit_on_publish;
+	u->retry_ms = RETRY_MIN_MS;
+	u->state = (struct panasonic_command){
+		.cmd = CMD_STATE, .mode = MODE_AUTO, .temp = 21,
+		.fan = FAN_AUTO, .swing = SWING_AUTO,
+	};
+
+	if (u->transport->open(u) < 0) {
+		ESP_LOGE(TAG, "%s: %s: %s", u->id, u->rx_path, strerror(errno));
+		exit(1);
+	}
+	watch_add(u->rx_fd, &u->ir_watch, EPOLLIN);
+	ESP_LOGI(TAG, "%s: %s %s%s%s", u->id, u->transport->name, u->rx_path,
+	         u->tx_path[0] ? " -> " : "", u->tx_path);
+	unit_connect(u);
+}
+
+static void tick(uint64_t now)
+{
+	for (int i = 0; i < unit_count; i++) {
+		struct unit *u = &units[i];
+
+		if (u->mark != 0 && now - u->mark_us >= RX_IDLE_US) {
+			unit_idle(u);
+		}
+		if (u->m.fd < 0) {
+			if (now >= u->retry_us) {
+				unit_connect(u);
+			}
+		} else if (u->m.connected && now >= u->ping_us) {
+			u->ping_us = now + opt.keepalive * 1000000ull;
+			mqtt_lite_ping(&u->m);
+			unit_update(u);
+		}
+	}
+}
+
+static void shutdown_units(void)
+{
+	uint64_t deadline = now_us() + 1000000;
+
+	/* A clean DISCONNECT discards the will */
+	for (int i = 0; i < unit_count; i++) {
+		struct unit *u = &units[i];
+
+		if (u->m.connected) {
+			unit_pub(u, AVAILABILITY_TOPIC, AVAILABILITY_OFFLINE, -1, 1, true);
+			mqtt_lite_disconnect(&u->m);
+			unit_update(u);
+		}
+	}
+	for (int i = 0; i < unit_count; i++) {
+		while (units[i].m.fd >= 0 && mqtt_lite_want_write(&units[i].m) &&
+		       mqtt_lite_flush(&units[i].m) > 0 && now_us() < deadline) {
+			usleep(1000);
+		}
+		mqtt_lite_close(&units[i].m);
+	}
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+	        "usage: %s [options] -u <id>=<transport>:<rx>[,<tx>] ...\n"
+	        "  -H host     broker host (%s)\n"
+	        "  -p port     broker port (%s)\n"
+	        "  -k seconds  keepalive (%d)\n"
+	        "  -5          MQTT 5 with topic aliases, falling back to 3.1.1\n"
+	        "  -u unit     add a unit; transports: lirc, pipe\n"
+	        "  -c file     read units from file, one per line\n"
+	        "  -v          verbose logging\n",
+	        prog, opt.host, opt.port, opt.keepalive);
+	exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+	struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+	struct epoll_event events[64];
+	struct watch signal_watch = { WATCH_SIGNAL, NULL };
+	sigset_t mask;
+	int sfd;
+	int c;
+
+	while ((c = getopt(argc, argv, "H:p:k:5u:c:v")) != -1) {
+		switch (c) {
+		case 'H': opt.host = optarg; break;
+		case 'p': opt.port = optarg; break;
+		case 'k': opt.keepalive = atoi(optarg); break;
+		case '5': opt.mqtt5 = true; break;
+		case 'u': if (unit_add(optarg) < 0) return 1; break;
+		case 'c': if (read_config(optarg) < 0) return 1; break;
+		case 'v': host_log_level = 5; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (unit_count == 0 || opt.keepalive <= 0) {
+		usage(argv[0]);
+	}
+	for (int i = 0; i < unit_count; i++) {
+		units[i].m.version = opt.mqtt5 ? 5 : 4;
+	}
+
+	if ((c = getaddrinfo(opt.host, opt.port, &hints, &broker)) != 0) {
+		fprintf(stderr, "%s: %s\n", opt.host, gai_strerror(c));
+		return 1;
+	}
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	srand(time(NULL));
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	sfd = signalfd(-1, &mask, SFD_CLOEXEC);
+	watch_add(sfd, &signal_watch, EPOLLIN);
+
+	for (int i = 0; i < unit_count; i++) {
+		unit_start(&units[i]);
+	}
+
+	while (running) {
+		int timeout = 1000;
+
+		/* Notice the end of a frame even if the receiver reports no timeout */
+		for (int i = 0; i < unit_count; i++) {
+			if (units[i].mark != 0) {
+				timeout = RX_IDLE_US / 1000;
+			}
+		}
+
+		int n = epoll_wait(epfd, events, sizeof(events) / sizeof(events[0]), timeout);
+
+		if (n < 0 && errno != EINTR) {
+			perror("epoll_wait");
+			return 1;
+		}
+		for (int i = 0; i < n; i++) {
+			struct watch *w = events[i].data.ptr;
+			struct unit *u = w->unit;
+
+			switch (w->kind) {
+			case WATCH_SIGNAL:
+				running = false;
+				break;
+			case WATCH_IR:
+				if (u->transport->read(u) < 0) {
+					ESP_LOGE(TAG, "%s: %s: %s", u->id, u->rx_path, strerror(errno));
+					epoll_ctl(epfd, EPOLL_CTL_DEL, u->rx_fd, NULL);
+				}
+				break;
+			case WATCH_MQTT:
+				if (u->m.fd < 0) {
+					break;
+				}
+				if ((events[i].events & (EPOLLERR | EPOLLHUP)) || ((events[i].events & EPOLLIN) &&
+				    mqtt_lite_read(&u->m) < 0)) {
+					unit_disconnected(u);
+					break;
+				}
+				unit_update(u);
+				break;
+			}
+		}
+		tick(now_us());
+	}
+
+	ESP_LOGI(TAG, "Exiting");
+	shutdown_units();
+	freeaddrinfo(broker);
+	return 0;
+}
@@ -29,10 +29,14 @@
 
 #include "esp_log.h"
 
+#include "history.h"
+#include "http_api.h"
+#include "mem_budget.h"
 #include "panasonic_ir.h"
 #include "panasonic_state.h"
 #include "mqtt.h"
 #include "ota.h"
+#include "task_stats.h"
 
 static const char TAG[] = "APP";
 static char device_id[6 * 2 + 1];
@@ -75,7 +79,15 @@ void app_main(void)
 	}
 
 	panasonic_state_init();
+#if CONFIG_HISTORY_LOG
+	history_init();
+#endif
 	panasonic_ir_init(set_state, NULL);
 	mqtt_init(device_id);
-	ota_init(CONFIG_FIRMWARE_UPGRADE_URL);
+	ota_init(device_id);
+#if CONFIG_HTTP_API_PORT > 0
+	http_api_start(CONFIG_HTTP_API_PORT, CONFIG_HTTP_API_TOKEN);
+#endif
+	task_stats_init();
+	mem_budget_init();
 }
@@ -0,0 +1,378 @@
+/* Parallel broker probe, see broker_probe.h */
+
+#include "broker_probe.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef ESP_PLATFORM
+#include "esp_timer.h"
+#include "lwip/netdb.h"
+#include "lwip/sockets.h"
+#else
+#include <netdb.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <time.h>
+#endif
+
+#include "esp_log.h"
+
+static const char TAG[] = "BROKER";
+
+#define PROBE_HOST_MAX 64
+#define PROBE_CRED_MAX 64
+
+struct probe {
+	int fd;
+	bool mqtt;              /*!< Wait for a CONNACK, not just the TCP handshake */
+	bool connecting;
+	char user[PROBE_CRED_MAX];
+	char pass[PROBE_CRED_MAX];
+	uint8_t rx[4];
+	int rx_len;
+};
+
+static int64_t now_ms(void)
+{
+#ifdef ESP_PLATFORM
+	return esp_timer_get_time() / 1000;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+/*
+ * @brief Copy len bytes of s as a string, if they fit
+ */
+static int copy_part(char *dst, size_t size, const char *s, size_t len)
+{
+	if (len >= size) {
+		return -1;
+	}
+	memcpy(dst, s, len);
+	dst[len] = '\0';
+	return 0;
+}
+
+/*
+ * @brief Split "scheme://[user[:password]@]host[:port][/path]"
+ *
+ * user and pass, PROBE_CRED_MAX bytes each, are left empty if the URL has
+ * none. Returns 1 for mqtt://, 0 for the other schemes esp-mqtt knows,
+ * or -1.
+ */
+static int url_parse(const char *url, char *host, size_t size, char *port, char *user, char *pass)
+{
+	static const struct {
+		const char *scheme;
+		const char *port;
+	} schemes[] = {
+		{ "mqtt://", "1883" },
+		{ "mqtts://", "8883" },
+		{ "ws://", "80" },
+		{ "wss://", "443" },
+	};
+	const char *start = NULL;
+	const char *end;
+	const char *at;
+	int i;
+
+	for (i = 0; i < (int)(sizeof(schemes) / sizeof(schemes[0])); i++) {
+		if (strncmp(url, schemes[i].scheme, strlen(schemes[i].scheme)) == 0) {
+			start = url + strlen(schemes[i].scheme);
+			break;
+		}
+	}
+	if (start == NULL) {
+		return -1;
+	}
+
+	end = start + strcspn(start, "/");
+	at = memchr(start, '@', end - start);
+	user[0] = '\0';
+	pass[0] = '\0';
+	if (at != NULL) {
+		const char *colon = memchr(start, ':', at - start);
+
+		if (colon == NULL) {
+			colon = at;
+		} else if (copy_part(pass, PROBE_CRED_MAX, colon + 1, at - colon - 1) < 0) {
+			return -1;
+		}
+		if (copy_part(user, PROBE_CRED_MAX, start, colon - start) < 0) {
+			return -1;
+		}
+		start = at + 1;
+	}
+
+	strcpy(port, schemes[i].port);
+	for (const char *p = start; p < end; p++) {
+		if (*p == ':') {
+			if (end - p - 1 < 1 || end - p - 1 > 5) {
+				return -1;
+			}
+			memcpy(port, p + 1, end - p - 1);
+			port[end - p - 1] = '\0';
+			end = p;
+			break;
+		}
+	}
+
+	if (end == start || copy_part(host, size, start, end - start) < 0) {
+		return -1;
+	}
+	return i == 0;
+}
+
+static int probe_open(struct probe *p, const char *url)
+{
+	struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM };
+	struct addrinfo *res;
+	char host[PROBE_HOST_MAX];
+	char port[6];
+	int mqtt;
+
+	p->fd = -1;
+	mqtt = url_parse(url, host, sizeof(host), port, p->user, p->pass);
+	if (mqtt < 0) {
+		ESP_LOGE(TAG, "Bad broker URL %s", url);
+		return -1;
+	}
+	if (getaddrinfo(host, port, &hints, &res) != 0 || res == NULL) {
+		ESP_LOGW(TAG, "Cannot resolve %s", host);
+		return -1;
+	}
+
+	p->fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+	if (p->fd < 0) {
+		freeaddrinfo(res);
+		return -1;
+	}
+	fcntl(p->fd, F_SETFL, O_NONBLOCK);
+	if (connect(p->fd, res->ai_addr, res->ai_addrlen) < 0 && errno != EINPROGRESS) {
+		freeaddrinfo(res);
+		close(p->fd);
+		p->fd = -1;
+		return -1;
+	}
+	freeaddrinfo(res);
+
+	p->mqtt = mqtt;
+	p->connecting = true;
+	p->rx_len = 0;
+	return 0;
+}
+
+static void probe_close(struct probe *p)
+{
+	if (p->fd >= 0) {
+		close(p->fd);
+		p->fd = -1;
+	}
+}
+
+static size_t put_string(uint8_t *buf, const char *s, size_t len)
+{
+	buf[0] = len >> 8;
+	buf[1] = len & 0xff;
+	memcpy(buf + 2, s, len);
+	return 2 + len;
+}
+
+/*
+ * @brief Send an MQTT 3.1.1 CONNECT with a clean session and no will,
+ * with the URL's credentials if it has any
+ */
+static int probe_connect(struct probe *p, const char *client_id)
+{
+	uint8_t buf[3 + 10 + 3 * (2 + PROBE_CRED_MAX)];
+	size_t id_len = strlen(client_id);
+	size_t user_len = strlen(p->user);
+	size_t pass_len = strlen(p->pass);
+	size_t rem, len = 0;
+	uint8_t flags = 0x02;
+
+	if (id_len > PROBE_CRED_MAX) {
+		id_len = PROBE_CRED_MAX;
+	}
+	rem = 10 + 2 + id_len;
+	if (user_len > 0) {
+		flags |= 0x80;
+		rem += 2 + user_len;
+		if (pass_len > 0) {
+			flags |= 0x40;
+			rem += 2 + pass_len;
+		}
+	}
+
+	buf[len++] = 0x10;
+	if (rem > 127) {
+		buf[len++] = (rem & 0x7f) | 0x80;
+		buf[len++] = rem >> 7;
+	} else {
+		buf[len++] = rem;
+	}
+	memcpy(buf + len, "\0\4MQTT\4", 7);
+	len += 7;
+	buf[len++] = flags;
+	buf[len++] = 0;                 /* Keep alive, seconds */
+	buf[len++] = 10;
+	len += put_string(buf + len, client_id, id_len);
+	if (flags & 0x80) {
+		len += put_string(buf + len, p->user, user_len);
+	}
+	if (flags & 0x40) {
+		len += put_string(buf + len, p->pass, pass_len);
+	}
+
+	return send(p->fd, buf, len, 0) == (int)len ? 0 : -1;
+}
+
+/*
+ * @brief Advance a probe whose socket is ready
+ *
+ * Returns 1 once the broker has answered, 0 to keep waiting, or -1 if
+ * the probe failed.
+ */
+static int probe_step(struct probe *p, const char *client_id)
+{
+	int n;
+
+	if (p->connecting) {
+		int err = 0;
+		socklen_t err_len = sizeof(err);
+
+		if (getsockopt(p->fd, SOL_SOCKET, SO_ERROR, &err, &err_len) < 0 || err != 0) {
+			return -1;
+		}
+		p->connecting = false;
+		if (!p->mqtt) {
+			return 1;
+		}
+		return probe_connect(p, client_id);
+	}
+
+	n = recv(p->fd, p->rx + p->rx_len, sizeof(p->rx) - p->rx_len, 0);
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+		return 0;
+	}
+	if (n <= 0) {
+		return -1;
+	}
+	p->rx_len += n;
+	if (p->rx[0] != 0x20) {
+		return -1;
+	}
+	if (p->rx_len < (int)sizeof(p->rx)) {
+		return 0;
+	}
+	if (p->rx[1] != 2) {
+		return -1;
+	}
+	if (p->rx[3] != 0) {
+		/* Up, but it would refuse the real connection just the same */
+		ESP_LOGW(TAG, "Probe refused, CONNACK return code %d", p->rx[3]);
+		return -1;
+	}
+
+	/* Leave without a will being published for the probe */
+	send(p->fd, "\xe0\0", 2, 0);
+	return 1;
+}
+
+/*
+ * @brief Contact every broker in urls at once and return the index of the
+ * first to answer
+ *
+ * Returns -1 if none answers within timeout_ms. Names are resolved one
+ * broker after the other, so a broker earlier in the list gets a small
+ * head start; on a tie the preferred one wins.
+ */
+int broker_probe(const char *const urls[], int count, const char *client_id, int timeout_ms)
+{
+	struct probe probes[BROKER_MAX];
+	int64_t start;
+	int winner = -1;
+	int open = 0;
+
+	if (count > BROKER_MAX) {
+		count = BROKER_MAX;
+	}
+
+	start = now_ms();
+	for (int i = 0; i < count; i++) {
+		if (probe_open(&probes[i], urls[i]) == 0) {
+			open++;
+		}
+	}
+
+	while (winner < 0 && open > 0) {
+		int64_t left = start + timeout_ms - now_ms();
+		struct timeval tv;
+		fd_set rfds;
+		fd_set wfds;
+		int max_fd = -1;
+
+		if (left <= 0) {
+			break;
+		}
+		tv.tv_sec = left / 1000;
+		tv.tv_usec = left % 1000 * 1000;
+
+		FD_ZERO(&rfds);
+		FD_ZERO(&wfds);
+		for (int i = 0; i < count; i++) {
+			if (probes[i].fd < 0) {
+				continue;
+			}
+			FD_SET(probes[i].fd, probes[i].connecting ? &wfds : &rfds);
+			if (probes[i].fd > max_fd) {
+				max_fd = probes[i].fd;
+			}
+		}
+
+		if (select(max_fd + 1, &rfds, &wfds, NULL, &tv) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+
+		for (int i = 0; i < count && winner < 0; i++) {
+			int ret;
+
+			if (probes[i].fd < 0 || (!FD_ISSET(probes[i].fd, &rfds) && !FD_ISSET(probes[i].fd, &wfds))) {
+				continue;
+			}
+			ret = probe_step(&probes[i], client_id);
+			if (ret > 0) {
+				winner = i;
+			} else if (ret < 0) {
+				ESP_LOGW(TAG, "%s is down or refused the probe", urls[i]);
+				probe_close(&probes[i]);
+				open--;
+			}
+		}
+	}
+
+	for (int i = 0; i < count; i++) {
+		probe_close(&probes[i]);
+	}
+
+	if (winner >= 0) {
+		ESP_LOGI(TAG, "%s answered in %d ms", urls[winner], (int)(now_ms() - start));
+	} else {
+		ESP_LOGW(TAG, "No broker answered");
+	}
+	return winner;
+}
@@ -0,0 +1,24 @@
+#ifndef BROKER_PROBE_H
+#define BROKER_PROBE_H
+
+/* Find the broker that answers first
+
+   Every broker in the list is contacted at once. For mqtt:// a probe is
+   a clean session CONNECT under its own client id, with the user and
+   password from the URL, and the broker counts as up only once it
+   accepts it; one that answers "server unavailable" or "not authorised"
+   is passed over like one that is down. mqtts://, ws:// and wss://
+   brokers are only probed up to the TCP handshake, since a TLS handshake
+   to each of them would take more CPU than the choice is worth, so for
+   those the probe says nothing about the login.
+
+   Plain sockets and select(), so the same code runs on lwIP and on the
+   host.
+*/
+
+#define BROKER_MAX              4
+#define BROKER_PROBE_TIMEOUT_MS 3000
+
+int broker_probe(const char *const urls[], int count, const char *client_id, int timeout_ms);
+
+#endif /* BROKER_PROBE_H */
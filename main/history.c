@@ -0,0 +1,362 @@
+/* State history log, see history.h
+
+   Slots are numbered from the start of the partition. The head is the
+   next slot to write; it is found at boot from the sector whose first
+   record has the highest sequence number.
+*/
+
+#include "history.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_system.h"
+
+#include "mem_budget.h"
+#include "mqtt.h"
+#include "mqtt_topics.h"
+#include "panasonic_frame.h"
+
+static const char TAG[] = "HISTORY";
+
+#define SLOTS_PER_SECTOR (SPI_FLASH_SEC_SIZE / HISTORY_RECORD_SIZE)
+#define SEQ_ERASED       0xffffffff
+
+/* What callers hand to the task; the frame is built there */
+struct history_entry {
+	enum {
+		ENTRY_CHANGE,
+		ENTRY_QUERY,
+	} type;
+	union {
+		struct {
+			uint32_t time;
+			uint8_t source;
+			uint8_t reason;
+			struct panasonic_command cmd;
+		} change;
+		struct {
+			uint32_t from;
+			uint32_t count;
+			bool latest;    /*!< The last count records, from is unused */
+		} query;
+	};
+};
+
+static const esp_partition_t *part;
+static uint32_t slots;
+static uint32_t head;
+static uint32_t next_seq;
+static QueueHandle_t history_queue;
+static uint32_t dropped;
+
+/* Records not yet in flash */
+static struct history_record batch[HISTORY_BATCH];
+static int batch_len;
+
+static uint16_t crc16(const uint8_t *data, size_t len)
+{
+	uint16_t crc = 0xffff;
+
+	while (len--) {
+		crc ^= *data++ << 8;
+		for (int i = 0; i < 8; i++) {
+			crc = crc & 0x8000 ? crc << 1 ^ 0x1021 : crc << 1;
+		}
+	}
+	return crc;
+}
+
+static bool record_valid(const struct history_record *r)
+{
+	return r->seq != SEQ_ERASED && r->crc == crc16((const uint8_t *)r, offsetof(struct history_record, crc));
+}
+
+static uint8_t state_changes(const struct panasonic_command *old, const struct panasonic_command *cmd)
+{
+	uint8_t reason = 0;
+
+	if (cmd->cmd != CMD_STATE) {
+		return HISTORY_COMMAND;
+	}
+	if (old == NULL) {
+		return HISTORY_POWER | HISTORY_MODE | HISTORY_TEMP | HISTORY_FAN | HISTORY_SWING;
+	}
+
+	reason |= old->on != cmd->on ? HISTORY_POWER : 0;
+	reason |= old->mode != cmd->mode ? HISTORY_MODE : 0;
+	reason |= old->temp != cmd->temp ? HISTORY_TEMP : 0;
+	reason |= old->fan != cmd->fan ? HISTORY_FAN : 0;
+	reason |= old->swing != cmd->swing ? HISTORY_SWING : 0;
+	reason |= old->on_timer != cmd->on_timer || old->off_timer != cmd->off_timer ||
+	          old->on_time != cmd->on_time || old->off_time != cmd->off_time ? HISTORY_TIMER : 0;
+	return reason;
+}
+
+/*
+ * @brief Write the batch at the head, erasing each sector as it is entered
+ */
+static void batch_flush(void)
+{
+	int done = 0;
+
+	while (done < batch_len) {
+		uint32_t in_sector = head % SLOTS_PER_SECTOR;
+		int run = batch_len - done;
+		esp_err_t err = ESP_OK;
+
+		if (run > SLOTS_PER_SECTOR - in_sector) {
+			run = SLOTS_PER_SECTOR - in_sector;
+		}
+		if (in_sector == 0) {
+			err = esp_partition_erase_range(part, head * HISTORY_RECORD_SIZE, SPI_FLASH_SEC_SIZE);
+		}
+		if (err == ESP_OK) {
+			err = esp_partition_write(part, head * HISTORY_RECORD_SIZE, &batch[done],
+			                          run * HISTORY_RECORD_SIZE);
+		}
+		if (err != ESP_OK) {
+			ESP_LOGE(TAG, "Write at slot %u failed: %s", head, esp_err_to_name(err));
+		}
+
+		head = (head + run) % slots;
+		done += run;
+	}
+	batch_len = 0;
+}
+
+static void batch_add(const struct history_entry *e)
+{
+	struct history_record *r = &batch[batch_len++];
+	int len = 0;
+
+	memset(r, 0, sizeof(*r));
+	if (e->change.source != SOURCE_BOOT) {
+		len = panasonic_build_frame(&e->change.cmd, r->frame, sizeof(r->frame));
+	}
+	r->seq = next_seq++;
+	r->time = e->change.time;
+	r->source = e->change.source;
+	r->reason = e->change.reason;
+	r->len = len > 0 ? len : 0;
+	r->crc = crc16((const uint8_t *)r, offsetof(struct history_record, crc));
+
+	if (batch_len == HISTORY_BATCH) {
+		batch_flush();
+	}
+}
+
+/*
+ * @brief Find the head and the next sequence number
+ */
+static void head_find(void)
+{
+	struct history_record r;
+	uint32_t best = slots;
+	uint32_t best_seq = 0;
+
+	for (uint32_t s = 0; s < slots; s += SLOTS_PER_SECTOR) {
+		if (esp_partition_read(part, s * HISTORY_RECORD_SIZE, &r, sizeof(r)) == ESP_OK &&
+		    record_valid(&r) && (best == slots || r.seq > best_seq)) {
+			best = s;
+			best_seq = r.seq;
+		}
+	}
+
+	if (best == slots) {
+		head = 0;
+		next_seq = 0;
+		return;
+	}
+
+	/* The first free slot after it, or the next sector if it is full */
+	head = best;
+	next_seq = best_seq + 1;
+	for (uint32_t i = best + 1; i < best + SLOTS_PER_SECTOR; i++) {
+		if (esp_partition_read(part, i * HISTORY_RECORD_SIZE, &r, sizeof(r)) != ESP_OK ||
+		    r.seq == SEQ_ERASED) {
+			head = i;
+			return;
+		}
+		if (record_valid(&r)) {
+			next_seq = r.seq + 1;
+		}
+	}
+	head = (best + SLOTS_PER_SECTOR) % slots;
+}
+
+/*
+ * @brief Send the records of a query in HISTORY_CHUNK sized messages
+ *
+ * The ring is read from its oldest sector on. That is the one after the
+ * head's, unless the head is at the start of a sector: then the head's
+ * sector has not been erased for this pass yet and still holds the
+ * oldest records. Records are sent as stored, so a consumer can check
+ * them against their CRC.
+ */
+static void query_run(uint32_t from, uint32_t count)
+{
+	static struct history_record buf[HISTORY_CHUNK];
+	static struct history_record out[HISTORY_CHUNK];
+	uint32_t start = head % SLOTS_PER_SECTOR == 0 ? head :
+	                 (head / SLOTS_PER_SECTOR + 1) * SLOTS_PER_SECTOR % slots;
+	int n = 0;
+
+	for (uint32_t i = 0; i < slots && count > 0; i += HISTORY_CHUNK) {
+		uint32_t slot = (start + i) % slots;
+
+		if (esp_partition_read(part, slot * HISTORY_RECORD_SIZE, buf, sizeof(buf)) != ESP_OK) {
+			break;
+		}
+		for (int j = 0; j < HISTORY_CHUNK && count > 0; j++) {
+			if (!record_valid(&buf[j]) || buf[j].seq < from) {
+				continue;
+			}
+			out[n++] = buf[j];
+			count--;
+			if (n == HISTORY_CHUNK) {
+				mqtt_pub(HISTORY_TOPIC, (const char *)out, sizeof(out), 0, 0);
+				n = 0;
+			}
+		}
+	}
+
+	if (n > 0) {
+		mqtt_pub(HISTORY_TOPIC, (const char *)out, n * HISTORY_RECORD_SIZE, 0, 0);
+	}
+	mqtt_pub(HISTORY_TOPIC, "", 0, 0, 0);
+}
+
+static void history_task(void *arg)
+{
+	struct history_entry e;
+
+	for (;;) {
+		TickType_t wait = batch_len > 0 ? pdMS_TO_TICKS(HISTORY_FLUSH_MS) : portMAX_DELAY;
+
+		if (xQueueReceive(history_queue, &e, wait) != pdTRUE) {
+			batch_flush();
+			continue;
+		}
+
+		if (__atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED) != 0) {
+			ESP_LOGW(TAG, "Queue was full, changes were not logged");
+		}
+
+		if (e.type == ENTRY_CHANGE) {
+			batch_add(&e);
+		} else {
+			uint32_t from = e.query.from;
+
+			/* Queries see everything logged before them */
+			batch_flush();
+			if (e.query.latest) {
+				from = next_seq > e.query.count ? next_seq - e.query.count : 0;
+			}
+			query_run(from, e.query.count);
+		}
+	}
+}
+
+/*
+ * @brief Log a state change
+ *
+ * old is the state before it, or NULL if unknown. Never blocks: with the
+ * queue full, the change is counted as lost instead.
+ */
+void history_log(enum state_source source, const struct panasonic_command *old,
+                 const struct panasonic_command *cmd)
+{
+	struct history_entry e = {
+		.type = ENTRY_CHANGE,
+		.change.time = time(NULL),
+		.change.source = source,
+	};
+
+	if (history_queue == NULL) {
+		return;
+	}
+
+	if (cmd != NULL) {
+		e.change.cmd = *cmd;
+		e.change.reason = state_changes(old, cmd);
+	} else {
+		e.change.reason = esp_reset_reason();
+	}
+	if (xQueueSend(history_queue, &e, 0) != pdTRUE) {
+		__atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * @brief Ask for records, from the payload of HISTORY_TOPIC"/get"
+ *
+ * "<from> [<count>]" asks for up to count records from sequence number
+ * from on, "-<count>" for the last count, and an empty payload for the
+ * last HISTORY_QUERY_DEFAULT.
+ */
+void history_query(const char *data, int len)
+{
+	struct history_entry e = { .type = ENTRY_QUERY };
+	char s[24];
+	char *end;
+	long from;
+
+	if (history_queue == NULL) {
+		return;
+	}
+
+	snprintf(s, sizeof(s), "%.*s", len, data);
+	from = strtol(s, &end, 10);
+	if (end == s || from < 0) {
+		e.query.latest = true;
+		e.query.count = end == s ? HISTORY_QUERY_DEFAULT : -from;
+	} else {
+		e.query.from = from;
+		e.query.count = strtoul(end, &end, 10);
+		if (e.query.count == 0) {
+			e.query.count = HISTORY_QUERY_DEFAULT;
+		}
+	}
+
+	if (xQueueSend(history_queue, &e, 0) != pdTRUE) {
+		ESP_LOGW(TAG, "Busy, query dropped");
+	}
+}
+
+void history_init(void)
+{
+	TaskHandle_t task;
+
+	part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, HISTORY_PARTITION);
+	if (part == NULL || part->size < 2 * SPI_FLASH_SEC_SIZE) {
+		ESP_LOGE(TAG, "No \"%s\" partition of two sectors or more", HISTORY_PARTITION);
+		return;
+	}
+	slots = part->size / SPI_FLASH_SEC_SIZE * SLOTS_PER_SECTOR;
+	head_find();
+	ESP_LOGI(TAG, "%u records, head at slot %u, next record %u", slots, head, next_seq);
+
+#if CONFIG_STATIC_MEMORY
+	static uint8_t queue_storage[HISTORY_QUEUE_LEN * sizeof(struct history_entry)];
+	static StaticQueue_t queue_buf;
+	static StackType_t stack[HISTORY_TASK_STACK];
+	static StaticTask_t task_buf;
+
+	history_queue = xQueueCreateStatic(HISTORY_QUEUE_LEN, sizeof(struct history_entry), queue_storage, &queue_buf);
+	task = xTaskCreateStatic(history_task, "history", HISTORY_TASK_STACK, NULL, 1, stack, &task_buf);
+#else
+	history_queue = xQueueCreate(HISTORY_QUEUE_LEN, sizeof(struct history_entry));
+	xTaskCreate(history_task, "history", HISTORY_TASK_STACK, NULL, 1, &task);
+#endif
+	mem_register_task(task, HISTORY_TASK_STACK);
+
+	history_log(SOURCE_BOOT, NULL, NULL);
+}
@@ -0,0 +1,60 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+/* Append-only log of state changes, in the "history" data partition
+
+   Every change is kept as one HISTORY_RECORD_SIZE record: when, where it
+   came from, which fields it changed and the frame for it. The partition
+   is a ring of flash sectors written in order, so each sector is erased
+   once per pass and wear is even; a new pass erases the oldest sector.
+
+   Records are queued without blocking and written in batches by a low
+   priority task. A message to HISTORY_TOPIC"/get" asks for a range; the
+   records come back on HISTORY_TOPIC as they are stored, up to
+   HISTORY_CHUNK per message, followed by an empty message.
+
+   Needs CONFIG_HISTORY_LOG and a partition table with the partition, such
+   as partitions.csv.
+*/
+
+#include <stdint.h>
+
+#include "panasonic_pulse.h"
+#include "panasonic_state.h"
+
+#define HISTORY_PARTITION     "history"
+#define HISTORY_RECORD_SIZE   32
+#define HISTORY_BATCH         8         /*!< Records written to flash at a time */
+#define HISTORY_FLUSH_MS      5000      /*!< Longest a record waits for a batch */
+#define HISTORY_CHUNK         16        /*!< Records per message of a query */
+#define HISTORY_QUERY_DEFAULT 64
+
+/* Reason bits of a change: the fields it changed. A repeat of the current
+   state has none. Boot records carry esp_reset_reason() instead. */
+#define HISTORY_POWER   0x01
+#define HISTORY_MODE    0x02
+#define HISTORY_TEMP    0x04
+#define HISTORY_FAN     0x08
+#define HISTORY_SWING   0x10
+#define HISTORY_TIMER   0x20
+#define HISTORY_COMMAND 0x40            /*!< A special command, not a state */
+
+/* As stored in flash and sent on HISTORY_TOPIC, little endian */
+struct history_record {
+	uint32_t seq;                   /*!< One more than the record before; erased slots read all ones */
+	uint32_t time;                  /*!< time(): wall clock if set, else seconds since boot */
+	uint8_t source;                 /*!< enum state_source */
+	uint8_t reason;
+	uint8_t len;                    /*!< Frame length, 0 for boot records */
+	uint8_t frame[PANASONIC_FRAME_MAXLEN];
+	uint16_t crc;                   /*!< CRC-16/CCITT of the bytes before it */
+};
+
+_Static_assert(sizeof(struct history_record) == HISTORY_RECORD_SIZE, "history record size");
+
+void history_log(enum state_source source, const struct panasonic_command *old,
+                 const struct panasonic_command *cmd);
+void history_query(const char *data, int len);
+void history_init(void);
+
+#endif /* HISTORY_H */
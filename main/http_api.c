@@ -0,0 +1,442 @@
+/* Local HTTP control, see http_api.h
+
+   One task, one select() loop. State changes arrive from whichever task
+   made them through a one byte datagram on a loopback UDP socket, which
+   wakes the loop to send the new state to every event stream.
+*/
+
+#include "http_api.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#ifdef ESP_PLATFORM
+#include "lwip/sockets.h"
+#else
+#include <netinet/in.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#endif
+
+#include "esp_log.h"
+#include "mem_budget.h"
+#include "mqtt_topics.h"
+#include "panasonic_state.h"
+
+static const char TAG[] = "HTTP";
+
+#define HTTP_BUF_SIZE 1024
+
+struct client {
+	int fd;
+	bool events;            /*!< Switched to a server-sent event stream */
+	size_t len;
+	char buf[HTTP_BUF_SIZE];
+};
+
+static struct client clients[HTTP_API_MAX_CLIENTS];
+static char token[HTTP_API_TOKEN_MAX];
+static int listen_fd = -1;
+static int wake_fd = -1;
+static struct sockaddr_in wake_addr;
+
+static void client_close(struct client *c)
+{
+	close(c->fd);
+	c->fd = -1;
+	c->events = false;
+	c->len = 0;
+}
+
+static int send_all(struct client *c, const char *data, size_t len)
+{
+	while (len > 0) {
+		int n = send(c->fd, data, len, 0);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n <= 0) {
+			return -1;
+		}
+		data += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * @brief Send a whole response in one segment, so that Nagle's algorithm
+ * has nothing to hold back for the peer's delayed ACK
+ */
+static int respond(struct client *c, int status, const char *reason, const char *body, bool keep_alive)
+{
+	char msg[200 + STATE_JSON_MAXLEN];
+	int n;
+
+	n = snprintf(msg, sizeof(msg),
+	             "HTTP/1.1 %d %s\r\n"
+	             "Content-Type: %s\r\n"
+	             "Content-Length: %u\r\n"
+	             "%s%s"
+	             "\r\n"
+	             "%s",
+	             status, reason, status == 200 ? "application/json" : "text/plain",
+	             (unsigned int)strlen(body), status == 401 ? "WWW-Authenticate: Bearer\r\n" : "",
+	             keep_alive ? "" : "Connection: close\r\n", body);
+
+	if (n >= (int)sizeof(msg) || send_all(c, msg, n) < 0) {
+		return -1;
+	}
+	return keep_alive ? 0 : -1;
+}
+
+static int state_json(char *buf, size_t size)
+{
+	struct panasonic_command cmd;
+
+	panasonic_get_state(&cmd);
+	return panasonic_state_to_json(buf, size, &cmd);
+}
+
+static int post_state(struct client *c, const char *body, size_t len, bool keep_alive)
+{
+	struct mqtt_set_request reqs[MQTT_SET_FIELDS];
+	char json[STATE_JSON_MAXLEN];
+	int count;
+
+	count = mqtt_parse_state(reqs, body, len);
+	if (count < 0) {
+		return respond(c, 400, "Bad Request", "invalid value", keep_alive);
+	} else if (count == 0) {
+		return respond(c, 400, "Bad Request", "no fields", keep_alive);
+	}
+
+	panasonic_set_fields(reqs, count, SOURCE_HTTP, NULL);
+	state_json(json, sizeof(json));
+	return respond(c, 200, "OK", json, keep_alive);
+}
+
+static int start_events(struct client *c)
+{
+	char json[STATE_JSON_MAXLEN];
+	char msg[150 + STATE_JSON_MAXLEN];
+	int n;
+
+	state_json(json, sizeof(json));
+	n = snprintf(msg, sizeof(msg),
+	             "HTTP/1.1 200 OK\r\n"
+	             "Content-Type: text/event-stream\r\n"
+	             "Cache-Control: no-cache\r\n"
+	             "\r\n"
+	             "data: %s\n\n", json);
+	if (n >= (int)sizeof(msg) || send_all(c, msg, n) < 0) {
+		return -1;
+	}
+	c->events = true;
+	return 0;
+}
+
+/*
+ * @brief Whether the request carries the configured bearer token, if any
+ *
+ * Compares every byte, so the time taken does not tell how much of a
+ * guess was right.
+ */
+static bool authorized(const char *value)
+{
+	size_t len = strlen(token);
+	unsigned char diff = 0;
+
+	if (len == 0) {
+		return true;
+	}
+	if (value == NULL || strncasecmp(value, "Bearer ", 7) != 0) {
+		return false;
+	}
+	value += 7;
+	for (size_t i = 0; i < len; i++) {
+		diff |= value[i] ^ token[i];
+		if (value[i] == '\0') {
+			return false;
+		}
+	}
+	return diff == 0 && (value[len] == '\r' || value[len] == ' ');
+}
+
+/*
+ * @brief Handle one complete request; -1 closes the connection
+ *
+ * POST takes only application/json: a browser has to ask before sending
+ * that cross-origin, and no Access-Control-Allow-Origin ever says yes,
+ * so other web pages on the LAN cannot change the state.
+ */
+static int handle_request(struct client *c, const char *method, const char *path,
+                          const char *body, size_t body_len, const char *type, bool keep_alive)
+{
+	char json[STATE_JSON_MAXLEN];
+
+	ESP_LOGD(TAG, "%s %s", method, path);
+
+	if (strcmp(path, "/state") == 0) {
+		if (strcmp(method, "GET") == 0) {
+			state_json(json, sizeof(json));
+			return respond(c, 200, "OK", json, keep_alive);
+		} else if (strcmp(method, "POST") == 0) {
+			if (type == NULL || strncasecmp(type, "application/json", 16) != 0) {
+				return respond(c, 415, "Unsupported Media Type", "application/json only", keep_alive);
+			}
+			return post_state(c, body, body_len, keep_alive);
+		}
+		return respond(c, 405, "Method Not Allowed", "", keep_alive);
+	} else if (strcmp(path, "/events") == 0 && strcmp(method, "GET") == 0) {
+		return start_events(c);
+	}
+	return respond(c, 404, "Not Found", "", keep_alive);
+}
+
+/*
+ * @brief Value of a request header, or NULL; end points at the blank line
+ */
+static const char *header_value(const char *head, const char *end, const char *name)
+{
+	size_t len = strlen(name);
+	const char *line = strstr(head, "\r\n");
+
+	while (line != NULL && line < end) {
+		line += 2;
+		if (strncasecmp(line, name, len) == 0 && line[len] == ':') {
+			return line + len + 1 + strspn(line + len + 1, " \t");
+		}
+		line = strstr(line, "\r\n");
+	}
+	return NULL;
+}
+
+/*
+ * @brief Process every complete request in the client's buffer
+ */
+static int client_parse(struct client *c)
+{
+	for (;;) {
+		char method[8], path[32];
+		const char *end, *value;
+		size_t head_len, body_len = 0;
+		bool keep_alive;
+		int ret;
+
+		c->buf[c->len] = '\0';
+		end = strstr(c->buf, "\r\n\r\n");
+		if (end == NULL) {
+			return c->len < sizeof(c->buf) - 1 ? 0 : -1;
+		}
+		head_len = end + 4 - c->buf;
+
+		if (sscanf(c->buf, "%7s %31s", method, path) != 2) {
+			return -1;
+		}
+		value = header_value(c->buf, end, "Content-Length");
+		if (value != NULL) {
+			body_len = strtoul(value, NULL, 10);
+		}
+		/* head_len fits, so this cannot overflow whatever the client sent */
+		if (body_len > sizeof(c->buf) - 1 - head_len) {
+			respond(c, 413, "Payload Too Large", "", false);
+			return -1;
+		}
+		if (c->len < head_len + body_len) {
+			return 0;
+		}
+		value = header_value(c->buf, end, "Connection");
+		keep_alive = value == NULL || strncasecmp(value, "close", 5) != 0;
+
+		if (!authorized(header_value(c->buf, end, "Authorization"))) {
+			ret = respond(c, 401, "Unauthorized", "", keep_alive);
+		} else {
+			ret = handle_request(c, method, path, c->buf + head_len, body_len,
+			                     header_value(c->buf, end, "Content-Type"), keep_alive);
+		}
+		if (ret < 0 || c->events) {
+			return ret;
+		}
+
+		c->len -= head_len + body_len;
+		memmove(c->buf, c->buf + head_len + body_len, c->len);
+	}
+}
+
+static void client_read(struct client *c)
+{
+	int n = recv(c->fd, c->buf + c->len, sizeof(c->buf) - 1 - c->len, 0);
+
+	if (n <= 0) {
+		client_close(c);
+		return;
+	}
+	if (c->events) {
+		/* Nothing more is expected on an event stream */
+		return;
+	}
+	c->len += n;
+	if (client_parse(c) < 0) {
+		client_close(c);
+	}
+}
+
+static void accept_client(void)
+{
+	struct timeval timeout = { .tv_sec = 2 };
+	int fd = accept(listen_fd, NULL, NULL);
+
+	if (fd < 0) {
+		return;
+	}
+	for (int i = 0; i < HTTP_API_MAX_CLIENTS; i++) {
+		if (clients[i].fd < 0) {
+			/* A stuck client must not hold up the loop for long */
+			setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+			clients[i].fd = fd;
+			return;
+		}
+	}
+	ESP_LOGW(TAG, "Too many clients");
+	close(fd);
+}
+
+static void broadcast_state(void)
+{
+	char json[STATE_JSON_MAXLEN];
+	char event[STATE_JSON_MAXLEN + 8];
+	int n;
+
+	state_json(json, sizeof(json));
+	n = snprintf(event, sizeof(event), "data: %s\n\n", json);
+
+	for (int i = 0; i < HTTP_API_MAX_CLIENTS; i++) {
+		struct client *c = &clients[i];
+
+		if (c->fd >= 0 && c->events && send(c->fd, event, n, MSG_DONTWAIT) != n) {
+			client_close(c);
+		}
+	}
+}
+
+/*
+ * @brief Wake the server loop to send the new state to event streams
+ *
+ * Called from panasonic_state.c in the task that changed the state.
+ */
+void http_api_notify(void)
+{
+	sendto(wake_fd, "", 1, MSG_DONTWAIT, (struct sockaddr *)&wake_addr, sizeof(wake_addr));
+}
+
+/*
+ * @brief Listen on port; with a non-empty bearer_token, every request
+ * must carry "Authorization: Bearer <bearer_token>"
+ */
+int http_api_init(uint16_t port, const char *bearer_token)
+{
+	struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port) };
+	socklen_t len = sizeof(wake_addr);
+	int one = 1;
+
+	for (int i = 0; i < HTTP_API_MAX_CLIENTS; i++) {
+		clients[i].fd = -1;
+	}
+	snprintf(token, sizeof(token), "%s", bearer_token != NULL ? bearer_token : "");
+
+	listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(listen_fd, HTTP_API_MAX_CLIENTS) < 0) {
+		ESP_LOGE(TAG, "Cannot listen on port %u: %s", port, strerror(errno));
+		return -1;
+	}
+	fcntl(listen_fd, F_SETFL, O_NONBLOCK);
+
+	wake_addr.sin_family = AF_INET;
+	wake_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	wake_fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (wake_fd < 0 || bind(wake_fd, (struct sockaddr *)&wake_addr, sizeof(wake_addr)) < 0 ||
+	    getsockname(wake_fd, (struct sockaddr *)&wake_addr, &len) < 0) {
+		ESP_LOGE(TAG, "Cannot create wake socket: %s", strerror(errno));
+		return -1;
+	}
+	fcntl(wake_fd, F_SETFL, O_NONBLOCK);
+
+	panasonic_state_listen(http_api_notify);
+	ESP_LOGI(TAG, "Listening on port %u%s", port, token[0] ? " with a bearer token" : "");
+	return 0;
+}
+
+void http_api_run(void)
+{
+	for (;;) {
+		fd_set rfds;
+		int maxfd = listen_fd > wake_fd ? listen_fd : wake_fd;
+		char drain[16];
+
+		FD_ZERO(&rfds);
+		FD_SET(listen_fd, &rfds);
+		FD_SET(wake_fd, &rfds);
+		for (int i = 0; i < HTTP_API_MAX_CLIENTS; i++) {
+			if (clients[i].fd >= 0) {
+				FD_SET(clients[i].fd, &rfds);
+				maxfd = clients[i].fd > maxfd ? clients[i].fd : maxfd;
+			}
+		}
+
+		if (select(maxfd + 1, &rfds, NULL, NULL, NULL) < 0) {
+			if (errno != EINTR) {
+				ESP_LOGE(TAG, "select: %s", strerror(errno));
+			}
+			continue;
+		}
+
+		if (FD_ISSET(wake_fd, &rfds)) {
+			/* Several changes in a row need only one event */
+			while (recv(wake_fd, drain, sizeof(drain), 0) > 0) {
+			}
+			broadcast_state();
+		}
+		if (FD_ISSET(listen_fd, &rfds)) {
+			accept_client();
+		}
+		for (int i = 0; i < HTTP_API_MAX_CLIENTS; i++) {
+			if (clients[i].fd >= 0 && FD_ISSET(clients[i].fd, &rfds)) {
+				client_read(&clients[i]);
+			}
+		}
+	}
+}
+
+#ifdef ESP_PLATFORM
+static void http_api_task(void *arg)
+{
+	http_api_run();
+}
+
+void http_api_start(uint16_t port, const char *bearer_token)
+{
+	TaskHandle_t task;
+
+	if (http_api_init(port, bearer_token) < 0) {
+		return;
+	}
+
+#if CONFIG_STATIC_MEMORY
+	static StackType_t stack[HTTP_API_TASK_STACK];
+	static StaticTask_t task_buf;
+
+	task = xTaskCreateStatic(http_api_task, "http_api", HTTP_API_TASK_STACK, NULL, 5, stack, &task_buf);
+#else
+	xTaskCreate(http_api_task, "http_api", HTTP_API_TASK_STACK, NULL, 5, &task);
+#endif
+	mem_register_task(task, HTTP_API_TASK_STACK);
+}
+#endif
@@ -0,0 +1,29 @@
+#ifndef HTTP_API_H
+#define HTTP_API_H
+
+/* Local HTTP control, independent of the MQTT broker
+
+     GET  /state    current state, as published on panasonic/<id>
+     POST /state    change some fields: {"mode":"cool","temperature":22}
+     GET  /events   server-sent events, one "data:" line per state change
+
+   Field names and values are those of the /set topics. A POST answers
+   with the new state once the IR frame has been sent, and must be sent
+   as application/json. With a bearer token configured, every request
+   needs "Authorization: Bearer <token>".
+
+   Plain sockets and select(), so the same code runs on lwIP and on the
+   host. http_api_start() runs it in its own task on the target.
+*/
+
+#include <stdint.h>
+
+#define HTTP_API_MAX_CLIENTS 4
+#define HTTP_API_TOKEN_MAX   65
+
+int http_api_init(uint16_t port, const char *bearer_token);
+void http_api_run(void);
+void http_api_notify(void);
+void http_api_start(uint16_t port, const char *bearer_token);
+
+#endif /* HTTP_API_H */
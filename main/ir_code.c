@@ -0,0 +1,115 @@
+#include "ir_code.h"
+
+#include <string.h>
+
+struct cluster {
+	uint32_t sum;
+	uint16_t count;
+	uint16_t center;
+};
+
+static int within(uint16_t d, uint16_t center)
+{
+	int tolerance = center / 8 > IR_CODE_TOLERANCE_US ? center / 8 : IR_CODE_TOLERANCE_US;
+
+	return d + tolerance >= center && d <= center + tolerance;
+}
+
+/*
+ * @brief Add a duration to the cluster it falls into, or start a new one
+ */
+static int cluster_add(struct cluster *cl, int *n, uint16_t d)
+{
+	/* An end of transmission only ever matches another one */
+	for (int i = 0; i < *n; i++) {
+		if ((d == 0) == (cl[i].center == 0) && within(d, cl[i].center)) {
+			cl[i].sum += d;
+			cl[i].count++;
+			cl[i].center = cl[i].sum / cl[i].count;
+			return 0;
+		}
+	}
+	if (*n == IR_CODE_DURATIONS) {
+		return -1;
+	}
+	cl[(*n)++] = (struct cluster){ .sum = d, .count = 1, .center = d };
+	return 0;
+}
+
+static int cluster_index(const struct cluster *cl, int n, uint16_t d)
+{
+	int best = 0;
+
+	for (int i = 1; i < n; i++) {
+		if ((cl[i].center > d ? cl[i].center - d : d - cl[i].center) <
+		    (cl[best].center > d ? cl[best].center - d : d - cl[best].center)) {
+			best = i;
+		}
+	}
+	return best;
+}
+
+/*
+ * @brief Compress a pulse sequence
+ *
+ * Returns the code length, or -1 if the sequence has more distinct
+ * durations than the table holds or does not fit in size.
+ */
+int ir_code_encode(uint8_t *code, size_t size, const struct panasonic_pulse *pulses, size_t count)
+{
+	struct cluster cl[IR_CODE_DURATIONS];
+	size_t len;
+	int n = 0;
+
+	for (size_t i = 0; i < count; i++) {
+		if (cluster_add(cl, &n, pulses[i].mark) < 0 || cluster_add(cl, &n, pulses[i].space) < 0) {
+			return -1;
+		}
+	}
+
+	len = 2 + 2 * n + count;
+	if (count == 0 || count > IR_CODE_PAIRS_MAX || len > size) {
+		return -1;
+	}
+
+	code[0] = IR_CODE_FORMAT;
+	code[1] = n;
+	for (int i = 0; i < n; i++) {
+		code[2 + 2 * i] = cl[i].center & 0xff;
+		code[3 + 2 * i] = cl[i].center >> 8;
+	}
+	for (size_t i = 0; i < count; i++) {
+		code[2 + 2 * n + i] = cluster_index(cl, n, pulses[i].mark) << 4 |
+		                      cluster_index(cl, n, pulses[i].space);
+	}
+	return len;
+}
+
+/*
+ * @brief Check a stored code and set c up to read its pairs
+ *
+ * The pairs are read in place, so code must outlive c.
+ */
+int ir_code_parse(struct ir_code *c, const uint8_t *code, size_t len)
+{
+	size_t n;
+
+	if (len < 2 || code[0] != IR_CODE_FORMAT || code[1] > IR_CODE_DURATIONS || len <= 2 + 2 * code[1]) {
+		return -1;
+	}
+
+	n = code[1];
+	memset(c->table, 0, sizeof(c->table));
+	for (size_t i = 0; i < n; i++) {
+		c->table[i] = code[2 + 2 * i] | code[3 + 2 * i] << 8;
+	}
+	c->pairs = code + 2 + 2 * n;
+	c->count = len - 2 - 2 * n;
+
+	for (size_t i = 0; i < c->count; i++) {
+		if ((c->pairs[i] >> 4) >= n || (c->pairs[i] & 0xf) >= n) {
+			return -1;
+		}
+	}
+	return 0;
+}
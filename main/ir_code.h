@@ -0,0 +1,50 @@
+#ifndef IR_CODE_H
+#define IR_CODE_H
+
+/* Compact storage for learned IR codes of any protocol
+
+   Remote controls use only a handful of distinct durations, so a code is
+   kept as a table of up to IR_CODE_DURATIONS durations, averaged over the
+   pulses that fall within tolerance of each other, followed by one byte
+   per mark/space pair: the table index of the mark in the high nibble
+   and of the space in the low one.
+
+     byte 0      IR_CODE_FORMAT
+     byte 1      number of table entries, n
+     2 .. 2n+1   durations in microseconds, little endian
+     2n+2 ..     pairs; a space of 0 ends the code
+
+   A 32 bit NEC code takes 46 bytes. No ESP-IDF dependencies.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "panasonic_pulse.h"
+
+#define IR_CODE_FORMAT       1
+#define IR_CODE_DURATIONS    16
+#define IR_CODE_PAIRS_MAX    256
+#define IR_CODE_TOLERANCE_US 60         /*!< Or 1/8 of the duration, if more */
+#define IR_CODE_MAXLEN       (2 + 2 * IR_CODE_DURATIONS + IR_CODE_PAIRS_MAX)
+
+struct ir_code {
+	uint16_t table[IR_CODE_DURATIONS];
+	const uint8_t *pairs;
+	size_t count;
+};
+
+int ir_code_encode(uint8_t *code, size_t size, const struct panasonic_pulse *pulses, size_t count);
+int ir_code_parse(struct ir_code *c, const uint8_t *code, size_t len);
+
+static inline uint16_t ir_code_mark(const struct ir_code *c, uint8_t pair)
+{
+	return c->table[pair >> 4];
+}
+
+static inline uint16_t ir_code_space(const struct ir_code *c, uint8_t pair)
+{
+	return c->table[pair & 0xf];
+}
+
+#endif /* IR_CODE_H */
@@ -0,0 +1,120 @@
+#include "ir_histogram.h"
+
+#include <stdio.h>
+
+static const char *const class_names[IR_HIST_CLASSES] = {
+	[IR_HIST_BIT_0]   = "bit0",
+	[IR_HIST_BIT_1]   = "bit1",
+	[IR_HIST_HEADER]  = "header",
+	[IR_HIST_INVALID] = "invalid",
+};
+
+static inline unsigned int bin(uint16_t us)
+{
+	unsigned int b = us >> IR_HIST_BIN_SHIFT;
+
+	return b < IR_HIST_BINS ? b : IR_HIST_BINS - 1;
+}
+
+static inline int near_below(uint16_t us, int threshold)
+{
+	return us <= threshold && us > threshold - IR_HIST_NEAR_US;
+}
+
+/*
+ * @brief Count one mark/space pair under the class the decoder gave it
+ *
+ * End of transmission pairs carry no space and are left out.
+ */
+void ir_histogram_add(struct ir_histogram *h, enum pana_item item, uint16_t mark, uint16_t space)
+{
+	enum ir_hist_class c;
+
+	switch (item) {
+	case PANA_BIT_0:
+		c = IR_HIST_BIT_0;
+		break;
+	case PANA_BIT_1:
+		c = IR_HIST_BIT_1;
+		break;
+	case PANA_HEADER:
+		c = IR_HIST_HEADER;
+		break;
+	case PANA_INVALID:
+		c = IR_HIST_INVALID;
+		break;
+	default:
+		return;
+	}
+
+	h->mark[c][bin(mark)]++;
+	h->space[c][bin(space)]++;
+
+	if (c == IR_HIST_INVALID) {
+		if (mark < MARK_US - BIT_MARGIN && mark >= MARK_US - BIT_MARGIN - IR_HIST_NEAR_US) {
+			h->near.mark_short++;
+		} else if (mark > MARK_US + BIT_MARGIN && mark <= MARK_US + BIT_MARGIN + IR_HIST_NEAR_US) {
+			h->near.mark_long++;
+		} else if (near_below(mark, HEADER_MARK_MIN_US)) {
+			h->near.header_mark++;
+		} else if (near_below(space, HEADER_SPACE_MIN_US) && mark < space) {
+			h->near.header_space++;
+		}
+	} else if (c != IR_HIST_HEADER &&
+	           space + IR_HIST_NEAR_US > 2 * mark && space < 2 * mark + IR_HIST_NEAR_US) {
+		h->near.bit_split++;
+	}
+}
+
+/*
+ * @brief Print one series as a line of text
+ *
+ * Series 0 holds the bin width, the margins and the near miss counts.
+ * The others are "<class> mark|space" followed by "<bin>:<count>" for
+ * every non-empty bin; bin b covers [b * IR_HIST_BIN_US, (b + 1) *
+ * IR_HIST_BIN_US). A line that does not fit in buf is cut after the last
+ * whole entry. Returns the length, or -1 past the last series.
+ */
+int ir_histogram_dump(const struct ir_histogram *h, int series, char *buf, size_t size)
+{
+	const uint32_t *bins;
+	size_t len;
+	int n;
+
+	if (series < 0 || series >= IR_HIST_SERIES || size == 0) {
+		return -1;
+	}
+
+	if (series == 0) {
+		n = snprintf(buf, size, "bin %d margin %d near %d mark_short %u mark_long %u "
+		             "header_mark %u header_space %u bit_split %u",
+		             IR_HIST_BIN_US, BIT_MARGIN, IR_HIST_NEAR_US,
+		             (unsigned int)h->near.mark_short, (unsigned int)h->near.mark_long,
+		             (unsigned int)h->near.header_mark, (unsigned int)h->near.header_space,
+		             (unsigned int)h->near.bit_split);
+		return n < (int)size ? n : (int)size - 1;
+	}
+
+	series--;
+	bins = series % 2 == 0 ? h->mark[series / 2] : h->space[series / 2];
+	n = snprintf(buf, size, "%s %s", class_names[series / 2], series % 2 == 0 ? "mark" : "space");
+	if (n >= (int)size) {
+		buf[0] = '\0';
+		return 0;
+	}
+	len = n;
+
+	for (int b = 0; b < IR_HIST_BINS; b++) {
+		if (bins[b] == 0) {
+			continue;
+		}
+		n = snprintf(buf + len, size - len, " %d:%u", b, (unsigned int)bins[b]);
+		if (n >= (int)(size - len)) {
+			buf[len] = '\0';
+			break;
+		}
+		len += n;
+	}
+
+	return len;
+}
@@ -0,0 +1,50 @@
+#ifndef IR_HISTOGRAM_H
+#define IR_HISTOGRAM_H
+
+/* Received mark and space durations, for tuning the receiver per site
+
+   Fixed IR_HIST_BIN_US wide bins, one mark and one space histogram per
+   class the decoder gave the pair (bit 0, bit 1, header, invalid), plus
+   counts of pairs that only just missed a threshold. Adding a pair is a
+   shift, a compare and two increments.
+
+   No ESP-IDF dependencies.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "panasonic_pulse.h"
+
+#define IR_HIST_BIN_SHIFT  5
+#define IR_HIST_BIN_US     (1 << IR_HIST_BIN_SHIFT)
+#define IR_HIST_BINS       128          /*!< The last bin takes everything longer */
+#define IR_HIST_NEAR_US    100          /*!< How far outside a threshold is a near miss */
+
+enum ir_hist_class {
+	IR_HIST_BIT_0,
+	IR_HIST_BIT_1,
+	IR_HIST_HEADER,
+	IR_HIST_INVALID,
+	IR_HIST_CLASSES
+};
+
+struct ir_histogram {
+	uint32_t mark[IR_HIST_CLASSES][IR_HIST_BINS];
+	uint32_t space[IR_HIST_CLASSES][IR_HIST_BINS];
+	struct {
+		uint32_t mark_short;    /*!< Bit mark below MARK_US - BIT_MARGIN */
+		uint32_t mark_long;     /*!< Bit mark above MARK_US + BIT_MARGIN */
+		uint32_t header_mark;   /*!< Mark just short of HEADER_MARK_MIN_US */
+		uint32_t header_space;  /*!< Space just short of HEADER_SPACE_MIN_US */
+		uint32_t bit_split;     /*!< Bit space close to the 0/1 boundary */
+	} near;
+};
+
+/* Number of series ir_histogram_dump() produces */
+#define IR_HIST_SERIES (1 + 2 * IR_HIST_CLASSES)
+
+void ir_histogram_add(struct ir_histogram *h, enum pana_item item, uint16_t mark, uint16_t space);
+int ir_histogram_dump(const struct ir_histogram *h, int series, char *buf, size_t size);
+
+#endif /* IR_HISTOGRAM_H */
@@ -0,0 +1,100 @@
+/* Stack high-water marks and heap usage at runtime
+
+   Tasks created by the application register here with the stack size
+   they were given, and mem_report() logs how much of it was never used.
+   The heap minimum tells whether anything still allocates after boot.
+*/
+
+#include "mem_budget.h"
+
+#include "freertos/timers.h"
+#include "esp_system.h"
+#include "esp_log.h"
+
+static const char TAG[] = "MEM";
+
+#if CONFIG_STATIC_MEMORY
+#define MEM_MODE "static"
+#else
+#define MEM_MODE "heap"
+#endif
+
+static struct {
+	TaskHandle_t task;
+	uint32_t stack_size;
+} tasks[MEM_BUDGET_TASKS];
+static int task_count;
+static uint32_t boot_free_heap;
+
+/*
+ * @brief Include a task in mem_report()
+ */
+void mem_register_task(TaskHandle_t task, uint32_t stack_size)
+{
+	if (task == NULL) {
+		return;
+	}
+	if (task_count == MEM_BUDGET_TASKS) {
+		ESP_LOGE(TAG, "No room to report on %s, add it to MEM_BUDGET_TASKS", pcTaskGetTaskName(task));
+		return;
+	}
+	tasks[task_count].task = task;
+	tasks[task_count].stack_size = stack_size;
+	task_count++;
+}
+
+/*
+ * @brief Stack size a task was registered with, or 0
+ */
+uint32_t mem_task_stack_size(TaskHandle_t task)
+{
+	for (int i = 0; i < task_count; i++) {
+		if (tasks[i].task == task) {
+			return tasks[i].stack_size;
+		}
+	}
+	return 0;
+}
+
+void mem_report(void)
+{
+	for (int i = 0; i < task_count; i++) {
+		/* The high-water mark is in bytes on ESP-IDF */
+		uint32_t unused = uxTaskGetStackHighWaterMark(tasks[i].task);
+
+		ESP_LOGI(TAG, "%-20s stack %5u of %5u bytes used", pcTaskGetTaskName(tasks[i].task),
+		         tasks[i].stack_size - unused, tasks[i].stack_size);
+	}
+	ESP_LOGI(TAG, "Heap free %u, minimum %u, at boot %u", esp_get_free_heap_size(),
+	         esp_get_minimum_free_heap_size(), boot_free_heap);
+}
+
+#if CONFIG_MEM_REPORT_INTERVAL > 0
+static void mem_report_timer(TimerHandle_t timer)
+{
+	mem_report();
+}
+#endif
+
+/*
+ * @brief Call once all tasks have been started
+ */
+void mem_budget_init(void)
+{
+	boot_free_heap = esp_get_free_heap_size();
+	ESP_LOGI(TAG, "Task stacks %u bytes ("MEM_MODE")", MEM_BUDGET_STACKS);
+
+#if CONFIG_MEM_REPORT_INTERVAL > 0
+	TimerHandle_t timer;
+#if CONFIG_STATIC_MEMORY
+	static StaticTimer_t timer_buf;
+
+	timer = xTimerCreateStatic("mem_report", pdMS_TO_TICKS(CONFIG_MEM_REPORT_INTERVAL * 1000),
+	                           pdTRUE, NULL, mem_report_timer, &timer_buf);
+#else
+	timer = xTimerCreate("mem_report", pdMS_TO_TICKS(CONFIG_MEM_REPORT_INTERVAL * 1000),
+	                     pdTRUE, NULL, mem_report_timer);
+#endif
+	xTimerStart(timer, portMAX_DELAY);
+#endif
+}
@@ -0,0 +1,61 @@
+#ifndef MEM_BUDGET_H
+#define MEM_BUDGET_H
+
+/* Long-lived RAM used by the application, in one place
+
+   With CONFIG_STATIC_MEMORY every task stack, queue, timer and mutex
+   listed here is a static object, so the total is fixed at link time and
+   nothing is taken from the heap once the proxy is up. Without it the
+   same sizes are used for the heap allocations made at boot.
+
+   Buffers on the receive, transmit and publish paths are static in both
+   modes. ESP-IDF components (Wi-Fi, lwIP, esp-mqtt, the RMT driver and the
+   HTTP client used during an update) allocate for themselves and are not
+   counted.
+*/
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+/* One receive task per IR receiver */
+#if CONFIG_IR_RX2
+#define IR_RX_TASKS           2
+#else
+#define IR_RX_TASKS           1
+#endif
+
+/* Task stacks, in bytes */
+#define IR_RX_TASK_STACK      2048
+#define OTA_TASK_STACK        8192
+#define HTTP_API_TASK_STACK   4096
+#define BROKER_TASK_STACK     3584
+#define HISTORY_TASK_STACK    3072
+#define GROUP_TASK_STACK      3072
+#define HEARTBEAT_TASK_STACK  3072          /*!< Publishes, through TLS with mqtts:// */
+#define STATS_TASK_STACK      3072
+
+/* RMT receive ring buffer of each receiver, allocated once by the driver at boot */
+#define IR_RX_RINGBUF_SIZE    4000
+
+/* State/command JSON published by panasonic_state.c */
+#define STATE_JSON_MAXLEN     100
+
+/* Queue storage */
+#define OTA_QUEUE_LEN         1
+#define HISTORY_QUEUE_LEN     16
+#define GROUP_QUEUE_LEN       4
+
+/* Everything above that CONFIG_STATIC_MEMORY places in .bss */
+#define MEM_BUDGET_STACKS     (IR_RX_TASKS * IR_RX_TASK_STACK + OTA_TASK_STACK + HTTP_API_TASK_STACK + \
+                               BROKER_TASK_STACK + HISTORY_TASK_STACK + GROUP_TASK_STACK + \
+                               HEARTBEAT_TASK_STACK + STATS_TASK_STACK)
+
+/* Tasks counted in MEM_BUDGET_STACKS, each registered with mem_register_task() */
+#define MEM_BUDGET_TASKS      (IR_RX_TASKS + 7)
+
+void mem_register_task(TaskHandle_t task, uint32_t stack_size);
+uint32_t mem_task_stack_size(TaskHandle_t task);
+void mem_report(void);
+void mem_budget_init(void);
+
+#endif /* MEM_BUDGET_H */
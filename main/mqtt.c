@@ -31,173 +31,630 @@
 
 #include "esp_log.h"
 #include "esp_ota_ops.h"
+#include "esp_timer.h"
 #include "mqtt_client.h"
 
+#include "broker_probe.h"
+#include "history.h"
+#include "mem_budget.h"
+#include "mqtt_topics.h"
+#include "ota.h"
+#include "panasonic_ir.h"
 #include "panasonic_state.h"
 
-#define TOPIC_PREFIX "panasonic/"
-
 static const char TAG[] = "MQTT_EXAMPLE";
+extern const uint8_t server_cert_pem_start[] asm("_binary_ca_cert_pem_start");
 
 static char unique_id[13];
 static char discovery_topic[50];
-
-static const char discovery_data[] = ""
-"{\n"
-"  \"~\":\""TOPIC_PREFIX"%s\",\n"
-"  \"name\":\"Panasonic HVAC\",\n"
-"  \"uniq_id\":\"%s\",\n"
-//"  \"avty_t\":\"~/available\",\n"
-//"  \"pl_avail\":\"online\",\n"
-//"  \"pl_not_avail\":\"offline\",\n"
-"  \"mode_cmd_t\":\"~/mode/set\",\n"
-"  \"mode_stat_t\":\"~\",\n"
-"  \"mode_stat_tpl\":\"{{value_json.mode}}\",\n"
-//"  \"modes\":[\"auto\",\"off\",\"cool\",\"heat\",\"dry\",\"fan_only\"],\n"
-"  \"temp_cmd_t\":\"~/temperature/set\",\n"
-"  \"temp_stat_t\":\"~\",\n"
-"  \"temp_stat_tpl\":\"{{value_json.temperature}}\",\n"
-"  \"fan_mode_cmd_t\":\"~/fan/set\",\n"
-"  \"fan_mode_stat_t\":\"~\",\n"
-"  \"fan_mode_stat_tpl\":\"{{value_json.fan}}\",\n"
-"  \"fan_modes\":[\"auto\",\"min\",\"low\",\"medium\",\"high\",\"max\"],\n"
-"  \"swing_mode_cmd_t\":\"~/swing/set\",\n"
-"  \"swing_mode_stat_t\":\"~\",\n"
-"  \"swing_mode_stat_tpl\":\"{{value_json.swing}}\",\n"
-"  \"swing_modes\":[\"auto\",\"forward\",\"high\",\"middle\",\"low\",\"down\"],\n"
-"  \"min_temp\":\"8\",\n"
-"  \"max_temp\":\"31\",\n"
-//"  \"temp_step\":\"1\",\n"
-"  \"dev\":{\n"
-"    \"ids\":\"%s\",\n"
-"    \"mdl\":\"CS-NE9LKE\",\n"
-"    \"sw\":\"%s\"\n"
-"  }\n"
-"}";
-#define DISCOVERY_FORMAT(unique_id) discovery_data, unique_id, unique_id, unique_id, esp_ota_get_app_description()->version
+static char availability_topic[40];
+static char ota_topic[40];
+static char command_topic[40];
+static char state_topic[32];
+#if CONFIG_IR_HISTOGRAM
+static char histogram_topic[40];
+#endif
+#if CONFIG_IR_LEARN
+static char learn_topic[40];
+static char send_topic[40];
+#endif
+#if CONFIG_HISTORY_LOG
+static char history_topic[40];
+#endif
 
 static esp_mqtt_client_handle_t client;
+static bool connected;
+
+/* CONFIG_BROKER_URL split into its URLs, most preferred first */
+static char broker_list[128];
+static const char *brokers[BROKER_MAX];
+static int broker_count;
+static int broker_current;
+static TaskHandle_t broker_task_handle;
+
+/* CONFIG_MQTT_GROUPS split into its names */
+static char group_list[sizeof(CONFIG_MQTT_GROUPS)];
+static const char *groups[GROUP_MAX];
+static int group_count;
+
+/* Set and command topics are QoS 1 in a persistent session, so that the
+   broker keeps them for us while we are away */
+#if CONFIG_MQTT_PERSISTENT_SESSION
+#define COMMAND_QOS 1
+#else
+#define COMMAND_QOS 0
+#endif
+
+/* How long to wait for a connection before probing again */
+#define BROKER_RETRY_MS 10000
+
+static int64_t connect_start;
+/* Subscribed to state_topic to read back the state from before a reboot */
+static bool state_sync;
+
+/* Unacknowledged state publishes, and how long to wait for a PUBACK; the
+   timeout matches the expiry of esp-mqtt's outbox */
+#define STATE_PUB_INFLIGHT 2
+#define STATE_PUB_TIMEOUT  pdMS_TO_TICKS(30000)
+
+/*
+ * State is published retained at QoS 1, so that it survives broker load
+ * and a new subscriber gets it straight away. At most STATE_PUB_INFLIGHT
+ * publishes are unacknowledged at a time; a state that has to wait is
+ * replaced by any newer one, as only the latest matters.
+ */
+static struct {
+	struct {
+		int msg_id;     /*!< 0 when free, -1 while being published */
+		TickType_t sent;
+	} inflight[STATE_PUB_INFLIGHT];
+	bool pending;
+	int len;
+	char data[STATE_JSON_MAXLEN];
+} state_pub;
+static portMUX_TYPE state_pub_mux = portMUX_INITIALIZER_UNLOCKED;
+
+/*
+ * Set commands the broker kept for us while we were away arrive right
+ * after the CONNACK, ahead of the SUBACKs for our subscriptions. Until
+ * the last of those SUBACKs only the newest value of each field is kept,
+ * and they then go out together in one frame.
+ */
+struct backlog_field {
+	bool used;
+	struct mqtt_set_request req;
+	int64_t received;
+	int id_len;             /*!< 0 for no acknowledgement */
+	char id[MQTT_ACK_ID_MAX];
+};
+
+static struct {
+	bool open;
+	int end_msg_id;         /*!< Subscription whose SUBACK closes the backlog */
+	struct backlog_field fields[MQTT_SET_FIELDS];
+} backlog;
+static portMUX_TYPE backlog_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static void mqtt_apply_set(const struct mqtt_set_request *req, struct panasonic_tx *tx)
+{
+	switch (req->field) {
+	case SET_MODE:
+		ESP_LOGI(TAG, "Mode to %d", req->power ? req->mode : -1);
+		break;
+	case SET_TEMPERATURE:
+		break;
+	case SET_FAN:
+		ESP_LOGI(TAG, "Fan to %d", req->fan);
+		break;
+	case SET_SWING:
+		ESP_LOGI(TAG, "Swing to %d", req->swing);
+		break;
+	}
+	panasonic_set_fields(req, 1, SOURCE_MQTT, tx);
+}
+
+/*
+ * @brief Acknowledge a command that carried an id but was not sent
+ */
+static void ack_refuse(const char *id, int id_len, const char *result)
+{
+	char buf[MQTT_ACK_MAXLEN];
+	int len;
+
+	if (id == NULL) {
+		return;
+	}
+
+	len = mqtt_ack_payload(buf, sizeof(buf), id, id_len, result, 0, 0);
+	mqtt_pub(ACK_TOPIC, buf, len, 1, 0);
+}
+
+/*
+ * @brief Acknowledge a command that carried an id
+ *
+ * tx is NULL for a command that was refused before anything was sent.
+ */
+static void ack_publish(const char *id, int id_len, int64_t received, const struct panasonic_tx *tx)
+{
+	char buf[MQTT_ACK_MAXLEN];
+	int len;
+
+	if (id == NULL) {
+		return;
+	}
+
+	if (tx == NULL) {
+		ack_refuse(id, id_len, "invalid");
+		return;
+	}
+	len = mqtt_ack_payload(buf, sizeof(buf), id, id_len, tx->err == 0 ? "ok" : "failed",
+	                       tx->start - received, tx->err == 0 ? tx->done - tx->start : 0);
+	mqtt_pub(ACK_TOPIC, buf, len, 1, 0);
+}
+
+/*
+ * @brief Keep a set command while the backlog is open
+ *
+ * Returns false if it is not, and the command is to be carried out now.
+ * A command it replaces is acknowledged as "superseded".
+ */
+static bool backlog_add(const struct mqtt_set_request *req, const char *id, int id_len, int64_t received)
+{
+	struct backlog_field *f;
+	char old_id[MQTT_ACK_ID_MAX];
+	int old_len = 0;
+
+	portENTER_CRITICAL(&backlog_mux);
+	if (!backlog.open) {
+		portEXIT_CRITICAL(&backlog_mux);
+		return false;
+	}
+	f = &backlog.fields[req->field];
+	if (f->used) {
+		old_len = f->id_len;
+		memcpy(old_id, f->id, old_len);
+	}
+	f->used = true;
+	f->req = *req;
+	f->received = received;
+	f->id_len = 0;
+	if (id != NULL) {
+		f->id_len = id_len;
+		memcpy(f->id, id, id_len);
+	}
+	portEXIT_CRITICAL(&backlog_mux);
+
+	if (old_len > 0) {
+		ack_refuse(old_id, old_len, "superseded");
+	}
+	return true;
+}
+
+/*
+ * @brief Close the backlog and carry out what it kept as one change
+ */
+static void backlog_flush(void)
+{
+	/* Only ever used from the MQTT task */
+	static struct backlog_field fields[MQTT_SET_FIELDS];
+	struct mqtt_set_request reqs[MQTT_SET_FIELDS];
+	struct panasonic_tx tx;
+	int count = 0;
+
+	portENTER_CRITICAL(&backlog_mux);
+	memcpy(fields, backlog.fields, sizeof(fields));
+	memset(backlog.fields, 0, sizeof(backlog.fields));
+	backlog.open = false;
+	portEXIT_CRITICAL(&backlog_mux);
+
+	for (int i = 0; i < MQTT_SET_FIELDS; i++) {
+		if (fields[i].used) {
+			reqs[count++] = fields[i].req;
+		}
+	}
+	if (count == 0) {
+		return;
+	}
+
+	ESP_LOGI(TAG, "Setting %d fields kept by the broker", count);
+	panasonic_set_fields(reqs, count, SOURCE_MQTT, &tx);
+	for (int i = 0; i < MQTT_SET_FIELDS; i++) {
+		if (fields[i].used && fields[i].id_len > 0) {
+			ack_publish(fields[i].id, fields[i].id_len, fields[i].received, &tx);
+		}
+	}
+}
+
+/*
+ * @brief Carry out a message on COMMAND_SET_TOPIC
+ */
+static void command_receive(const char *data, int len, int64_t received)
+{
+	struct panasonic_command cmds[PANASONIC_COMMANDS_MAX];
+	struct panasonic_tx tx;
+	const char *id;
+	int id_len;
+	int ret;
+
+	ret = mqtt_split_id(data, len, &id, &id_len);
+	if (ret >= 0) {
+		ret = mqtt_parse_commands(cmds, PANASONIC_COMMANDS_MAX, data, ret);
+	}
+	if (ret > 0 && panasonic_send_commands(cmds, ret, SOURCE_MQTT, &tx) < 0) {
+		ESP_LOGW(TAG, "No state known yet for \"%.*s\"", len, data);
+		ack_refuse(id, id_len, "no state");
+	} else if (ret > 0) {
+		ack_publish(id, id_len, received, &tx);
+	} else {
+		ESP_LOGI(TAG, "Unknown command \"%.*s\"", len, data);
+		ack_publish(id, id_len, received, NULL);
+	}
+}
 
-static int string_to_mode(enum mode *mode, const char *s, int len)
+/*
+ * @brief Carry out a message on one of the mqtt_set_topics
+ *
+ * Returns false if the topic is not a set topic.
+ */
+static bool set_receive(const char *topic, int topic_len, const char *data, int len, int64_t received)
 {
-	if (strncmp("auto", s, len) == 0) {
-		*mode = MODE_AUTO;
-		return 1;
-	} else if (strncmp("cool", s, len) == 0) {
-		*mode = MODE_COOL;
-		return 1;
-	} else if (strncmp("dry", s, len) == 0) {
-		*mode = MODE_DRY;
-		return 1;
-	} else if (strncmp("fan_only", s, len) == 0) {
-		*mode = MODE_FAN;
-		return 1;
-	} else if (strncmp("heat", s, len) == 0) {
-		*mode = MODE_HEAT;
-		return 1;
-	}
-	return -1;
+	struct mqtt_set_request req;
+	struct panasonic_tx tx;
+	const char *id;
+	int id_len;
+	int ret;
+
+	ret = mqtt_split_id(data, len, &id, &id_len);
+	if (ret < 0 || (ret = mqtt_parse_set(&req, topic, topic_len, data, ret)) == 0) {
+		return false;
+	}
+	if (ret > 0) {
+		if (!backlog_add(&req, id, id_len, received)) {
+			mqtt_apply_set(&req, &tx);
+			ack_publish(id, id_len, received, &tx);
+		}
+	} else {
+		ESP_LOGI(TAG, "Unknown value \"%.*s\"", len, data);
+		ack_publish(id, id_len, received, NULL);
+	}
+	return true;
+}
+
+static void group_list_parse(const char *list)
+{
+	char *save;
+
+	snprintf(group_list, sizeof(group_list), "%s", list);
+	for (char *name = strtok_r(group_list, " ,", &save); name != NULL; name = strtok_r(NULL, " ,", &save)) {
+		if (group_count == GROUP_MAX) {
+			ESP_LOGE(TAG, "More than %d groups, \"%s\" and after left out", GROUP_MAX, name);
+			break;
+		}
+		if (strlen(name) > GROUP_NAME_MAX || strpbrk(name, "/+#") != NULL) {
+			ESP_LOGE(TAG, "Bad group name \"%s\"", name);
+			continue;
+		}
+		groups[group_count++] = name;
+	}
+}
+
+static bool group_topic(const char *topic, int topic_len)
+{
+	return topic_len > sizeof(GROUP_TOPIC_PREFIX) - 1 &&
+	       strncmp(topic, GROUP_TOPIC_PREFIX, sizeof(GROUP_TOPIC_PREFIX) - 1) == 0;
+}
+
+/*
+ * @brief Carry out a message on a group topic as if it were on our own
+ */
+static void group_apply(const char *topic, int topic_len, const char *data, int len, int64_t received)
+{
+	const size_t suffix = sizeof(COMMAND_SET_TOPIC) - 1;
+
+	if (topic_len >= suffix && strncmp(topic + topic_len - suffix, COMMAND_SET_TOPIC, suffix) == 0) {
+		command_receive(data, len, received);
+	} else if (!set_receive(topic, topic_len, data, len, received)) {
+		ESP_LOGI(TAG, "Unknown group topic %.*s", topic_len, topic);
+	}
 }
 
-static int string_to_fan(enum fan *fan, const char *s, int len)
+#if CONFIG_MQTT_GROUP_JITTER > 0
+/* Longest group topic and payload that are queued; a payload has room for
+   a command list and an id */
+#define GROUP_TOPIC_MAXLEN (sizeof(GROUP_TOPIC_PREFIX) + GROUP_NAME_MAX + 16)
+#define GROUP_DATA_MAXLEN  (MQTT_ACK_ID_MAX + 64)
+
+struct group_msg {
+	int64_t received;
+	uint8_t topic_len;
+	uint8_t len;
+	char topic[GROUP_TOPIC_MAXLEN];
+	char data[GROUP_DATA_MAXLEN];
+};
+
+static QueueHandle_t group_queue;
+
+/*
+ * @brief Carry out group messages in order, each after its own random delay
+ *
+ * The wait counts towards queue_us in the acknowledgement.
+ */
+static void group_task(void *arg)
 {
-	if (strncmp("auto", s, len) == 0) {
-		*fan = FAN_AUTO;
-		return 1;
-	} else if (strncmp("min", s, len) == 0) {
-		*fan = FAN_1;
-		return 1;
-	} else if (strncmp("low", s, len) == 0) {
-		*fan = FAN_2;
-		return 1;
-	} else if (strncmp("medium", s, len) == 0) {
-		*fan = FAN_3;
-		return 1;
-	} else if (strncmp("high", s, len) == 0) {
-		*fan = FAN_4;
-		return 1;
-	} else if (strncmp("max", s, len) == 0) {
-		*fan = FAN_5;
-		return 1;
-	}
-	return -1;
+	struct group_msg m;
+
+	for (;;) {
+		xQueueReceive(group_queue, &m, portMAX_DELAY);
+		vTaskDelay(pdMS_TO_TICKS(esp_random() % (CONFIG_MQTT_GROUP_JITTER + 1)));
+		group_apply(m.topic, m.topic_len, m.data, m.len, m.received);
+	}
 }
 
-static int string_to_swing(enum swing *swing, const char *s, int len)
+static void group_task_start(void)
 {
-	if (strncmp("auto", s, len) == 0) {
-		*swing = SWING_AUTO;
-		return 1;
-	} else if (strncmp("forward", s, len) == 0) {
-		*swing = SWING_1;
-		return 1;
-	} else if (strncmp("high", s, len) == 0) {
-		*swing = SWING_2;
-		return 1;
-	} else if (strncmp("middle", s, len) == 0) {
-		*swing = SWING_3;
-		return 1;
-	} else if (strncmp("low", s, len) == 0) {
-		*swing = SWING_4;
-		return 1;
-	} else if (strncmp("down", s, len) == 0) {
-		*swing = SWING_5;
-		return 1;
-	}
-	return -1;
+	TaskHandle_t task;
+#if CONFIG_STATIC_MEMORY
+	static uint8_t queue_storage[GROUP_QUEUE_LEN * sizeof(struct group_msg)];
+	static StaticQueue_t queue_buf;
+	static StackType_t stack[GROUP_TASK_STACK];
+	static StaticTask_t task_buf;
+
+	group_queue = xQueueCreateStatic(GROUP_QUEUE_LEN, sizeof(struct group_msg), queue_storage, &queue_buf);
+	task = xTaskCreateStatic(group_task, "group", GROUP_TASK_STACK, NULL, 5, stack, &task_buf);
+#else
+	group_queue = xQueueCreate(GROUP_QUEUE_LEN, sizeof(struct group_msg));
+	xTaskCreate(group_task, "group", GROUP_TASK_STACK, NULL, 5, &task);
+#endif
+	mem_register_task(task, GROUP_TASK_STACK);
 }
+#endif /* CONFIG_MQTT_GROUP_JITTER > 0 */
+
+/*
+ * @brief Take a message on one of our group topics
+ *
+ * With CONFIG_MQTT_GROUP_JITTER it is handed to the group task, so that
+ * the MQTT task is not held up by the wait.
+ */
+static void group_receive(const char *topic, int topic_len, const char *data, int len, int64_t received)
+{
+#if CONFIG_MQTT_GROUP_JITTER > 0
+	struct group_msg m = {
+		.received = received,
+		.topic_len = topic_len,
+		.len = len,
+	};
 
-static bool ends_with(const char *a, int alen, const char *end)
+	if (topic_len > sizeof(m.topic) || len > sizeof(m.data)) {
+		ESP_LOGW(TAG, "Group message on %.*s too long", topic_len, topic);
+		return;
+	}
+	memcpy(m.topic, topic, topic_len);
+	memcpy(m.data, data, len);
+	if (xQueueSend(group_queue, &m, 0) != pdTRUE) {
+		ESP_LOGW(TAG, "Busy, group message dropped");
+	}
+#else
+	group_apply(topic, topic_len, data, len, received);
+#endif
+}
+
+/*
+ * @brief Publish the pending state if connected and a slot is free
+ *
+ * The publish itself happens outside the critical section, since it
+ * waits for the client lock.
+ */
+static void state_pub_flush(void)
 {
-	size_t endlen = strlen(end);
+	char data[STATE_JSON_MAXLEN];
+	TickType_t now = xTaskGetTickCount();
+	int slot = -1;
+	int len = 0;
+	int msg_id;
 
-	return alen >= endlen && strncmp(a + (alen - endlen), end, endlen) == 0;
+	portENTER_CRITICAL(&state_pub_mux);
+	for (int i = 0; i < STATE_PUB_INFLIGHT; i++) {
+		if (state_pub.inflight[i].msg_id != 0 && now - state_pub.inflight[i].sent > STATE_PUB_TIMEOUT) {
+			state_pub.inflight[i].msg_id = 0;
+		}
+		if (state_pub.inflight[i].msg_id == 0) {
+			slot = i;
+		}
+	}
+	if (connected && state_pub.pending && slot >= 0) {
+		len = state_pub.len;
+		memcpy(data, state_pub.data, len);
+		state_pub.pending = false;
+		state_pub.inflight[slot].msg_id = -1;
+		state_pub.inflight[slot].sent = now;
+	} else {
+		slot = -1;
+	}
+	portEXIT_CRITICAL(&state_pub_mux);
+
+	if (slot < 0) {
+		return;
+	}
+
+	msg_id = esp_mqtt_client_publish(client, state_topic, data, len, 1, 1);
+
+	portENTER_CRITICAL(&state_pub_mux);
+	if (msg_id > 0) {
+		state_pub.inflight[slot].msg_id = msg_id;
+	} else {
+		/* Try again on the next PUBACK or connect, unless superseded */
+		state_pub.inflight[slot].msg_id = 0;
+		state_pub.pending = true;
+	}
+	portEXIT_CRITICAL(&state_pub_mux);
 }
 
+static void state_pub_acked(int msg_id)
+{
+	portENTER_CRITICAL(&state_pub_mux);
+	for (int i = 0; i < STATE_PUB_INFLIGHT; i++) {
+		if (state_pub.inflight[i].msg_id == msg_id) {
+			state_pub.inflight[i].msg_id = 0;
+		}
+	}
+	portEXIT_CRITICAL(&state_pub_mux);
+	state_pub_flush();
+}
+
+/*
+ * @brief Take over our retained state after a reboot
+ *
+ * Only the first message counts; afterwards the topic carries our own
+ * publishes, so the subscription is dropped.
+ */
+static void state_sync_receive(esp_mqtt_client_handle_t client, const char *data, int len)
+{
+	struct mqtt_set_request reqs[MQTT_SET_FIELDS];
+	struct panasonic_command cmd = { .cmd = CMD_STATE };
+
+	if (mqtt_parse_state(reqs, data, len) == MQTT_SET_FIELDS) {
+		for (int i = 0; i < MQTT_SET_FIELDS; i++) {
+			panasonic_apply_set(&cmd, &reqs[i]);
+		}
+		if (panasonic_state_restore(&cmd)) {
+			ESP_LOGI(TAG, "Restored state \"%.*s\"", len, data);
+		}
+	}
+
+	state_sync = false;
+	esp_mqtt_client_unsubscribe(client, state_topic);
+}
+
+#if CONFIG_IR_HISTOGRAM
+static void histogram_publish(char *buf, size_t size, bool reset)
+{
+	int len;
+
+	for (int i = 0; (len = panasonic_ir_histogram(i, buf, size)) >= 0; i++) {
+		mqtt_pub(IR_HISTOGRAM_TOPIC, buf, len, 0, 0);
+	}
+	if (reset) {
+		panasonic_ir_histogram_reset();
+	}
+}
+#endif
+
 static esp_err_t mqtt_event_handler_cb(esp_mqtt_event_handle_t event)
 {
 	esp_mqtt_client_handle_t client = event->client;
+	int64_t received = esp_timer_get_time();
+	bool known;
 	int msg_id;
-	char buf[sizeof(discovery_data) + 12 + 12 + 12 + 32 + 10];
+	int ret;
+	/* Only ever used from the MQTT task; too big for its stack */
+	static char buf[MQTT_DISCOVERY_MAXLEN];
 
 	switch (event->event_id) {
+	case MQTT_EVENT_BEFORE_CONNECT:
+		connect_start = esp_timer_get_time();
+		break;
 	case MQTT_EVENT_CONNECTED:
-		ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED");
+		/* Includes the TLS handshake with mqtts:// */
+		ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED to %s in %d ms", brokers[broker_current],
+		         (int)((esp_timer_get_time() - connect_start) / 1000));
+		connected = true;
+		msg_id = esp_mqtt_client_publish(client, availability_topic, AVAILABILITY_ONLINE, 0, 1, 1);
+		ESP_LOGI(TAG, "published to %s, msg_id=%d", availability_topic, msg_id);
+
+		/*
+		 * After a reboot the retained state is all we know about the
+		 * unit. It is asked for first, so that it is in before any
+		 * commands kept in our session are applied on top of it.
+		 */
+		known = panasonic_state_known();
+		if (!known) {
+			state_sync = true;
+			msg_id = esp_mqtt_client_subscribe(client, state_topic, 1);
+			ESP_LOGI(TAG, "subscribed to %s, msg_id=%d", state_topic, msg_id);
+		}
+
 		msg_id = esp_mqtt_client_subscribe(client, TOPIC_PREFIX"restart", 0);
 		ESP_LOGI(TAG, "sent subscribe successful, msg_id=%d", msg_id);
 
-		snprintf(buf, sizeof(buf), TOPIC_PREFIX"%s/mode/set", unique_id);
-		msg_id = esp_mqtt_client_subscribe(client, buf, 0);
-		ESP_LOGI(TAG, "subscribed to %s, msg_id=%d", buf, msg_id);
+		for (size_t i = 0; i < mqtt_set_topic_count; i++) {
+			snprintf(buf, sizeof(buf), TOPIC_PREFIX"%s%s", unique_id, mqtt_set_topics[i]);
+			msg_id = esp_mqtt_client_subscribe(client, buf, COMMAND_QOS);
+			ESP_LOGI(TAG, "subscribed to %s, msg_id=%d", buf, msg_id);
+		}
+
+		msg_id = esp_mqtt_client_subscribe(client, command_topic, COMMAND_QOS);
+		ESP_LOGI(TAG, "subscribed to %s, msg_id=%d", command_topic, msg_id);
 
-		snprintf(buf, sizeof(buf), TOPIC_PREFIX"%s/temperature/set", unique_id);
-		msg_id = esp_mqtt_client_subscribe(client, buf, 0);
-		ESP_LOGI(TAG, "subscribed to %s, msg_id=%d", buf, msg_id);
+		/* One level for the field covers COMMAND_SET_TOPIC too */
+		for (int i = 0; i < group_count; i++) {
+			snprintf(buf, sizeof(buf), GROUP_TOPIC_PREFIX"%s/+/set", groups[i]);
+			msg_id = esp_mqtt_client_subscribe(client, buf, COMMAND_QOS);
+			ESP_LOGI(TAG, "subscribed to %s, msg_id=%d", buf, msg_id);
+		}
 
-		snprintf(buf, sizeof(buf), TOPIC_PREFIX"%s/fan/set", unique_id);
-		msg_id = esp_mqtt_client_subscribe(client, buf, 0);
-		ESP_LOGI(TAG, "subscribed to %s, msg_id=%d", buf, msg_id);
+		if (event->session_present && msg_id > 0) {
+			portENTER_CRITICAL(&backlog_mux);
+			backlog.open = true;
+			backlog.end_msg_id = msg_id;
+			portEXIT_CRITICAL(&backlog_mux);
+		}
 
-		snprintf(buf, sizeof(buf), TOPIC_PREFIX"%s/swing/set", unique_id);
-		msg_id = esp_mqtt_client_subscribe(client, buf, 0);
-		ESP_LOGI(TAG, "subscribed to %s, msg_id=%d", buf, msg_id);
+		msg_id = esp_mqtt_client_subscribe(client, ota_topic, 0);
+		ESP_LOGI(TAG, "subscribed to %s, msg_id=%d", ota_topic, msg_id);
+#if CONFIG_IR_HISTOGRAM
+		msg_id = esp_mqtt_client_subscribe(client, histogram_topic, 0);
+		ESP_LOGI(TAG, "subscribed to %s, msg_id=%d", histogram_topic, msg_id);
+#endif
+#if CONFIG_IR_LEARN
+		msg_id = esp_mqtt_client_subscribe(client, learn_topic, 0);
+		ESP_LOGI(TAG, "subscribed to %s, msg_id=%d", learn_topic, msg_id);
+		msg_id = esp_mqtt_client_subscribe(client, send_topic, 0);
+		ESP_LOGI(TAG, "subscribed to %s, msg_id=%d", send_topic, msg_id);
+#endif
+#if CONFIG_HISTORY_LOG
+		msg_id = esp_mqtt_client_subscribe(client, history_topic, 0);
+		ESP_LOGI(TAG, "subscribed to %s, msg_id=%d", history_topic, msg_id);
+#endif
+
+		/*
+		 * Otherwise ours is newer and is published again, in case the
+		 * broker lost it; it goes out after anything still in flight
+		 * from before the disconnect.
+		 */
+		if (known) {
+			struct panasonic_command cmd;
+
+			panasonic_get_state(&cmd);
+			ret = panasonic_state_to_json(buf, STATE_JSON_MAXLEN, &cmd);
+			mqtt_pub_state(buf, ret);
+		}
 
-		snprintf(buf, sizeof(buf), DISCOVERY_FORMAT(unique_id));
+		mqtt_discovery_payload(buf, sizeof(buf), unique_id, esp_ota_get_app_description()->version);
 		msg_id = esp_mqtt_client_publish(client, discovery_topic, buf, 0, 0, 1);
 		ESP_LOGI(TAG, "published to %s, msg_id=%d", discovery_topic, msg_id);
 		break;
 	case MQTT_EVENT_DISCONNECTED:
 		ESP_LOGI(TAG, "MQTT_EVENT_DISCONNECTED");
+		connected = false;
+		/* What made it in before the connection dropped still counts */
+		backlog_flush();
+		if (broker_task_handle != NULL) {
+			xTaskNotifyGive(broker_task_handle);
+		}
 		break;
 
 	case MQTT_EVENT_SUBSCRIBED:
 		ESP_LOGI(TAG, "MQTT_EVENT_SUBSCRIBED, msg_id=%d", event->msg_id);
+		if (backlog.open && event->msg_id == backlog.end_msg_id) {
+			backlog_flush();
+		}
 		break;
 	case MQTT_EVENT_UNSUBSCRIBED:
 		ESP_LOGI(TAG, "MQTT_EVENT_UNSUBSCRIBED, msg_id=%d", event->msg_id);
 		break;
 	case MQTT_EVENT_PUBLISHED:
 		ESP_LOGI(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
+		state_pub_acked(event->msg_id);
 		break;
 	case MQTT_EVENT_DATA:
 		ESP_LOGI(TAG, "MQTT_EVENT_DATA");
@@ -205,38 +662,37 @@ static esp_err_t mqtt_event_handler_cb(esp_mqtt_event_handle_t event)
 			ESP_LOGI(TAG, "Rebooting ...");
 			vTaskDelay(1000 / portTICK_PERIOD_MS);
 			esp_restart();
-		} else if (ends_with(event->topic, event->topic_len, "/mode/set")) {
-			if (strncmp("off", event->data, event->data_len) == 0) {
-				panasonic_set_mode(false, MODE_AUTO);
-			} else {
-				enum mode mode;
-				if (string_to_mode(&mode, event->data, event->data_len) > 0) {
-					ESP_LOGI(TAG, "Mode to %d", mode);
-					panasonic_set_mode(true, mode);
-				} else {
-					ESP_LOGI(TAG, "Unknown mode");
-				}
-			}
-		} else if (ends_with(event->topic, event->topic_len, "/temperature/set")) {
-			long temp = strtol(event->data, NULL, 10);
-			panasonic_set_temperature(temp);
-		} else if (ends_with(event->topic, event->topic_len, "/fan/set")) {
-			enum fan fan;
-			if (string_to_fan(&fan, event->data, event->data_len) > 0) {
-				ESP_LOGI(TAG, "Fan to %d", fan);
-				panasonic_set_fan(fan);
-			} else {
-				ESP_LOGI(TAG, "Unknown fan");
-			}
-		} else if (ends_with(event->topic, event->topic_len, "/swing/set")) {
-			enum swing swing;
-			if (string_to_swing(&swing, event->data, event->data_len) > 0) {
-				ESP_LOGI(TAG, "Swing to %d", swing);
-				panasonic_set_swing(swing);
-			} else {
-				ESP_LOGI(TAG, "Unknown swing");
-			}
-		} else {
+		} else if (event->topic_len == strlen(ota_topic) &&
+		           strncmp(event->topic, ota_topic, event->topic_len) == 0) {
+			ESP_LOGI(TAG, "OTA requested");
+			ota_trigger();
+#if CONFIG_IR_HISTOGRAM
+		} else if (event->topic_len == strlen(histogram_topic) &&
+		           strncmp(event->topic, histogram_topic, event->topic_len) == 0) {
+			histogram_publish(buf, sizeof(buf), event->data_len == 5 && strncmp(event->data, "reset", 5) == 0);
+#endif
+#if CONFIG_IR_LEARN
+		} else if (event->topic_len == strlen(learn_topic) &&
+		           strncmp(event->topic, learn_topic, event->topic_len) == 0) {
+			panasonic_ir_learn(event->data, event->data_len);
+		} else if (event->topic_len == strlen(send_topic) &&
+		           strncmp(event->topic, send_topic, event->topic_len) == 0) {
+			panasonic_ir_play(event->data, event->data_len);
+#endif
+#if CONFIG_HISTORY_LOG
+		} else if (event->topic_len == strlen(history_topic) &&
+		           strncmp(event->topic, history_topic, event->topic_len) == 0) {
+			history_query(event->data, event->data_len);
+#endif
+		} else if (state_sync && event->topic_len == strlen(state_topic) &&
+		           strncmp(event->topic, state_topic, event->topic_len) == 0) {
+			state_sync_receive(client, event->data, event->data_len);
+		} else if (event->topic_len == strlen(command_topic) &&
+		           strncmp(event->topic, command_topic, event->topic_len) == 0) {
+			command_receive(event->data, event->data_len, received);
+		} else if (group_topic(event->topic, event->topic_len)) {
+			group_receive(event->topic, event->topic_len, event->data, event->data_len, received);
+		} else if (!set_receive(event->topic, event->topic_len, event->data, event->data_len, received)) {
 			printf("TOPIC=%.*s\r\n", event->topic_len, event->topic);
 			printf("DATA=%.*s\r\n", event->data_len, event->data);
 		}
@@ -256,18 +712,157 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
 	mqtt_event_handler_cb(event_data);
 }
 
+#if CONFIG_MQTT_HEARTBEAT_INTERVAL > 0
+/*
+ * @brief Publish the heartbeat from a task of its own
+ *
+ * Not from a timer: the publish waits for the client during reconnects
+ * and writes through TLS with mqtts://, neither of which belongs in the
+ * timer service task.
+ */
+static void heartbeat_task(void *arg)
+{
+	for (;;) {
+		vTaskDelay(pdMS_TO_TICKS(CONFIG_MQTT_HEARTBEAT_INTERVAL * 1000));
+		if (connected) {
+			mqtt_pub(HEARTBEAT_TOPIC, "1", 1, 0, 0);
+		}
+	}
+}
+#endif
+
+static bool broker_tls(const char *url)
+{
+	return strncmp(url, "mqtts://", 8) == 0 || strncmp(url, "wss://", 6) == 0;
+}
+
+static void broker_list_parse(const char *list)
+{
+	char *save;
+
+	snprintf(broker_list, sizeof(broker_list), "%s", list);
+	for (char *url = strtok_r(broker_list, " ,", &save); url != NULL && broker_count < BROKER_MAX;
+	     url = strtok_r(NULL, " ,", &save)) {
+		brokers[broker_count++] = url;
+	}
+	if (broker_count == 0) {
+		ESP_LOGE(TAG, "No broker configured");
+		abort();
+	}
+}
+
+/*
+ * @brief Move the client to broker i
+ *
+ * Stopping sends a DISCONNECT, so the old broker does not publish the
+ * will.
+ */
+static void broker_switch(int i, bool started)
+{
+	ESP_LOGI(TAG, "Using broker %s", brokers[i]);
+	if (started) {
+		connected = false;
+		esp_mqtt_client_stop(client);
+	}
+	broker_current = i;
+	esp_mqtt_client_set_uri(client, brokers[i]);
+	esp_mqtt_client_start(client);
+}
+
+/*
+ * @brief Pick the broker for the client and fail over between them
+ *
+ * While disconnected, all brokers are probed and the first to answer is
+ * used, which also covers the current one coming back. While connected
+ * to a fallback, the preferred brokers are probed every
+ * CONFIG_BROKER_PREFERRED_INTERVAL seconds.
+ */
+static void broker_task(void *arg)
+{
+	char probe_id[sizeof(unique_id) + 6];
+	bool started = false;
+	int i;
+
+	snprintf(probe_id, sizeof(probe_id), "%s-probe", unique_id);
+
+	for (;;) {
+		if (!connected) {
+			i = broker_probe(brokers, broker_count, probe_id, BROKER_PROBE_TIMEOUT_MS);
+			if (i >= 0) {
+				broker_switch(i, started);
+				started = true;
+			}
+			/* A disconnect from the stop above is stale */
+			ulTaskNotifyTake(pdTRUE, 0);
+			ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(BROKER_RETRY_MS));
+			continue;
+		}
+
+		if (broker_current == 0 || CONFIG_BROKER_PREFERRED_INTERVAL == 0) {
+			ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+			continue;
+		}
+
+		if (ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(CONFIG_BROKER_PREFERRED_INTERVAL * 1000)) == 0 && connected) {
+			i = broker_probe(brokers, broker_current, probe_id, BROKER_PROBE_TIMEOUT_MS);
+			if (i >= 0) {
+				broker_switch(i, started);
+				ulTaskNotifyTake(pdTRUE, 0);
+			}
+		}
+	}
+}
+
+static void broker_task_start(void)
+{
+#if CONFIG_STATIC_MEMORY
+	static StackType_t stack[BROKER_TASK_STACK];
+	static StaticTask_t task_buf;
+
+	broker_task_handle = xTaskCreateStatic(broker_task, "broker", BROKER_TASK_STACK, NULL, 5, stack, &task_buf);
+#else
+	xTaskCreate(broker_task, "broker", BROKER_TASK_STACK, NULL, 5, &broker_task_handle);
+#endif
+	mem_register_task(broker_task_handle, BROKER_TASK_STACK);
+}
+
 void mqtt_init(const char *device_id)
 {
+	const char *urls = CONFIG_BROKER_URL;
+
 	snprintf(unique_id, sizeof(unique_id), "%s", device_id);
-	snprintf(discovery_topic, sizeof(discovery_topic), "homeassistant/climate/%s/config", device_id);
+	mqtt_discovery_topic(discovery_topic, sizeof(discovery_topic), device_id);
+	snprintf(availability_topic, sizeof(availability_topic), TOPIC_PREFIX"%s"AVAILABILITY_TOPIC, device_id);
+	snprintf(ota_topic, sizeof(ota_topic), TOPIC_PREFIX"%s"OTA_TOPIC, device_id);
+	snprintf(command_topic, sizeof(command_topic), TOPIC_PREFIX"%s"COMMAND_SET_TOPIC, device_id);
+	snprintf(state_topic, sizeof(state_topic), TOPIC_PREFIX"%s", device_id);
+#if CONFIG_IR_HISTOGRAM
+	snprintf(histogram_topic, sizeof(histogram_topic), TOPIC_PREFIX"%s"IR_HISTOGRAM_TOPIC"/get", device_id);
+#endif
+#if CONFIG_IR_LEARN
+	snprintf(learn_topic, sizeof(learn_topic), TOPIC_PREFIX"%s"IR_LEARN_TOPIC, device_id);
+	snprintf(send_topic, sizeof(send_topic), TOPIC_PREFIX"%s"IR_SEND_TOPIC, device_id);
+#endif
+#if CONFIG_HISTORY_LOG
+	snprintf(history_topic, sizeof(history_topic), TOPIC_PREFIX"%s"HISTORY_TOPIC"/get", device_id);
+#endif
 
 	esp_mqtt_client_config_t mqtt_cfg = {
-		.uri = CONFIG_BROKER_URL,
+#if CONFIG_MQTT_PERSISTENT_SESSION
+		/* The broker finds the session by client id, so it must not change */
+		.client_id = unique_id,
+		.disable_clean_session = 1,
+#endif
+		.keepalive = CONFIG_MQTT_KEEPALIVE,
+		.lwt_topic = availability_topic,
+		.lwt_msg = AVAILABILITY_OFFLINE,
+		.lwt_qos = 1,
+		.lwt_retain = 1,
 	};
 #if CONFIG_BROKER_URL_FROM_STDIN
 	char line[128];
 
-	if (strcmp(mqtt_cfg.uri, "FROM_STDIN") == 0) {
+	if (strcmp(urls, "FROM_STDIN") == 0) {
 		int count = 0;
 		printf("Please enter url of mqtt broker\n");
 		while (count < 128) {
@@ -281,7 +876,7 @@ void mqtt_init(const char *device_id)
 			}
 			vTaskDelay(10 / portTICK_PERIOD_MS);
 		}
-		mqtt_cfg.uri = line;
+		urls = line;
 		printf("Broker url: %s\n", line);
 	} else {
 		ESP_LOGE(TAG, "Configuration mismatch: wrong broker url");
@@ -289,18 +884,74 @@ void mqtt_init(const char *device_id)
 	}
 #endif /* CONFIG_BROKER_URL_FROM_STDIN */
 
+	broker_list_parse(urls);
+	group_list_parse(CONFIG_MQTT_GROUPS);
+#if CONFIG_MQTT_GROUP_JITTER > 0
+	group_task_start();
+#endif
+	mqtt_cfg.uri = brokers[0];
+
+	/* The broker certificate is checked against the CA used for updates */
+	for (int i = 0; i < broker_count; i++) {
+		if (broker_tls(brokers[i])) {
+			mqtt_cfg.cert_pem = (const char *)server_cert_pem_start;
+		}
+	}
+
 	client = esp_mqtt_client_init(&mqtt_cfg);
 	esp_mqtt_client_register_event(client, ESP_EVENT_ANY_ID, mqtt_event_handler, client);
-	esp_mqtt_client_start(client);
+	if (broker_count > 1) {
+		broker_task_start();
+	} else {
+		esp_mqtt_client_start(client);
+	}
+
+#if CONFIG_MQTT_HEARTBEAT_INTERVAL > 0
+	TaskHandle_t task;
+#if CONFIG_STATIC_MEMORY
+	static StackType_t stack[HEARTBEAT_TASK_STACK];
+	static StaticTask_t task_buf;
+
+	task = xTaskCreateStatic(heartbeat_task, "heartbeat", HEARTBEAT_TASK_STACK, NULL, 5, stack, &task_buf);
+#else
+	xTaskCreate(heartbeat_task, "heartbeat", HEARTBEAT_TASK_STACK, NULL, 5, &task);
+#endif
+	mem_register_task(task, HEARTBEAT_TASK_STACK);
+#endif
 }
 
 int mqtt_pub(const char *suffix, const char *data, int len, int qos, int retain)
 {
-	char topic[32];
+	char topic[sizeof(TOPIC_PREFIX) - 1 + sizeof(unique_id) - 1 + TOPIC_SUFFIX_MAX + 1];
 	if (client == NULL) {
 		return -1;
 	}
 
-	snprintf(topic, sizeof(topic), TOPIC_PREFIX"%s%s", unique_id, suffix);
+	if (snprintf(topic, sizeof(topic), TOPIC_PREFIX"%s%s", unique_id, suffix) >= (int)sizeof(topic)) {
+		ESP_LOGE(TAG, "Topic suffix %s too long", suffix);
+		return -1;
+	}
 	return esp_mqtt_client_publish(client, topic, data, len, qos, retain);
 }
+
+/*
+ * @brief Publish the state, retained at QoS 1
+ *
+ * Never blocks on the broker: the state is sent now if a slot is free,
+ * or else replaces any state still waiting for one.
+ */
+int mqtt_pub_state(const char *data, int len)
+{
+	if (len <= 0 || len > STATE_JSON_MAXLEN) {
+		return -1;
+	}
+
+	portENTER_CRITICAL(&state_pub_mux);
+	memcpy(state_pub.data, data, len);
+	state_pub.len = len;
+	state_pub.pending = true;
+	portEXIT_CRITICAL(&state_pub_mux);
+
+	state_pub_flush();
+	return 0;
+}
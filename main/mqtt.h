@@ -3,5 +3,6 @@
 
 void mqtt_init(const char *device_id);
 int mqtt_pub(const char *topic, const char *data, int len, int qos, int retain);
+int mqtt_pub_state(const char *data, int len);
 
 #endif /* MQTT_H */
@@ -0,0 +1,391 @@
+/* Panasonic AC MQTT topic layout and Home Assistant discovery
+
+   This file has no ESP-IDF dependencies so that the host tools can share
+   the exact topic and payload format with the firmware.
+*/
+
+#include "mqtt_topics.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+static const char discovery_data[] = ""
+"{\n"
+"  \"~\":\""TOPIC_PREFIX"%s\",\n"
+"  \"name\":\"Panasonic HVAC\",\n"
+"  \"uniq_id\":\"%s\",\n"
+"  \"avty_t\":\"~"AVAILABILITY_TOPIC"\",\n"
+"  \"pl_avail\":\""AVAILABILITY_ONLINE"\",\n"
+"  \"pl_not_avail\":\""AVAILABILITY_OFFLINE"\",\n"
+"  \"mode_cmd_t\":\"~/mode/set\",\n"
+"  \"mode_stat_t\":\"~\",\n"
+"  \"mode_stat_tpl\":\"{{value_json.mode}}\",\n"
+//"  \"modes\":[\"auto\",\"off\",\"cool\",\"heat\",\"dry\",\"fan_only\"],\n"
+"  \"temp_cmd_t\":\"~/temperature/set\",\n"
+"  \"temp_stat_t\":\"~\",\n"
+"  \"temp_stat_tpl\":\"{{value_json.temperature}}\",\n"
+"  \"fan_mode_cmd_t\":\"~/fan/set\",\n"
+"  \"fan_mode_stat_t\":\"~\",\n"
+"  \"fan_mode_stat_tpl\":\"{{value_json.fan}}\",\n"
+"  \"fan_modes\":[\"auto\",\"min\",\"low\",\"medium\",\"high\",\"max\"],\n"
+"  \"swing_mode_cmd_t\":\"~/swing/set\",\n"
+"  \"swing_mode_stat_t\":\"~\",\n"
+"  \"swing_mode_stat_tpl\":\"{{value_json.swing}}\",\n"
+"  \"swing_modes\":[\"auto\",\"forward\",\"high\",\"middle\",\"low\",\"down\"],\n"
+"  \"min_temp\":\"8\",\n"
+"  \"max_temp\":\"31\",\n"
+//"  \"temp_step\":\"1\",\n"
+"  \"dev\":{\n"
+"    \"ids\":\"%s\",\n"
+"    \"mdl\":\"CS-NE9LKE\",\n"
+"    \"sw\":\"%s\"\n"
+"  }\n"
+"}";
+
+_Static_assert(sizeof(discovery_data) + 12 + 12 + 12 + 32 <= MQTT_DISCOVERY_MAXLEN,
+               "MQTT_DISCOVERY_MAXLEN too small");
+
+const char *const mqtt_set_topics[] = {
+	[SET_MODE]        = "/mode/set",
+	[SET_TEMPERATURE] = "/temperature/set",
+	[SET_FAN]         = "/fan/set",
+	[SET_SWING]       = "/swing/set",
+};
+const size_t mqtt_set_topic_count = sizeof(mqtt_set_topics) / sizeof(mqtt_set_topics[0]);
+
+/* Keys of the state object published on TOPIC_PREFIX<id> */
+static const char *const state_keys[] = {
+	[SET_MODE]        = "mode",
+	[SET_TEMPERATURE] = "temperature",
+	[SET_FAN]         = "fan",
+	[SET_SWING]       = "swing",
+};
+
+static int string_to_mode(enum mode *mode, const char *s, int len)
+{
+	if (strncmp("auto", s, len) == 0) {
+		*mode = MODE_AUTO;
+		return 1;
+	} else if (strncmp("cool", s, len) == 0) {
+		*mode = MODE_COOL;
+		return 1;
+	} else if (strncmp("dry", s, len) == 0) {
+		*mode = MODE_DRY;
+		return 1;
+	} else if (strncmp("fan_only", s, len) == 0) {
+		*mode = MODE_FAN;
+		return 1;
+	} else if (strncmp("heat", s, len) == 0) {
+		*mode = MODE_HEAT;
+		return 1;
+	}
+	return -1;
+}
+
+static int string_to_fan(enum fan *fan, const char *s, int len)
+{
+	if (strncmp("auto", s, len) == 0) {
+		*fan = FAN_AUTO;
+		return 1;
+	} else if (strncmp("min", s, len) == 0) {
+		*fan = FAN_1;
+		return 1;
+	} else if (strncmp("low", s, len) == 0) {
+		*fan = FAN_2;
+		return 1;
+	} else if (strncmp("medium", s, len) == 0) {
+		*fan = FAN_3;
+		return 1;
+	} else if (strncmp("high", s, len) == 0) {
+		*fan = FAN_4;
+		return 1;
+	} else if (strncmp("max", s, len) == 0) {
+		*fan = FAN_5;
+		return 1;
+	}
+	return -1;
+}
+
+static int string_to_swing(enum swing *swing, const char *s, int len)
+{
+	if (strncmp("auto", s, len) == 0) {
+		*swing = SWING_AUTO;
+		return 1;
+	} else if (strncmp("forward", s, len) == 0) {
+		*swing = SWING_1;
+		return 1;
+	} else if (strncmp("high", s, len) == 0) {
+		*swing = SWING_2;
+		return 1;
+	} else if (strncmp("middle", s, len) == 0) {
+		*swing = SWING_3;
+		return 1;
+	} else if (strncmp("low", s, len) == 0) {
+		*swing = SWING_4;
+		return 1;
+	} else if (strncmp("down", s, len) == 0) {
+		*swing = SWING_5;
+		return 1;
+	}
+	return -1;
+}
+
+static const struct {
+	const char *name;
+	enum cmd cmd;
+} command_names[] = {
+	{ "state",     CMD_STATE },
+	{ "E-ion",     CMD_E_ION },
+	{ "Patrol",    CMD_PATROL },
+	{ "Quiet",     CMD_QUIET },
+	{ "Powerful",  CMD_POWERFUL },
+	{ "Check",     CMD_CHECK },
+	{ "Set_Air_1", CMD_SET_AIR_1 },
+	{ "Set_Air_2", CMD_SET_AIR_2 },
+	{ "Set_Air_3", CMD_SET_AIR_3 },
+	{ "AC_Reset",  CMD_AC_RESET },
+};
+
+static int string_to_command(enum cmd *cmd, const char *s, int len)
+{
+	for (size_t i = 0; i < sizeof(command_names) / sizeof(command_names[0]); i++) {
+		if (strlen(command_names[i].name) == len && strncasecmp(command_names[i].name, s, len) == 0) {
+			*cmd = command_names[i].cmd;
+			return 1;
+		}
+	}
+	return -1;
+}
+
+static bool ends_with(const char *a, int alen, const char *end)
+{
+	size_t endlen = strlen(end);
+
+	return alen >= endlen && strncmp(a + (alen - endlen), end, endlen) == 0;
+}
+
+int mqtt_discovery_topic(char *buf, size_t size, const char *id)
+{
+	return snprintf(buf, size, "homeassistant/climate/%s/config", id);
+}
+
+int mqtt_discovery_payload(char *buf, size_t size, const char *id, const char *sw_version)
+{
+	return snprintf(buf, size, discovery_data, id, id, id, sw_version);
+}
+
+/*
+ * @brief Parse a message on one of the mqtt_set_topics
+ *
+ * Returns 1 if req was filled in, 0 if the topic is not a set topic and
+ * -1 if the payload is not a valid value for the field.
+ */
+int mqtt_parse_set(struct mqtt_set_request *req, const char *topic, int topic_len, const char *data, int data_len)
+{
+	size_t i;
+
+	for (i = 0; i < mqtt_set_topic_count; i++) {
+		if (ends_with(topic, topic_len, mqtt_set_topics[i])) {
+			break;
+		}
+	}
+	if (i == mqtt_set_topic_count) {
+		return 0;
+	}
+
+	memset(req, 0, sizeof(*req));
+	req->field = i;
+
+	switch (req->field) {
+	case SET_MODE:
+		if (strncmp("off", data, data_len) == 0) {
+			req->power = false;
+			req->mode = MODE_AUTO;
+			return 1;
+		}
+		req->power = true;
+		return string_to_mode(&req->mode, data, data_len);
+	case SET_TEMPERATURE: {
+		char s[8];
+		snprintf(s, sizeof(s), "%.*s", data_len, data);
+		req->temperature = strtol(s, NULL, 10);
+		return 1;
+	}
+	case SET_FAN:
+		return string_to_fan(&req->fan, data, data_len);
+	case SET_SWING:
+		return string_to_swing(&req->swing, data, data_len);
+	}
+
+	return -1;
+}
+
+/*
+ * @brief Find "key": in a flat JSON object and return its value
+ *
+ * Strings are returned without their quotes, anything else up to the next
+ * comma, brace or white space.
+ */
+static const char *json_value(const char *json, int json_len, const char *key, int *len)
+{
+	static const char space[] = " \t\r\n";
+	const char *end = json + json_len;
+	size_t key_len = strlen(key);
+	const char *p, *q;
+
+	for (p = json; p + key_len + 2 <= end; p++) {
+		if (p[0] == '"' && strncmp(p + 1, key, key_len) == 0 && p[key_len + 1] == '"') {
+			break;
+		}
+	}
+	if (p + key_len + 2 > end) {
+		return NULL;
+	}
+
+	for (p += key_len + 2; p < end && strchr(space, *p) != NULL && *p != '\0'; p++) {
+	}
+	if (p == end || *p++ != ':') {
+		return NULL;
+	}
+	for (; p < end && strchr(space, *p) != NULL && *p != '\0'; p++) {
+	}
+
+	if (p < end && *p == '"') {
+		for (q = ++p; q < end && *q != '"'; q++) {
+		}
+	} else {
+		for (q = p; q < end && strchr(",}", *q) == NULL && strchr(space, *q) == NULL; q++) {
+		}
+	}
+	*len = q - p;
+	return p;
+}
+
+/*
+ * @brief Parse a state object, as published on TOPIC_PREFIX<id>
+ *
+ * Any subset of the keys may be present, so a partial object works as a
+ * change request. Returns the number of fields found, as set requests in
+ * key order, or -1 if a value is invalid.
+ */
+int mqtt_parse_state(struct mqtt_set_request reqs[MQTT_SET_FIELDS], const char *data, int data_len)
+{
+	int count = 0;
+
+	for (int i = 0; i < MQTT_SET_FIELDS; i++) {
+		const char *value;
+		int len;
+
+		value = json_value(data, data_len, state_keys[i], &len);
+		if (value == NULL) {
+			continue;
+		}
+		if (mqtt_parse_set(&reqs[count], mqtt_set_topics[i], strlen(mqtt_set_topics[i]), value, len) <= 0) {
+			return -1;
+		}
+		count++;
+	}
+
+	return count;
+}
+
+/*
+ * @brief Parse the payload of COMMAND_SET_TOPIC
+ *
+ * Accepts command names as published on /command, and "state" for the
+ * current state, separated by commas or spaces or as a JSON array of
+ * strings. Returns the number of commands, or -1 on an unknown name or
+ * more than max commands. CMD_STATE entries are left for the caller to
+ * fill in.
+ */
+int mqtt_parse_commands(struct panasonic_command *cmds, int max, const char *data, int data_len)
+{
+	static const char sep[] = " ,[]\"\t\r\n";
+	int count = 0;
+	int i = 0;
+
+	while (i < data_len) {
+		int start;
+
+		while (i < data_len && strchr(sep, data[i]) != NULL) {
+			i++;
+		}
+		start = i;
+		while (i < data_len && strchr(sep, data[i]) == NULL) {
+			i++;
+		}
+		if (i == start) {
+			break;
+		}
+		if (count == max) {
+			return -1;
+		}
+
+		memset(&cmds[count], 0, sizeof(cmds[count]));
+		if (string_to_command(&cmds[count].cmd, data + start, i - start) < 0) {
+			return -1;
+		}
+		count++;
+	}
+
+	return count;
+}
+
+/*
+ * @brief Take the "#<id>" suffix off a command payload
+ *
+ * Sets id to NULL if there is none. Returns the length of the payload
+ * without it, or -1 if the id is empty, longer than MQTT_ACK_ID_MAX or
+ * not printable ASCII without quotes and backslashes, which would need
+ * escaping in JSON.
+ */
+int mqtt_split_id(const char *data, int data_len, const char **id, int *id_len)
+{
+	int i;
+
+	*id = NULL;
+	*id_len = 0;
+	for (i = data_len - 1; i >= 0 && data[i] != '#'; i--) {
+	}
+	if (i < 0) {
+		return data_len;
+	}
+
+	if (data_len - i - 1 < 1 || data_len - i - 1 > MQTT_ACK_ID_MAX) {
+		return -1;
+	}
+	for (int j = i + 1; j < data_len; j++) {
+		if (data[j] < 0x20 || data[j] == '"' || data[j] == '\\' || data[j] == 0x7f) {
+			return -1;
+		}
+	}
+
+	*id = data + i + 1;
+	*id_len = data_len - i - 1;
+	return i;
+}
+
+/*
+ * @brief Build the message for ACK_TOPIC
+ *
+ * result is "ok", "invalid" for a payload that was not understood,
+ * "failed" if the frame could not be sent, "no state" for a command that
+ * needs the current state before one is known, or "superseded" for a
+ * command kept during an outage that a newer one for the same field
+ * replaced. queue_us is the time from receipt to the start of the
+ * transmission, tx_us the transmission up to rmt_wait_tx_done(); both
+ * are 0 when nothing was sent. Without an id, for an MQTT 5 reply that
+ * carries correlation data instead, the object has no "id".
+ */
+int mqtt_ack_payload(char *buf, size_t size, const char *id, int id_len, const char *result,
+                     int64_t queue_us, int64_t tx_us)
+{
+	if (id == NULL) {
+		return snprintf(buf, size, "{\"result\":\"%s\",\"queue_us\":%lld,\"tx_us\":%lld}",
+		                result, (long long)queue_us, (long long)tx_us);
+	}
+	return snprintf(buf, size, "{\"id\":\"%.*s\",\"result\":\"%s\",\"queue_us\":%lld,\"tx_us\":%lld}",
+	                id_len, id, result, (long long)queue_us, (long long)tx_us);
+}
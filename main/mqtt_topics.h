@@ -0,0 +1,93 @@
+#ifndef MQTT_TOPICS_H
+#define MQTT_TOPICS_H
+
+#include "panasonic_frame.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TOPIC_PREFIX "panasonic/"
+
+/* Longest suffix mqtt_pub() appends to TOPIC_PREFIX<id> */
+#define TOPIC_SUFFIX_MAX     16
+
+/* Retained availability, kept up to date by the broker through the LWT */
+#define AVAILABILITY_TOPIC   "/available"
+#define AVAILABILITY_ONLINE  "online"
+#define AVAILABILITY_OFFLINE "offline"
+
+/* Optional single byte liveness publish, see CONFIG_MQTT_HEARTBEAT_INTERVAL */
+#define HEARTBEAT_TOPIC      "/heartbeat"
+
+/* Update trigger; any payload starts a check of CONFIG_FIRMWARE_MANIFEST_URL */
+#define OTA_TOPIC            "/ota"
+
+/* Special commands, one name or a list such as "state,Powerful" */
+#define COMMAND_SET_TOPIC    "/command/set"
+
+/* Receive timing histogram, one message per series on request to
+   IR_HISTOGRAM_TOPIC"/get"; a payload of "reset" clears it afterwards */
+#define IR_HISTOGRAM_TOPIC   "/ir/histogram"
+
+/* Learned codes for other devices: a name published to IR_LEARN_TOPIC
+   records the next burst received under that name (empty cancels), one
+   published to IR_SEND_TOPIC plays it back; results on IR_STATUS_TOPIC */
+#define IR_LEARN_TOPIC       "/ir/learn"
+#define IR_SEND_TOPIC        "/ir/send"
+#define IR_STATUS_TOPIC      "/ir/status"
+
+/* Per-task CPU and stack use, see task_stats.h */
+#define STATS_TASKS_TOPIC    "/stats/tasks"
+
+/* State history, see history.h; queries go to HISTORY_TOPIC"/get" */
+#define HISTORY_TOPIC        "/history"
+
+/* Command acknowledgements: a /set or COMMAND_SET_TOPIC payload may end in
+   "#<id>", and the id comes back on ACK_TOPIC at QoS 1 once the frame has
+   gone out or the command was refused */
+#define ACK_TOPIC            "/ack"
+#define MQTT_ACK_ID_MAX      32
+#define MQTT_ACK_MAXLEN      (MQTT_ACK_ID_MAX + 80)
+
+/* Group topics: the set topics and COMMAND_SET_TOPIC under
+   GROUP_TOPIC_PREFIX<name> reach every proxy in the group, see
+   CONFIG_MQTT_GROUPS */
+#define GROUP_TOPIC_PREFIX   TOPIC_PREFIX"group/"
+#define GROUP_MAX            4
+#define GROUP_NAME_MAX       16
+
+/* Longest discovery payload mqtt_discovery_payload() can produce */
+#define MQTT_DISCOVERY_MAXLEN 1400
+
+enum mqtt_set_field {
+	SET_MODE,
+	SET_TEMPERATURE,
+	SET_FAN,
+	SET_SWING,
+};
+#define MQTT_SET_FIELDS (SET_SWING + 1)
+
+/* A parsed command from one of the panasonic/<id>/<field>/set topics */
+struct mqtt_set_request {
+	enum mqtt_set_field field;
+	bool power;
+	enum mode mode;
+	int temperature;
+	enum fan fan;
+	enum swing swing;
+};
+
+/* Topic suffixes, appended to TOPIC_PREFIX<id>, that a proxy subscribes to */
+extern const char *const mqtt_set_topics[];
+extern const size_t mqtt_set_topic_count;
+
+int mqtt_discovery_topic(char *buf, size_t size, const char *id);
+int mqtt_discovery_payload(char *buf, size_t size, const char *id, const char *sw_version);
+int mqtt_parse_set(struct mqtt_set_request *req, const char *topic, int topic_len, const char *data, int data_len);
+int mqtt_parse_state(struct mqtt_set_request reqs[MQTT_SET_FIELDS], const char *data, int data_len);
+int mqtt_parse_commands(struct panasonic_command *cmds, int max, const char *data, int data_len);
+int mqtt_split_id(const char *data, int data_len, const char **id, int *id_len);
+int mqtt_ack_payload(char *buf, size_t size, const char *id, int id_len, const char *result,
+                     int64_t queue_us, int64_t tx_us);
+
+#endif /* MQTT_TOPICS_H */
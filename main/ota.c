@@ -7,35 +7,139 @@
    CONDITIONS OF ANY KIND, either express or implied.
 */
 #include <string.h>
+#include <strings.h>
+#include <stdlib.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/event_groups.h"
+#include "freertos/queue.h"
 #include "esp_system.h"
 #include "esp_event.h"
 #include "esp_log.h"
 #include "esp_ota_ops.h"
+#include "esp_partition.h"
+#include "esp_image_format.h"
 #include "esp_http_client.h"
-#include "esp_https_ota.h"
+#include "esp_tls.h"
+#include "nvs.h"
+#include "cJSON.h"
+
+#include "mem_budget.h"
+#include "mqtt.h"
+#include "ota.h"
+#include "ota_patch.h"
+#include "tls_session.h"
 
 #if CONFIG_EXAMPLE_CONNECT_WIFI
 #include "esp_wifi.h"
 #endif
 
+#define OTA_BUF_SIZE        1024
+#define OTA_CHECKPOINT      (16 * SPI_FLASH_SEC_SIZE) /*!< Bytes between progress saves to NVS */
+#define OTA_RETRY_MIN_MS    2000
+#define OTA_RETRY_MAX_MS    (10 * 60 * 1000)
+#define OTA_NVS_NAMESPACE   "ota"
+#define OTA_NVS_KEY         "progress"
+#define OTA_MANIFEST_MAXLEN 512
+#define OTA_HEADERS_MAXLEN  512
+#define OTA_MANIFEST_TIMEOUT_MS 10000
+#define OTA_STATUS_TOPIC    "/ota/status"
+
+/* Offset of the app description in an application image */
+#define OTA_DESC_OFFSET     (sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t))
+
 static const char TAG[] = "OTA";
 extern const uint8_t server_cert_pem_start[] asm("_binary_ca_cert_pem_start");
 extern const uint8_t server_cert_pem_end[] asm("_binary_ca_cert_pem_end");
 
+/*
+ * Download state that survives reboots. It is only saved when the decoder
+ * has just completed a block, so written is sector aligned and the sector
+ * at written is always erased again before it is rewritten on resume.
+ */
+struct ota_progress {
+	uint32_t part;          /*!< Flash address of the partition being written */
+	uint32_t size;          /*!< Total download size */
+	uint32_t offset;        /*!< Download bytes consumed */
+	uint32_t written;       /*!< Image bytes known to be on flash */
+	uint32_t image_size;    /*!< Decoded image size */
+	uint32_t old_pos;       /*!< Patch decoder state at offset */
+	uint32_t url_hash;      /*!< Which URL the download came from */
+	uint8_t format;         /*!< enum ota_patch_format */
+	char etag[64];          /*!< Server ETag of the image, if any */
+};
+
+struct ota_response {
+	uint32_t total;
+	char etag[64];
+};
+
+/*
+ * Small JSON document describing the current release, fetched before the
+ * image so that an up to date proxy never touches the image itself:
+ *
+ *   {"version":"1.4","size":612345,"sha256":"<hex>","rollout":25,"url":"https://..."}
+ *
+ * sha256 is the digest appended to the application image (its last 32
+ * bytes). size is the download size. url defaults to
+ * CONFIG_FIRMWARE_UPGRADE_URL and rollout to 100 (percent of the fleet).
+ * Manifest and image must both come over https:// from a server the CA
+ * certificate vouches for, or else the sha256 would vouch for nothing.
+ */
+struct ota_manifest {
+	char version[32];
+	char url[256];
+	uint8_t sha256[32];
+	bool has_sha256;
+	uint32_t size;
+	int rollout;
+};
+
+static struct ota_progress progress;
+static struct ota_response response;
+static struct ota_patch patch;
+static const esp_partition_t *update_part;
+static const esp_partition_t *running_part;
+static esp_err_t write_err;
+static const uint8_t *expected_sha256;
+static char device_id[13];
+static QueueHandle_t ota_queue;
+
 static esp_http_client_config_t http_config = {
 	.url = CONFIG_FIRMWARE_UPGRADE_URL,
 	.cert_pem = (char *)server_cert_pem_start,
+	.user_data = &response,
 };
 
+static void ota_status(const char *status)
+{
+	mqtt_pub(OTA_STATUS_TOPIC, status, strlen(status), 0, 0);
+}
+
+static bool url_is_https(const char *url)
+{
+	return strncmp(url, "https://", 8) == 0;
+}
+
+static uint32_t fnv1a(uint32_t h, const char *s)
+{
+	while (*s) {
+		h = (h ^ (uint8_t)*s++) * 16777619;
+	}
+	return h;
+}
+
 static esp_err_t validate_image_header(esp_app_desc_t *new_app_info)
 {
 	if (new_app_info == NULL) {
 		return ESP_ERR_INVALID_ARG;
 	}
 
+	/* The manifest already established that the image differs */
+	if (expected_sha256 != NULL) {
+		return ESP_OK;
+	}
+
 	const esp_partition_t *running = esp_ota_get_running_partition();
 	esp_app_desc_t running_app_info;
 	if (esp_ota_get_partition_description(running, &running_app_info) == ESP_OK) {
@@ -44,71 +148,655 @@ static esp_err_t validate_image_header(esp_app_desc_t *new_app_info)
 
 	if (memcmp(new_app_info->version, running_app_info.version, sizeof(new_app_info->version)) == 0) {
 		ESP_LOGW(TAG, "Current running version is the same as a new. We will not continue the update.");
-		return ESP_FAIL;
+		return ESP_ERR_INVALID_VERSION;
 	}
 	return ESP_OK;
 }
 
-void advanced_ota_example_task(void *pvParameter)
+static void progress_save(void)
 {
-	ESP_LOGI(TAG, "Starting Advanced OTA example");
+	nvs_handle_t nvs;
 
-	esp_err_t ota_finish_err = ESP_OK;
-	esp_http_client_config_t *config = pvParameter;
-	esp_https_ota_config_t ota_config = {
-		.http_config = config,
-	};
+	if (nvs_open(OTA_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) {
+		return;
+	}
+	if (progress.size == 0) {
+		nvs_erase_key(nvs, OTA_NVS_KEY);
+	} else {
+		nvs_set_blob(nvs, OTA_NVS_KEY, &progress, sizeof(progress));
+	}
+	nvs_commit(nvs);
+	nvs_close(nvs);
+}
 
-	esp_https_ota_handle_t https_ota_handle = NULL;
-	esp_err_t err = esp_https_ota_begin(&ota_config, &https_ota_handle);
-	if (err != ESP_OK) {
-		ESP_LOGE(TAG, "ESP HTTPS OTA Begin failed");
-		vTaskDelete(NULL);
+static void progress_load(const esp_partition_t *part)
+{
+	nvs_handle_t nvs;
+	size_t len = sizeof(progress);
+
+	memset(&progress, 0, sizeof(progress));
+	if (nvs_open(OTA_NVS_NAMESPACE, NVS_READONLY, &nvs) == ESP_OK) {
+		if (nvs_get_blob(nvs, OTA_NVS_KEY, &progress, &len) != ESP_OK || len != sizeof(progress)) {
+			memset(&progress, 0, sizeof(progress));
+		}
+		nvs_close(nvs);
+	}
+
+	if (progress.part != part->address || progress.url_hash != fnv1a(2166136261u, http_config.url) ||
+	    progress.image_size > part->size ||
+	    progress.offset > progress.size || progress.written > progress.image_size ||
+	    progress.written % SPI_FLASH_SEC_SIZE != 0 || progress.format == OTA_FORMAT_UNKNOWN) {
+		memset(&progress, 0, sizeof(progress));
+	} else if (progress.offset > 0) {
+		ESP_LOGI(TAG, "Resuming download at %u of %u bytes", progress.offset, progress.size);
+	}
+}
+
+static void progress_reset(void)
+{
+	memset(&progress, 0, sizeof(progress));
+	progress_save();
+}
+
+static esp_err_t http_event_handler(esp_http_client_event_t *evt)
+{
+	struct ota_response *r = evt->user_data;
+
+	if (evt->event_id != HTTP_EVENT_ON_HEADER) {
+		return ESP_OK;
+	}
+
+	if (strcasecmp(evt->header_key, "Content-Range") == 0) {
+		/* bytes <first>-<last>/<total> */
+		const char *total = strchr(evt->header_value, '/');
+		if (total != NULL) {
+			r->total = strtoul(total + 1, NULL, 10);
+		}
+	} else if (strcasecmp(evt->header_key, "ETag") == 0) {
+		snprintf(r->etag, sizeof(r->etag), "%s", evt->header_value);
+	}
+	return ESP_OK;
+}
+
+/*
+ * @brief Open the image at progress.offset
+ *
+ * Falls back to a full download if the server ignores the range or the
+ * image has changed since the saved progress was recorded.
+ */
+static esp_err_t ota_open(esp_http_client_handle_t client, const esp_partition_t *part)
+{
+	char range[32];
+	esp_err_t err;
+	int status;
+
+	memset(&response, 0, sizeof(response));
+	if (progress.offset > 0) {
+		snprintf(range, sizeof(range), "bytes=%u-", progress.offset);
+		esp_http_client_set_header(client, "Range", range);
 	}
 
-	esp_app_desc_t app_desc;
-	err = esp_https_ota_get_img_desc(https_ota_handle, &app_desc);
+	err = esp_http_client_open(client, 0);
 	if (err != ESP_OK) {
-		ESP_LOGE(TAG, "esp_https_ota_read_img_desc failed");
-		goto ota_end;
+		ESP_LOGE(TAG, "Failed to open HTTP connection: %s", esp_err_to_name(err));
+		return err;
+	}
+	int content_length = esp_http_client_fetch_headers(client);
+	status = esp_http_client_get_status_code(client);
+
+	if (status == 206 && progress.offset > 0) {
+		if (response.total != progress.size ||
+		    (response.etag[0] && progress.etag[0] && strcmp(response.etag, progress.etag) != 0)) {
+			ESP_LOGW(TAG, "Image changed on server, restarting download");
+			progress_reset();
+			return ESP_ERR_INVALID_STATE;
+		}
+		return ESP_OK;
+	} else if (status == 200) {
+		if (progress.offset > 0) {
+			ESP_LOGW(TAG, "Server does not support ranges, restarting download");
+		}
+		if (content_length <= OTA_PATCH_HEADER_SIZE || content_length > part->size) {
+			ESP_LOGE(TAG, "Invalid image size %d", content_length);
+			return ESP_ERR_INVALID_SIZE;
+		}
+		memset(&progress, 0, sizeof(progress));
+		progress.part = part->address;
+		progress.url_hash = fnv1a(2166136261u, http_config.url);
+		progress.size = content_length;
+		memcpy(progress.etag, response.etag, sizeof(progress.etag));
+		return ESP_OK;
+	} else if (status == 416) {
+		ESP_LOGW(TAG, "Saved offset rejected by server, restarting download");
+		progress_reset();
+		return ESP_ERR_INVALID_STATE;
+	}
+
+	ESP_LOGE(TAG, "Unexpected HTTP status %d", status);
+	return ESP_FAIL;
+}
+
+static int read_old(void *priv, uint32_t offset, void *buf, size_t len)
+{
+	if (offset + len > running_part->size) {
+		return -1;
+	}
+	return esp_partition_read(running_part, offset, buf, len) == ESP_OK ? 0 : -1;
+}
+
+static int read_new(void *priv, uint32_t offset, void *buf, size_t len)
+{
+	return esp_partition_read(update_part, offset, buf, len) == ESP_OK ? 0 : -1;
+}
+
+/*
+ * @brief Store one decoded block, erasing its sector first
+ *
+ * The sector is erased just before it is written, so that a resumed
+ * download does not wipe what the previous attempts already stored.
+ */
+static int write_block(void *priv, uint32_t offset, const void *buf, size_t len)
+{
+	if (offset == 0) {
+		const esp_app_desc_t *app_desc = (const void *)((const uint8_t *)buf + OTA_DESC_OFFSET);
+
+		if (len < OTA_DESC_OFFSET + sizeof(*app_desc) || app_desc->magic_word != ESP_APP_DESC_MAGIC_WORD) {
+			ESP_LOGE(TAG, "image header verification failed");
+			write_err = ESP_ERR_OTA_VALIDATE_FAILED;
+			return -1;
+		}
+		write_err = validate_image_header((esp_app_desc_t *)app_desc);
+		if (write_err != ESP_OK) {
+			return -1;
+		}
+	}
+
+	write_err = esp_partition_erase_range(update_part, offset, SPI_FLASH_SEC_SIZE);
+	if (write_err == ESP_OK) {
+		write_err = esp_partition_write(update_part, offset, buf, len);
+	}
+	return write_err == ESP_OK ? 0 : -1;
+}
+
+static const struct ota_patch_io patch_io = {
+	.read_old = read_old,
+	.read_new = read_new,
+	.write_block = write_block,
+};
+
+static int ota_read_full(esp_http_client_handle_t client, char *buf, int len)
+{
+	int pos = 0;
+
+	while (pos < len) {
+		int n = esp_http_client_read(client, buf + pos, len - pos);
+		if (n <= 0) {
+			return -1;
+		}
+		pos += n;
+	}
+	return pos;
+}
+
+/*
+ * @brief Work out what the server sends and set up the decoder for it
+ *
+ * Consumes the patch header, if any, and returns how many bytes of buf
+ * are image data.
+ */
+static int ota_start(esp_http_client_handle_t client, char *buf)
+{
+	struct ota_patch_header h;
+
+	if (ota_read_full(client, buf, OTA_PATCH_HEADER_SIZE) < 0) {
+		return -1;
+	}
+
+	progress.format = ota_patch_detect((uint8_t *)buf, OTA_PATCH_HEADER_SIZE);
+	if (progress.format == OTA_FORMAT_RAW) {
+		progress.image_size = progress.size;
+		ota_patch_init(&patch, &patch_io, OTA_FORMAT_RAW, progress.image_size, 0, 0);
+		return OTA_PATCH_HEADER_SIZE;
+	} else if (progress.format != OTA_FORMAT_PATCH) {
+		ESP_LOGE(TAG, "Unknown image format");
+		return -1;
+	}
+
+	ota_patch_parse_header(&h, (uint8_t *)buf, OTA_PATCH_HEADER_SIZE);
+	if (h.image_size > update_part->size) {
+		ESP_LOGE(TAG, "Image too large: %u bytes", h.image_size);
+		return -1;
+	}
+	if (h.flags & OTA_PATCH_FLAG_DELTA) {
+		const esp_app_desc_t *running = esp_ota_get_app_description();
+
+		if (h.old_size > running_part->size ||
+		    memcmp(h.old_sha256, running->app_elf_sha256, sizeof(h.old_sha256)) != 0) {
+			ESP_LOGE(TAG, "Delta image is not for the running firmware");
+			write_err = ESP_ERR_INVALID_VERSION;
+			return -1;
+		}
+	}
+	ESP_LOGI(TAG, "%s image, %u bytes for %u", h.flags & OTA_PATCH_FLAG_DELTA ? "Delta" : "Compressed",
+	         progress.size, h.image_size);
+
+	progress.image_size = h.image_size;
+	ota_patch_init(&patch, &patch_io, OTA_FORMAT_PATCH, progress.image_size, 0, 0);
+	return 0;
+}
+
+/*
+ * @brief Download the rest of the image into the update partition
+ *
+ * Plain, compressed and delta images all go through the patch decoder,
+ * which hands over whole sectors. Progress is recorded at those block
+ * boundaries, where the decoder state is fully described by the input
+ * and output offsets.
+ */
+static esp_err_t ota_download(const esp_partition_t *part)
+{
+	static char buf[OTA_BUF_SIZE];
+	esp_err_t err;
+	int n;
+
+	update_part = part;
+	running_part = esp_ota_get_running_partition();
+	write_err = ESP_OK;
+
+	esp_http_client_handle_t client = esp_http_client_init(&http_config);
+	if (client == NULL) {
+		return ESP_ERR_NO_MEM;
 	}
-	err = validate_image_header(&app_desc);
+
+	err = ota_open(client, part);
 	if (err != ESP_OK) {
-		ESP_LOGE(TAG, "image header verification failed");
-		goto ota_end;
+		goto out;
+	}
+
+	uint32_t offset = progress.offset;
+
+	if (offset == 0) {
+		n = ota_start(client, buf);
+		if (n < 0) {
+			err = write_err != ESP_OK ? write_err : ESP_FAIL;
+			goto out;
+		}
+		offset = OTA_PATCH_HEADER_SIZE - n;
+	} else {
+		ota_patch_init(&patch, &patch_io, progress.format, progress.image_size,
+		               progress.written, progress.old_pos);
+		n = 0;
 	}
 
 	while (1) {
-		err = esp_https_ota_perform(https_ota_handle);
-		if (err != ESP_ERR_HTTPS_OTA_IN_PROGRESS) {
+		for (int pos = 0; pos < n;) {
+			int used = ota_patch_feed(&patch, (uint8_t *)buf + pos, n - pos);
+			if (used < 0) {
+				ESP_LOGE(TAG, "Image data invalid at %u", offset);
+				err = write_err != ESP_OK ? write_err : ESP_ERR_INVALID_RESPONSE;
+				if (err != ESP_ERR_INVALID_VERSION) {
+					progress_reset();
+				}
+				goto out;
+			}
+			pos += used;
+			offset += used;
+
+			if (patch.block_done && patch.out - progress.written >= OTA_CHECKPOINT) {
+				progress.offset = offset;
+				progress.written = patch.out;
+				progress.old_pos = patch.old_pos;
+				progress_save();
+				ESP_LOGD(TAG, "Image bytes written: %u", patch.out);
+			}
+		}
+
+		if (offset >= progress.size) {
 			break;
 		}
-		// esp_https_ota_perform returns after every read operation which gives user the ability to
-		// monitor the status of OTA upgrade by calling esp_https_ota_get_image_len_read, which gives length of image
-		// data read so far.
-		ESP_LOGD(TAG, "Image bytes read: %d", esp_https_ota_get_image_len_read(https_ota_handle));
+		n = esp_http_client_read(client, buf, sizeof(buf));
+		if (n <= 0) {
+			ESP_LOGE(TAG, "Connection lost at %u of %u bytes", offset, progress.size);
+			err = ESP_FAIL;
+			goto out;
+		}
+		if (n > progress.size - offset) {
+			n = progress.size - offset;
+		}
+	}
+
+	uint8_t sha256[32];
+
+	if (patch.out != progress.image_size) {
+		ESP_LOGE(TAG, "Image truncated at %u of %u bytes", patch.out, progress.image_size);
+		err = ESP_ERR_INVALID_SIZE;
+	} else if (expected_sha256 != NULL &&
+	           (esp_partition_get_sha256(part, sha256) != ESP_OK ||
+	            memcmp(sha256, expected_sha256, sizeof(sha256)) != 0)) {
+		ESP_LOGE(TAG, "Image does not match the manifest hash");
+		err = ESP_ERR_INVALID_CRC;
+	} else {
+		err = esp_ota_set_boot_partition(part);
+		if (err != ESP_OK) {
+			ESP_LOGE(TAG, "Downloaded image is invalid: %s", esp_err_to_name(err));
+		}
+	}
+	progress_reset();
+
+out:
+	esp_http_client_cleanup(client);
+	return err;
+}
+
+/*
+ * @brief GET a small document, resuming the TLS session of the last check
+ *
+ * Manifests are fetched on every check, so this goes through esp-tls
+ * directly for the session cache, which esp_http_client cannot use.
+ * HTTP/1.0 keeps the reply unchunked. Returns the body length, or -1.
+ */
+static int manifest_get(const char *url, char *buf, size_t size)
+{
+	esp_tls_cfg_t cfg = {
+		.cacert_buf = server_cert_pem_start,
+		.cacert_bytes = server_cert_pem_end - server_cert_pem_start,
+		.timeout_ms = OTA_MANIFEST_TIMEOUT_MS,
+	};
+	char host[TLS_SESSION_HOST_MAX];
+	const char *path, *body;
+	size_t len = 0;
+	esp_tls_t *tls;
+	int status = 0;
+	int n;
+
+	if (!url_is_https(url)) {
+		ESP_LOGE(TAG, "Manifest URL is not https://");
+		return -1;
+	}
+	path = url + 8;
+	n = strcspn(path, "/");
+	snprintf(host, sizeof(host), "%.*s", n, path);
+	path = path[n] != '\0' ? path + n : "/";
+
+	n = snprintf(buf, size, "GET %s HTTP/1.0\r\nHost: %s\r\n\r\n", path, host);
+	if (n >= (int)size) {
+		return -1;
+	}
+
+	tls = tls_session_connect(url, host, &cfg);
+	if (tls == NULL) {
+		return -1;
+	}
+	while (len < (size_t)n) {
+		ssize_t ret = esp_tls_conn_write(tls, buf + len, n - len);
+		if (ret < 0 && ret != ESP_TLS_ERR_SSL_WANT_READ && ret != ESP_TLS_ERR_SSL_WANT_WRITE) {
+			break;
+		}
+		len += ret > 0 ? ret : 0;
+	}
+	if (len < (size_t)n) {
+		esp_tls_conn_delete(tls);
+		return -1;
+	}
+
+	/* Read up to the server closing the connection */
+	for (len = 0; len < size - 1;) {
+		ssize_t ret = esp_tls_conn_read(tls, buf + len, size - 1 - len);
+		if (ret == ESP_TLS_ERR_SSL_WANT_READ || ret == ESP_TLS_ERR_SSL_WANT_WRITE) {
+			continue;
+		} else if (ret <= 0) {
+			break;
+		}
+		len += ret;
+	}
+	esp_tls_conn_delete(tls);
+	buf[len] = '\0';
+
+	body = strstr(buf, "\r\n\r\n");
+	if (sscanf(buf, "HTTP/%*s %d", &status) != 1 || status != 200 || body == NULL) {
+		ESP_LOGE(TAG, "Manifest HTTP status %d", status);
+		return -1;
+	}
+	body += 4;
+	len -= body - buf;
+	memmove(buf, body, len + 1);
+	return len;
+}
+
+static int hex_to_bin(uint8_t *bin, size_t size, const char *hex)
+{
+	for (size_t i = 0; i < size; i++) {
+		unsigned int b;
+
+		if (sscanf(hex + i * 2, "%2x", &b) != 1) {
+			return -1;
+		}
+		bin[i] = b;
+	}
+	return hex[size * 2] == '\0' ? 0 : -1;
+}
+
+static esp_err_t manifest_fetch(struct ota_manifest *m, const char *url)
+{
+	char buf[OTA_MANIFEST_MAXLEN + OTA_HEADERS_MAXLEN];
+	cJSON *json, *item;
+
+	if (manifest_get(url, buf, sizeof(buf)) < 0) {
+		return ESP_FAIL;
+	}
+
+	json = cJSON_Parse(buf);
+	if (json == NULL) {
+		ESP_LOGE(TAG, "Invalid manifest");
+		return ESP_ERR_INVALID_RESPONSE;
+	}
+
+	memset(m, 0, sizeof(*m));
+	m->rollout = 100;
+	snprintf(m->url, sizeof(m->url), "%s", CONFIG_FIRMWARE_UPGRADE_URL);
+
+	item = cJSON_GetObjectItem(json, "version");
+	if (cJSON_IsString(item)) {
+		snprintf(m->version, sizeof(m->version), "%s", item->valuestring);
+	}
+	item = cJSON_GetObjectItem(json, "url");
+	if (cJSON_IsString(item)) {
+		snprintf(m->url, sizeof(m->url), "%s", item->valuestring);
+	}
+	item = cJSON_GetObjectItem(json, "size");
+	if (cJSON_IsNumber(item)) {
+		m->size = item->valuedouble;
+	}
+	item = cJSON_GetObjectItem(json, "rollout");
+	if (cJSON_IsNumber(item)) {
+		m->rollout = item->valueint;
+	}
+	item = cJSON_GetObjectItem(json, "sha256");
+	if (cJSON_IsString(item)) {
+		m->has_sha256 = hex_to_bin(m->sha256, sizeof(m->sha256), item->valuestring) == 0;
+	}
+	cJSON_Delete(json);
+
+	if (m->version[0] == '\0' && !m->has_sha256) {
+		ESP_LOGE(TAG, "Manifest has neither version nor sha256");
+		return ESP_ERR_INVALID_RESPONSE;
+	}
+	if (!url_is_https(m->url)) {
+		ESP_LOGE(TAG, "Manifest image URL is not https://");
+		return ESP_ERR_INVALID_RESPONSE;
+	}
+	return ESP_OK;
+}
+
+/*
+ * @brief Decide from the manifest whether this proxy should update
+ *
+ * Returns ESP_OK to go ahead, ESP_ERR_INVALID_VERSION if the running
+ * image is already the one described, or ESP_ERR_NOT_FOUND if this unit
+ * is outside the rollout percentage.
+ */
+static esp_err_t manifest_check(const struct ota_manifest *m)
+{
+	const esp_app_desc_t *running = esp_ota_get_app_description();
+	uint8_t sha256[32];
+
+	if (m->has_sha256) {
+		if (esp_partition_get_sha256(esp_ota_get_running_partition(), sha256) == ESP_OK &&
+		    memcmp(sha256, m->sha256, sizeof(sha256)) == 0) {
+			return ESP_ERR_INVALID_VERSION;
+		}
+	} else if (strncmp(m->version, running->version, sizeof(running->version)) == 0) {
+		return ESP_ERR_INVALID_VERSION;
 	}
 
-	if (esp_https_ota_is_complete_data_received(https_ota_handle) != true) {
-		// the OTA image was not completely received and user can customise the response to this situation.
-		ESP_LOGE(TAG, "Complete data was not received.");
+	/* Same units go first for every release step of the same version */
+	if (fnv1a(fnv1a(2166136261u, device_id), m->version) % 100 >= m->rollout) {
+		return ESP_ERR_NOT_FOUND;
 	}
+	return ESP_OK;
+}
 
-ota_end:
-	ota_finish_err = esp_https_ota_finish(https_ota_handle);
-	if ((err == ESP_OK) && (ota_finish_err == ESP_OK)) {
-		ESP_LOGI(TAG, "ESP_HTTPS_OTA upgrade successful. Rebooting ...");
+/*
+ * @brief One update check: manifest (if configured), then download
+ *
+ * Returns ESP_OK if there is nothing (more) to do, otherwise an error
+ * that is worth retrying.
+ */
+static esp_err_t ota_check(const esp_partition_t *part)
+{
+	static struct ota_manifest manifest;
+	static char image_url[256];
+	esp_err_t err;
+
+	expected_sha256 = NULL;
+	snprintf(image_url, sizeof(image_url), "%s", CONFIG_FIRMWARE_UPGRADE_URL);
+
+	if (CONFIG_FIRMWARE_MANIFEST_URL[0] != '\0') {
+		ota_status("checking");
+		err = manifest_fetch(&manifest, CONFIG_FIRMWARE_MANIFEST_URL);
+		if (err != ESP_OK) {
+			return err;
+		}
+		err = manifest_check(&manifest);
+		if (err == ESP_ERR_INVALID_VERSION) {
+			ESP_LOGI(TAG, "Firmware is up to date");
+			ota_status("up to date");
+			return ESP_OK;
+		} else if (err == ESP_ERR_NOT_FOUND) {
+			ESP_LOGI(TAG, "Version %s is not rolled out to this unit yet", manifest.version);
+			ota_status("not in rollout");
+			return ESP_OK;
+		}
+		ESP_LOGI(TAG, "Updating to version %s", manifest.version);
+		snprintf(image_url, sizeof(image_url), "%s", manifest.url);
+		if (manifest.has_sha256) {
+			expected_sha256 = manifest.sha256;
+		}
+	}
+
+	if (!url_is_https(image_url)) {
+		ESP_LOGE(TAG, "Image URL is not https://");
+		ota_status("failed");
+		return ESP_OK;
+	}
+	http_config.url = image_url;
+	progress_load(part);
+	if (CONFIG_FIRMWARE_MANIFEST_URL[0] != '\0' && manifest.size != 0 && progress.size != 0 &&
+	    progress.size != manifest.size) {
+		ESP_LOGW(TAG, "Saved progress is for another image");
+		progress_reset();
+	}
+
+	ota_status("downloading");
+	err = ota_download(part);
+	if (err == ESP_OK) {
+		ESP_LOGI(TAG, "OTA upgrade successful. Rebooting ...");
+		ota_status("rebooting");
 		vTaskDelay(1000 / portTICK_PERIOD_MS);
 		esp_restart();
-	} else {
-		ESP_LOGE(TAG, "ESP_HTTPS_OTA upgrade failed %d", ota_finish_err);
+	} else if (err == ESP_ERR_INVALID_VERSION) {
+		ota_status("up to date");
+		return ESP_OK;
+	}
+	return err;
+}
+
+void advanced_ota_example_task(void *pvParameter)
+{
+	uint8_t req;
+
+	ESP_LOGI(TAG, "Starting Advanced OTA example");
+
+	while (xQueueReceive(ota_queue, &req, portMAX_DELAY) == pdTRUE) {
+		uint32_t delay_ms = OTA_RETRY_MIN_MS;
+
+		while (1) {
+			const esp_partition_t *part = esp_ota_get_next_update_partition(NULL);
+			if (part == NULL) {
+				ESP_LOGE(TAG, "No OTA partition");
+				break;
+			}
+
+			uint32_t start = progress.offset;
+			esp_err_t err = ota_check(part);
+			if (err == ESP_OK) {
+				break;
+			} else if (err == ESP_ERR_INVALID_STATE) {
+				/* Stale progress was discarded, start over right away */
+				continue;
+			}
+
+			/* Back off, but not if the attempt got somewhere */
+			if (progress.offset > start) {
+				delay_ms = OTA_RETRY_MIN_MS;
+			}
+			uint32_t wait = delay_ms / 2 + esp_random() % (delay_ms / 2 + 1);
+			ESP_LOGW(TAG, "OTA attempt failed (%s), retrying in %u ms", esp_err_to_name(err), wait);
+			ota_status("failed");
+			delay_ms = delay_ms * 2 > OTA_RETRY_MAX_MS ? OTA_RETRY_MAX_MS : delay_ms * 2;
+
+			/* A new trigger cuts the wait short */
+			xQueueReceive(ota_queue, &req, wait / portTICK_PERIOD_MS);
+		}
 	}
 
 	vTaskDelete(NULL);
 }
 
-void ota_init(const char *url)
+/*
+ * @brief Ask the OTA task for an update check
+ *
+ * Always against CONFIG_FIRMWARE_MANIFEST_URL, or the image directly if
+ * that is empty: whoever can publish the trigger must not be able to
+ * choose where the firmware comes from.
+ */
+void ota_trigger(void)
+{
+	uint8_t req = 0;
+
+	xQueueOverwrite(ota_queue, &req);
+}
+
+void ota_init(const char *id)
 {
-	http_config.url = url;
-	xTaskCreate(&advanced_ota_example_task, "advanced_ota_example_task", 1024 * 8, &http_config, 5, NULL);
+	snprintf(device_id, sizeof(device_id), "%s", id);
+	http_config.event_handler = http_event_handler;
+	tls_session_init();
+
+	TaskHandle_t task;
+#if CONFIG_STATIC_MEMORY
+	static uint8_t queue_storage[OTA_QUEUE_LEN * sizeof(uint8_t)];
+	static StaticQueue_t queue_buf;
+	static StackType_t stack[OTA_TASK_STACK];
+	static StaticTask_t task_buf;
+
+	ota_queue = xQueueCreateStatic(OTA_QUEUE_LEN, sizeof(uint8_t), queue_storage, &queue_buf);
+	task = xTaskCreateStatic(&advanced_ota_example_task, "advanced_ota_example_task", OTA_TASK_STACK,
+	                         NULL, 5, stack, &task_buf);
+#else
+	ota_queue = xQueueCreate(OTA_QUEUE_LEN, sizeof(uint8_t));
+	xTaskCreate(&advanced_ota_example_task, "advanced_ota_example_task", OTA_TASK_STACK, NULL, 5, &task);
+#endif
+	mem_register_task(task, OTA_TASK_STACK);
+	ota_trigger();
 }
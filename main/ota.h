@@ -1,6 +1,7 @@
 #ifndef OTA_H
 #define OTA_H
 
-void ota_init(const char *url);
+void ota_init(const char *device_id);
+void ota_trigger(void);
 
 #endif /* OTA_H */
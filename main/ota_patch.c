@@ -0,0 +1,254 @@
+#include "ota_patch.h"
+
+#include <string.h>
+
+enum {
+	S_TOKEN,
+	S_LEN,
+	S_ARG,
+	S_LITERAL,
+};
+
+static uint32_t get_le32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+enum ota_patch_format ota_patch_detect(const uint8_t *data, size_t len)
+{
+	if (len >= 1 && data[0] == OTA_PATCH_RAW_MAGIC) {
+		return OTA_FORMAT_RAW;
+	}
+	if (len >= 4 && memcmp(data, OTA_PATCH_MAGIC, 4) == 0) {
+		return OTA_FORMAT_PATCH;
+	}
+	return OTA_FORMAT_UNKNOWN;
+}
+
+int ota_patch_parse_header(struct ota_patch_header *h, const uint8_t *data, size_t len)
+{
+	if (len < OTA_PATCH_HEADER_SIZE || memcmp(data, OTA_PATCH_MAGIC, 4) != 0) {
+		return -1;
+	}
+
+	h->flags = data[4];
+	h->image_size = get_le32(data + 8);
+	h->old_size = get_le32(data + 12);
+	memcpy(h->old_sha256, data + 16, sizeof(h->old_sha256));
+
+	return OTA_PATCH_HEADER_SIZE;
+}
+
+void ota_patch_write_header(uint8_t *data, const struct ota_patch_header *h)
+{
+	memset(data, 0, OTA_PATCH_HEADER_SIZE);
+	memcpy(data, OTA_PATCH_MAGIC, 4);
+	data[4] = h->flags;
+	put_le32(data + 8, h->image_size);
+	put_le32(data + 12, h->old_size);
+	memcpy(data + 16, h->old_sha256, sizeof(h->old_sha256));
+}
+
+/*
+ * @brief Start (or resume) decoding
+ *
+ * When resuming, out must be a block boundary recorded after a feed that
+ * set block_done, together with the old_pos from that moment.
+ */
+void ota_patch_init(struct ota_patch *p, const struct ota_patch_io *io, enum ota_patch_format format,
+                    uint32_t image_size, uint32_t out, uint32_t old_pos)
+{
+	memset(p, 0, sizeof(*p) - sizeof(p->block));
+	p->io = io;
+	p->format = format;
+	p->image_size = image_size;
+	p->out = out;
+	p->old_pos = old_pos;
+	p->state = S_TOKEN;
+}
+
+static uint32_t block_start(const struct ota_patch *p)
+{
+	return p->out & ~(OTA_PATCH_BLOCK - 1);
+}
+
+/*
+ * @brief Account for n decoded bytes and write the block out if complete
+ */
+static int advance(struct ota_patch *p, uint32_t n)
+{
+	uint32_t start = block_start(p);
+
+	p->out += n;
+	if (p->out % OTA_PATCH_BLOCK != 0 && p->out != p->image_size) {
+		return 0;
+	}
+	if (p->io->write_block(p->io->priv, start, p->block, p->out - start) < 0) {
+		return -1;
+	}
+	p->block_done = true;
+	return 0;
+}
+
+static int copy_new(struct ota_patch *p)
+{
+	uint32_t start = block_start(p);
+	uint32_t pos = p->out - start;
+	uint32_t src = p->out - p->arg;
+	uint32_t n = p->len;
+
+	if (p->arg == 0 || p->arg > p->out) {
+		return -1;
+	}
+
+	/* Part of the source that is already on flash */
+	if (src < start) {
+		uint32_t chunk = start - src < n ? start - src : n;
+		if (p->io->read_new(p->io->priv, src, p->block + pos, chunk) < 0) {
+			return -1;
+		}
+		src += chunk;
+		pos += chunk;
+		n -= chunk;
+	}
+
+	/* The rest is in this block and may overlap the destination */
+	for (uint32_t i = 0; i < n; i++) {
+		p->block[pos + i] = p->block[src - start + i];
+	}
+
+	return advance(p, p->len);
+}
+
+static int copy_old(struct ota_patch *p)
+{
+	int32_t delta = (p->arg >> 1) ^ -(int32_t)(p->arg & 1);
+	int64_t src = (int64_t)p->old_pos + delta;
+
+	if (src < 0 || src > UINT32_MAX - p->len) {
+		return -1;
+	}
+	if (p->io->read_old(p->io->priv, src, p->block + (p->out - block_start(p)), p->len) < 0) {
+		return -1;
+	}
+	p->old_pos = src + p->len;
+
+	return advance(p, p->len);
+}
+
+static int feed_raw(struct ota_patch *p, const uint8_t *data, size_t len)
+{
+	uint32_t pos = p->out - block_start(p);
+	uint32_t n = OTA_PATCH_BLOCK - pos;
+
+	if (n > p->image_size - p->out) {
+		n = p->image_size - p->out;
+	}
+	if (n > len) {
+		n = len;
+	}
+	memcpy(p->block + pos, data, n);
+
+	return advance(p, n) < 0 ? -1 : n;
+}
+
+/*
+ * @brief Decode a chunk of input
+ *
+ * Returns the number of bytes consumed, or -1 if the input is corrupt or
+ * an I/O callback failed. Stops right after writing a block, with
+ * block_done set, so that the caller can record a resume point.
+ */
+int ota_patch_feed(struct ota_patch *p, const uint8_t *data, size_t len)
+{
+	size_t i = 0;
+
+	p->block_done = false;
+
+	if (p->out >= p->image_size) {
+		return len;
+	}
+	if (p->format == OTA_FORMAT_RAW) {
+		return feed_raw(p, data, len);
+	}
+
+	while (i < len && !p->block_done) {
+		uint8_t b = data[i];
+
+		switch (p->state) {
+		case S_TOKEN:
+			i++;
+			p->op = b >> 6;
+			p->len = (b & 0x3F) + 1;
+			p->arg = 0;
+			p->shift = 0;
+			if (p->op > OP_COPY_OLD) {
+				return -1;
+			}
+			if (p->len == 64) {
+				p->state = S_LEN;
+				break;
+			}
+			goto check_len;
+		case S_LEN:
+			i++;
+			if (p->shift > 28) {
+				return -1;
+			}
+			p->arg |= (uint32_t)(b & 0x7F) << p->shift;
+			p->shift += 7;
+			if (b & 0x80) {
+				break;
+			}
+			p->len += p->arg;
+			p->arg = 0;
+			p->shift = 0;
+check_len:
+			if (p->len > OTA_PATCH_BLOCK - (p->out - block_start(p)) ||
+			    p->len > p->image_size - p->out) {
+				return -1;
+			}
+			p->state = p->op == OP_LITERAL ? S_LITERAL : S_ARG;
+			break;
+		case S_ARG:
+			i++;
+			if (p->shift > 28) {
+				return -1;
+			}
+			p->arg |= (uint32_t)(b & 0x7F) << p->shift;
+			p->shift += 7;
+			if (b & 0x80) {
+				break;
+			}
+			p->state = S_TOKEN;
+			if ((p->op == OP_COPY_NEW ? copy_new(p) : copy_old(p)) < 0) {
+				return -1;
+			}
+			break;
+		case S_LITERAL: {
+			uint32_t n = len - i < p->len ? len - i : p->len;
+
+			memcpy(p->block + (p->out - block_start(p)), data + i, n);
+			i += n;
+			p->len -= n;
+			if (p->len == 0) {
+				p->state = S_TOKEN;
+			}
+			if (advance(p, n) < 0) {
+				return -1;
+			}
+			break;
+		}
+		}
+	}
+
+	return i;
+}
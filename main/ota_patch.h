@@ -0,0 +1,89 @@
+#ifndef OTA_PATCH_H
+#define OTA_PATCH_H
+
+/* Streaming decoder for compressed and delta OTA images
+
+   An encoded image starts with struct ota_patch_header and is followed by
+   a stream of ops, each a token byte and optional varints:
+
+     LITERAL   n bytes follow in the stream
+     COPY_NEW  copy n bytes from <distance> bytes back in the new image
+     COPY_OLD  copy n bytes from the running image, at the end of the
+               previous COPY_OLD plus a signed (zigzag) adjustment
+
+   The token holds the op type in its top two bits and n - 1 in the low
+   six, with 63 meaning "add a varint". Ops never cross a block boundary,
+   so the whole decoder state at a boundary is (input offset, output
+   offset, old_pos). That is what makes a download resumable.
+
+   Plain application images (starting with ESP_IMAGE_HEADER_MAGIC) go
+   through the same decoder as one long literal.
+
+   No ESP-IDF dependencies; the host patch tool uses the same code.
+*/
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define OTA_PATCH_MAGIC        "PAT1"
+#define OTA_PATCH_HEADER_SIZE  48
+#define OTA_PATCH_BLOCK        4096  /*!< Output block, one flash sector */
+#define OTA_PATCH_FLAG_DELTA   0x01
+#define OTA_PATCH_RAW_MAGIC    0xE9  /*!< First byte of a plain image */
+
+enum ota_patch_op {
+	OP_LITERAL  = 0,
+	OP_COPY_NEW = 1,
+	OP_COPY_OLD = 2,
+};
+
+enum ota_patch_format {
+	OTA_FORMAT_UNKNOWN = 0,
+	OTA_FORMAT_RAW,
+	OTA_FORMAT_PATCH,
+};
+
+struct ota_patch_header {
+	uint8_t flags;
+	uint32_t image_size;        /*!< Size of the decoded image */
+	uint32_t old_size;          /*!< Bytes of the running image referenced */
+	uint8_t old_sha256[32];     /*!< app_elf_sha256 of the image the delta applies to */
+};
+
+struct ota_patch_io {
+	/* Read from the running image, for COPY_OLD */
+	int (*read_old)(void *priv, uint32_t offset, void *buf, size_t len);
+	/* Read back output that has already been written */
+	int (*read_new)(void *priv, uint32_t offset, void *buf, size_t len);
+	/* Store one block of output; offset is block aligned */
+	int (*write_block)(void *priv, uint32_t offset, const void *buf, size_t len);
+	void *priv;
+};
+
+struct ota_patch {
+	const struct ota_patch_io *io;
+	enum ota_patch_format format;
+	uint32_t image_size;
+	uint32_t out;           /*!< Output bytes decoded so far */
+	uint32_t old_pos;
+	bool block_done;        /*!< Last feed ended exactly after a block was written */
+
+	/* Op currently being decoded */
+	int state;
+	enum ota_patch_op op;
+	uint32_t len;
+	uint32_t arg;
+	int shift;
+
+	uint8_t block[OTA_PATCH_BLOCK];
+};
+
+enum ota_patch_format ota_patch_detect(const uint8_t *data, size_t len);
+int ota_patch_parse_header(struct ota_patch_header *h, const uint8_t *data, size_t len);
+void ota_patch_write_header(uint8_t *data, const struct ota_patch_header *h);
+void ota_patch_init(struct ota_patch *p, const struct ota_patch_io *io, enum ota_patch_format format,
+                    uint32_t image_size, uint32_t out, uint32_t old_pos);
+int ota_patch_feed(struct ota_patch *p, const uint8_t *data, size_t len);
+
+#endif /* OTA_PATCH_H */
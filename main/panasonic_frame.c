@@ -1,4 +1,5 @@
 #include "panasonic_frame.h"
+#include "panasonic_pulse.h"
 #include "esp_log.h"
 #include <string.h>
 #include <assert.h>
@@ -7,6 +8,86 @@ static const char TAG[] = "PANA";
 
 static const uint8_t header[] = { 0x02, 0x20, 0xE0, 0x04 };
 
+/* A state frame with every field 0; the bits set are fixed */
+static const uint8_t state_template[19] = {
+	0x02, 0x20, 0xE0, 0x04, 0x00, 0x08, 0x00, 0x80, 0x00, 0x00,
+	0x00, 0x08, 0x80, 0x00, 0x00, 0x80, 0x00, 0x00, 0x00,
+};
+
+/*
+ * Layout of a state frame. A field is width bits from bit shift of byte
+ * offset on, little endian, and spans two bytes at most. valid has bit v
+ * set for each value v the field may take; 0 allows any.
+ */
+struct frame_field {
+	const char *name;
+	uint8_t offset;
+	uint8_t shift;
+	uint8_t width;
+	uint32_t valid;
+};
+
+enum {
+	FIELD_ON,
+	FIELD_ON_TIMER,
+	FIELD_OFF_TIMER,
+	FIELD_MODE,
+	FIELD_TEMP,
+	FIELD_SWING,
+	FIELD_FAN,
+	FIELD_ON_TIME,
+	FIELD_OFF_TIME,
+	FIELD_NO_TIME,
+	FIELD_TIME,
+	FIELD_COUNT,
+};
+
+#define V(x) (1u << (x))
+
+static const struct frame_field fields[FIELD_COUNT] = {
+	[FIELD_ON]        = { "power",       5, 0, 1 },
+	[FIELD_ON_TIMER]  = { "on timer",    5, 1, 1 },
+	[FIELD_OFF_TIMER] = { "off timer",   5, 2, 1 },
+	[FIELD_MODE]      = { "mode",        5, 4, 4,
+	                      V(MODE_AUTO) | V(MODE_DRY) | V(MODE_COOL) | V(MODE_HEAT) | V(MODE_FAN) },
+	[FIELD_TEMP]      = { "temperature", 6, 1, 5 },
+	[FIELD_SWING]     = { "swing mode",  8, 0, 4,
+	                      V(SWING_1) | V(SWING_2) | V(SWING_3) | V(SWING_4) | V(SWING_5) | V(SWING_AUTO) },
+	[FIELD_FAN]       = { "fan mode",    8, 4, 4,
+	                      V(FAN_1) | V(FAN_2) | V(FAN_3) | V(FAN_4) | V(FAN_5) | V(FAN_AUTO) },
+	[FIELD_ON_TIME]   = { "on time",    10, 0, 11 },
+	[FIELD_OFF_TIME]  = { "off time",   11, 4, 11 },
+	[FIELD_NO_TIME]   = { "no time",    15, 0, 1 },
+	[FIELD_TIME]      = { "time",       16, 0, 16 },
+};
+
+/* Unrolled, every table lookup folds into a constant shift and mask */
+#define FIELDS_UNROLL _Pragma("GCC unroll 16")
+
+static inline uint32_t field_get(const uint8_t *data, const struct frame_field *f)
+{
+	uint32_t v = data[f->offset];
+
+	if (f->shift + f->width > 8) {
+		v |= data[f->offset + 1] << 8;
+	}
+	return v >> f->shift & ((1u << f->width) - 1);
+}
+
+static inline bool field_valid(const struct frame_field *f, uint32_t v)
+{
+	return v >> f->width == 0 && (f->valid == 0 || (f->valid >> v & 1) != 0);
+}
+
+static inline void field_put(uint8_t *data, const struct frame_field *f, uint32_t v)
+{
+	v = (v & ((1u << f->width) - 1)) << f->shift;
+	data[f->offset] |= v;
+	if (f->shift + f->width > 8) {
+		data[f->offset + 1] |= v >> 8;
+	}
+}
+
 static uint8_t sum(const uint8_t *data, int len)
 {
 	uint8_t sum = 0;
@@ -16,20 +97,26 @@ static uint8_t sum(const uint8_t *data, int len)
 	return sum;
 }
 
-int panasonic_parse_frame(struct panasonic_command *cmd, const uint8_t *data, int len)
+/* Candidates tried for a correction are parsed without the warnings */
+#define FRAME_WARN(...) do { if (!quiet) ESP_LOGW(TAG, __VA_ARGS__); } while (0)
+
+static int frame_parse(struct panasonic_command *cmd, const uint8_t *data, int len, bool quiet)
 {
+	uint32_t v[FIELD_COUNT];
+	uint32_t bad = 0;
+
 	if (len != 19 && len != 8) {
-		ESP_LOGW(TAG, "Invalid length %d", len);
+		FRAME_WARN("Invalid length %d", len);
 		return -1;
 	}
 
 	if (sum(data, len - 1) != data[len - 1]) {
-		ESP_LOGW(TAG, "Invalid checksum");
+		FRAME_WARN("Invalid checksum");
 		return -1;
 	}
 
 	if (memcmp(data, header, sizeof(header)) !=0) {
-		ESP_LOGW(TAG, "Invalid header");
+		FRAME_WARN("Invalid header");
 		return -1;
 	}
 
@@ -55,66 +142,86 @@ int panasonic_parse_frame(struct panasonic_command *cmd, const uint8_t *data, in
 	case CMD_AC_RESET:
 		return 1;
 	default:
-		ESP_LOGW(TAG, "Invalid command %d", cmd->cmd);
+		FRAME_WARN("Invalid command %d", cmd->cmd);
 		return -1;
 	}
 
 	assert(len == 19);
 
-	cmd->mode = data[5] >> 4;
+	/* One branch for all fields; which one failed only matters for the warning */
+	FIELDS_UNROLL
+	for (int i = 0; i < FIELD_COUNT; i++) {
+		v[i] = field_get(data, &fields[i]);
+		bad |= !field_valid(&fields[i], v[i]) << i;
+	}
+	if (bad != 0) {
+		int i = __builtin_ctz(bad);
 
-	switch (cmd->mode) {
-	case MODE_AUTO:
-	case MODE_COOL:
-	case MODE_DRY:
-	case MODE_FAN:
-	case MODE_HEAT:
-		break;
-	default:
-		ESP_LOGW(TAG, "Invalid mode %d", cmd->mode);
+		FRAME_WARN("Invalid %s %u", fields[i].name, field_get(data, &fields[i]));
 		return -1;
 	}
 
-	cmd->off_timer = (data[5] & 4) != 0;
-	cmd->on_timer  = (data[5] & 2) != 0;
-	cmd->on        = (data[5] & 1) != 0;
+	*cmd = (struct panasonic_command){
+		.cmd       = CMD_STATE,
+		.on        = v[FIELD_ON],
+		.on_timer  = v[FIELD_ON_TIMER],
+		.off_timer = v[FIELD_OFF_TIMER],
+		.mode      = v[FIELD_MODE],
+		.temp      = v[FIELD_TEMP],
+		.swing     = v[FIELD_SWING],
+		.fan       = v[FIELD_FAN],
+		.on_time   = v[FIELD_ON_TIME],
+		.off_time  = v[FIELD_OFF_TIME],
+		.no_time   = v[FIELD_NO_TIME],
+		.time      = v[FIELD_TIME],
+	};
 
-	cmd->temp = (data[6] >> 1) & 0x1F;
+	return 1;
+}
 
-	cmd->swing = data[8] & 0x0F;
-	cmd->fan = data[8] >> 4;
+int panasonic_parse_frame(struct panasonic_command *cmd, const uint8_t *data, int len)
+{
+	return frame_parse(cmd, data, len, false);
+}
 
-	switch (cmd->swing) {
-	case SWING_AUTO:
-	case SWING_1:
-	case SWING_2:
-	case SWING_3:
-	case SWING_4:
-	case SWING_5:
-		break;
-	default:
-		ESP_LOGW(TAG, "Invalid swing mode %d", cmd->swing);
-		return -1;
-	}
+/*
+ * @brief Parse the frame in a pulse parser, correcting one bit if need be
+ *
+ * On a checksum mismatch the bits the parser was least sure of are
+ * flipped in turn, weakest first, and the first candidate that passes
+ * the checksum, header and field checks is taken. The buffer is left
+ * corrected. An 8-bit sum cannot tell a flip from another flip of the
+ * same weight, hence only bits close to the threshold are tried.
+ *
+ * Returns as panasonic_parse_frame(), with *corrected set if a bit was
+ * flipped.
+ */
+int panasonic_parse_received(struct panasonic_command *cmd, struct panasonic_parser *p, int len, bool *corrected)
+{
+	uint8_t *data = p->buf;
 
-	switch (cmd->fan) {
-	case FAN_AUTO:
-	case FAN_1:
-	case FAN_2:
-	case FAN_3:
-	case FAN_4:
-	case FAN_5:
-		break;
-	default:
-		ESP_LOGW(TAG, "Invalid fan mode %d", cmd->fan);
-		return -1;
-	}
+	*corrected = false;
+	if ((len == 19 || len == 8) && sum(data, len - 1) != data[len - 1]) {
+		for (int i = 0; i < p->weak_count; i++) {
+			int bit = p->weak[i].bit;
 
-	/* TODO: Support time settings. */
+			if (bit >= len * 8) {
+				continue;
+			}
+			data[bit / 8] ^= 1 << bit % 8;
+			if (frame_parse(cmd, data, len, true) > 0) {
+				ESP_LOGI(TAG, "Corrected bit %d, %u us from the threshold", bit, p->weak[i].margin);
+				*corrected = true;
+				return 1;
+			}
+			data[bit / 8] ^= 1 << bit % 8;
+		}
+	}
 
-	return 1;
+	return frame_parse(cmd, data, len, false);
 }
 
+
 int panasonic_build_frame(const struct panasonic_command *cmd, uint8_t *data, size_t size)
 {
 	if (cmd == NULL || (cmd->cmd == CMD_STATE && size < 19) || size < 8) {
@@ -133,24 +240,37 @@ int panasonic_build_frame(const struct panasonic_command *cmd, uint8_t *data, si
 	}
 
 	bool no_time = cmd->time == 0 || cmd->no_time;
-	uint16_t off_time = no_time ? 0x600 : cmd->off_time;
-	uint16_t on_time  = no_time ? 0x600 : cmd->on_time;
-	uint16_t time     = no_time ? 0 : cmd->time;
-
-	data[4] = 0x00;
-	data[5] = (cmd->mode << 4) | (1 << 3) | (cmd->off_timer << 2) | (cmd->on_timer << 1) | cmd->on;
-	data[6] = cmd->temp << 1;
-	data[7] = 0x80;
-	data[8] = (cmd->fan << 4) | cmd->swing;
-	data[9] = 0x00;
-	data[10] = on_time;
-	data[11] = ((off_time & 0x03) << 4) | (1 << 3) | (on_time >> 8);
-	data[12] = (1 << 7) | (off_time >> 4);
-	data[13] = 0x00;
-	data[14] = 0x00;
-	data[15] = 0x80 | no_time;
-	data[16] = time;
-	data[17] = time >> 8;
+	uint32_t v[FIELD_COUNT] = {
+		[FIELD_ON]        = cmd->on,
+		[FIELD_ON_TIMER]  = cmd->on_timer,
+		[FIELD_OFF_TIMER] = cmd->off_timer,
+		[FIELD_MODE]      = cmd->mode,
+		[FIELD_TEMP]      = cmd->temp,
+		[FIELD_SWING]     = cmd->swing,
+		[FIELD_FAN]       = cmd->fan,
+		[FIELD_ON_TIME]   = no_time ? 0x600 : cmd->on_time,
+		[FIELD_OFF_TIME]  = no_time ? 0x600 : cmd->off_time,
+		[FIELD_NO_TIME]   = no_time,
+		[FIELD_TIME]      = no_time ? 0 : cmd->time,
+	};
+	uint32_t bad = 0;
+
+	FIELDS_UNROLL
+	for (int i = 0; i < FIELD_COUNT; i++) {
+		bad |= !field_valid(&fields[i], v[i]) << i;
+	}
+	if (bad != 0) {
+		int i = __builtin_ctz(bad);
+
+		ESP_LOGW(TAG, "Cannot send %s %u", fields[i].name, v[i]);
+		return -1;
+	}
+
+	memcpy(data, state_template, sizeof(state_template));
+	FIELDS_UNROLL
+	for (int i = 0; i < FIELD_COUNT; i++) {
+		field_put(data, &fields[i], v[i]);
+	}
 	data[18] = sum(data, 18);
 
 	return 19;
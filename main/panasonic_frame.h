@@ -51,7 +51,10 @@ struct panasonic_command {
 	bool no_time :1;
 };
 
+struct panasonic_parser;
+
 int panasonic_parse_frame(struct panasonic_command *cmd, const uint8_t *data, int len);
+int panasonic_parse_received(struct panasonic_command *cmd, struct panasonic_parser *p, int len, bool *corrected);
 int panasonic_build_frame(const struct panasonic_command *cmd, uint8_t *data, size_t size);
 
 #endif /* PANASONIC_FRAME_H */
@@ -6,19 +6,29 @@
    software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
    CONDITIONS OF ANY KIND, either express or implied.
 */
+#include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/queue.h"
 #include "freertos/semphr.h"
+#include "esp_attr.h"
 #include "esp_err.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "nvs.h"
 #include "driver/rmt.h"
 #include "driver/periph_ctrl.h"
 #include "soc/rmt_reg.h"
 #include "mqtt.h"
+#include "mqtt_topics.h"
+#include "ir_code.h"
+#include "ir_histogram.h"
+#include "mem_budget.h"
 #include "panasonic_frame.h"
+#include "panasonic_ir.h"
+#include "panasonic_pulse.h"
 #include "panasonic_state.h"
 
 static const char TAG[] = "IR";
@@ -37,30 +47,62 @@ static const char TAG[] = "IR";
 #define RMT_TX_GPIO_NUM  13     /*!< GPIO number for transmitter signal */
 #define RMT_RX_CHANNEL    0     /*!< RMT channel for receiver */
 #define RMT_RX_GPIO_NUM  14     /*!< GPIO number for receiver */
+#define RMT_RX2_CHANNEL   5     /*!< RMT channel for the second receiver, CONFIG_IR_RX2 */
 #define RMT_CLK_DIV      80    /*!< RMT counter clock divider for µs ticks */
 
-#define HEADER_MARK_US    3543          /*!< Panasonic protocol header */
-#define HEADER_SPACE_US   1700          /*!< Panasonic protocol header */
-#define MARK_US            400          /*!< Panasonic protocol mark */
-#define BIT_ONE_SPACE_US  1340          /*!< Panasonic protocol space bit 1 */
-#define BIT_ZERO_SPACE_US  470          /*!< Panasonic protocol space bit 0 */
-#define IDLE_US          10400          /*!< Panasonic protocol interframe spacing */
-#define BIT_MARGIN         150          /*!< Panasonic parse margin time */
-
 #define ITEM_DURATION(d)  (d & 0x7fff)  /*!< Parse duration time from memory register value */
 #define RMT_ITEM32_TIMEOUT_US  4000   /*!< RMT receiver timeout value(us) */
 
-enum pana_item {
-	PANA_INVALID = -1,
-	PANA_BIT_0,
-	PANA_BIT_1,
-	PANA_HEADER,
-	PANA_END
+#define TX_ITEMS_MAX  (PANASONIC_PULSES_MAX * PANASONIC_COMMANDS_MAX + 1)
+
+#define IR_NVS_NAMESPACE     "ircodes"
+#define IR_LEARN_MIN_PULSES  4          /*!< Shorter bursts are taken for noise */
+
+/* Frames the same as the last one within this long are the other
+   receiver's copy. Less than a command takes on air, so a remote that
+   repeats a command is never taken for a duplicate. */
+#define RX_DUP_WINDOW_US     200000
+
+/* A receiver, with its own task and parser. Channel 0 takes RMT
+   memory blocks 0-3, the transmitter block 4 and a second receiver 5-7,
+   enough for a data frame: the header frame ends in an idle gap longer
+   than RMT_ITEM32_TIMEOUT_US and arrives on its own. */
+struct ir_receiver {
+	int channel;
+	int gpio_num;
+	int mem_blocks;
+	const char *task_name;
+	struct panasonic_rx_stats stats;        /*!< Written by its task only */
+};
+
+static struct ir_receiver receivers[IR_RX_TASKS] = {
+	{ RMT_RX_CHANNEL, RMT_RX_GPIO_NUM, 4, "rmt_rx_task" },
+#if CONFIG_IR_RX2
+	{ RMT_RX2_CHANNEL, CONFIG_IR_RX2_GPIO, 3, "rmt_rx2_task" },
+#endif
 };
 
-static const uint8_t header[] = {0x02, 0x20, 0xE0, 0x04, 0x00, 0x00, 0x00, 0x06};
+/* The last frame passed on, for dropping the other receiver's copy */
+static portMUX_TYPE rx_last_mux = portMUX_INITIALIZER_UNLOCKED;
+static struct {
+	uint8_t data[PANASONIC_FRAME_MAXLEN];
+	int len;
+	int64_t time;
+} rx_last;
+
 static void (*receive_cb)(const struct panasonic_command *cmd, void *priv);
 static void *receive_priv;
+/* The transmit channel, shared by AC frames and learned codes */
+static SemaphoreHandle_t tx_lock;
+static struct panasonic_tx_stats tx_stats;      /*!< Written under tx_lock */
+#if CONFIG_IR_HISTOGRAM
+static struct ir_histogram histogram;
+#endif
+#if CONFIG_IR_LEARN
+static char learn_name[NVS_KEY_NAME_MAX_SIZE];
+static bool learning;
+static struct ir_code play_code;        /*!< Being sent, under tx_lock */
+#endif
 /*
  * @brief Build register value of waveform for one item
  */
@@ -72,38 +114,6 @@ static inline void fill_item_level(rmt_item32_t* item, int mark_us, int space_us
 	item->duration1 = mark_us;
 }
 
-/*
- * @brief Generate 1st header item; interframe spacing, followed by long mark
- */
-static void fill_item_header1(rmt_item32_t* item)
-{
-	fill_item_level(item, HEADER_MARK_US, IDLE_US);
-}
-
-/*
- * @brief Generate 2nd header item; like a normal bit but 4 units of space
- */
-static void fill_item_header2(rmt_item32_t* item)
-{
-	fill_item_level(item, MARK_US, HEADER_SPACE_US);
-}
-
-/*
- * @brief Generate data bit 1: 3 units of space before a mark
- */
-static void fill_item_bit_one(rmt_item32_t* item)
-{
-	fill_item_level(item, MARK_US, BIT_ONE_SPACE_US);
-}
-
-/*
- * @brief Generate data bit 0: 1 unit of space before a mark
- */
-static void fill_item_bit_zero(rmt_item32_t* item)
-{
-	fill_item_level(item, MARK_US, BIT_ZERO_SPACE_US);
-}
-
 /*
  * @brief Generate end item
  */
@@ -126,186 +136,313 @@ static uint16_t space_ticks(const rmt_item32_t *item)
 }
 
 /*
- * @brief Check whether duration is around target
-inline bool in_range(int duration, int target, int margin)
-{
-	return duration < target + margin && duration > target - margin;
-}
- */
-
-/*
- * @brief Decode an item into the corresponding symbol
+ * @brief Send frames back to back, blocking until done
+ *
+ * Consecutive frames are separated by IDLE_US only. Only called with the
+ * state mutex held, so one item buffer is enough. Returns 0 once
+ * rmt_wait_tx_done() has returned, or -1 if nothing was sent.
  */
-static enum pana_item decode_item(const rmt_item32_t* item)
+int panasonic_transmit_list(const struct panasonic_command *cmds, int count)
 {
-	uint16_t mark = mark_ticks(item);
-	uint16_t space = space_ticks(item);
+	static struct panasonic_pulse pulses[PANASONIC_PULSES_MAX];
+	static rmt_item32_t item[TX_ITEMS_MAX];
+	uint16_t space = IDLE_US;
+	int64_t start, sent;
+	int err = -1;
+	int n = 0;
 
-	if (space == 0) {
-		return PANA_END;
+	if (count > PANASONIC_COMMANDS_MAX) {
+		ESP_LOGE(TAG, "Too many commands");
+		return -1;
 	}
 
-	if ((mark > 2700 && space < mark) || (space > 1600 && mark < space)) {
-	/*if (in_range(space, HEADER_SPACE_US, BIT_MARGIN)
-	 || in_range(mark, HEADER_MARK_US, BIT_MARGIN)) {*/
-		return PANA_HEADER;
-	}
+	xSemaphoreTake(tx_lock, portMAX_DELAY);
+	start = esp_timer_get_time();
+
+	for (int c = 0; c < count; c++) {
+		uint8_t data[PANASONIC_FRAME_MAXLEN];
+		char s[sizeof(data) * 3 + 1];
+		size_t len = 0;
+		int ret, np;
+
+		ret = panasonic_build_frame(&cmds[c], data, sizeof(data));
+		if (ret < 0) {
+			goto out;
+		}
 
-	if (mark < MARK_US - BIT_MARGIN || mark > MARK_US + BIT_MARGIN) {
-		return PANA_INVALID;
+		for (int i = 0; i < ret; i++) {
+			len += snprintf(s + len, sizeof(s) - len, "%02x ", data[i]);
+		}
+		ESP_LOGI(TAG, "XMT %s", s);
+
+		np = panasonic_pulse_encode(pulses, PANASONIC_PULSES_MAX, data, ret);
+		if (np < 0) {
+			ESP_LOGE(TAG, "Frame too long");
+			goto out;
+		}
+
+		/* RMT items are a space followed by a mark, starting with the idle gap */
+		for (int i = 0; i < np; i++) {
+			fill_item_level(&item[n++], pulses[i].mark, space == 0 ? IDLE_US : space);
+			space = pulses[i].space;
+		}
 	}
+	fill_item_end(&item[n++]);
 
-	if (space < mark * 2) {
-		return PANA_BIT_0;
-	} else {
-		return PANA_BIT_1;
+	sent = esp_timer_get_time();
+	if (rmt_write_items(RMT_TX_CHANNEL, item, n, true) == ESP_OK) {
+		err = 0;
 	}
+	//rmt_fill_tx_items(RMT_TX_CHANNEL, item, n, 0);
+	//rmt_tx_start(RMT_TX_CHANNEL, true);
+	rmt_wait_tx_done(RMT_TX_CHANNEL, portMAX_DELAY);
+	//rmt_tx_stop(RMT_TX_CHANNEL);
+
+	__atomic_store_n(&tx_stats.frames, tx_stats.frames + count, __ATOMIC_RELAXED);
+	__atomic_store_n(&tx_stats.build_us, tx_stats.build_us + (uint32_t)(sent - start), __ATOMIC_RELAXED);
+	__atomic_store_n(&tx_stats.air_us, tx_stats.air_us + (uint32_t)(esp_timer_get_time() - sent),
+	                 __ATOMIC_RELAXED);
+out:
+	xSemaphoreGive(tx_lock);
+	return err;
 }
 
-struct panasonic_parser {
-	uint8_t data;
-	uint8_t *buf;
-	size_t bufsize;
-	int bitcount;
-	size_t bytecount;
-	bool in_frame;
-};
+int panasonic_transmit(const struct panasonic_command *cmd)
+{
+	return panasonic_transmit_list(cmd, 1);
+}
 
 /*
- * @brief Parse Panasonic data array.
+ * @brief Read the transmit totals, for task_stats.c
+ *
+ * Each counter is read atomically, though not all three together.
  */
-static int panasonic_parse_items(struct panasonic_parser *p, const rmt_item32_t* i)
+void panasonic_ir_tx_stats(struct panasonic_tx_stats *stats)
 {
-	//ESP_LOGI(TAG, "RMT RCV %5u %u %5u %u", i->duration0, i->level0, i->duration1, i->level1);
-
-	enum pana_item pi = decode_item(i);
-
-	if (pi == PANA_HEADER) {
-		//ESP_LOGI(TAG, "RMT RCV START %5u %u %5u %u", i->duration0, i->level0, i->duration1, i->level1);
-		p->bitcount = 0;
-		p->bytecount = 0;
-		p->in_frame = true;
-		return 0;
-	} else if (pi == PANA_END) {
-		//ESP_LOGI(TAG, "RMT RCV END, %d bytes, %d bits", p->bytecount, p->bitcount);
-		int ret = p->bitcount == 0 ? p->bytecount : -1;
-		p->bitcount = 0;
-		p->bytecount = 0;
-		p->in_frame = false;
-		return ret;
-	} else if (pi == PANA_INVALID) {
-		//ESP_LOGI(TAG, "RMT RCV INV %5u %u %5u %u", i->duration0, i->level0, i->duration1, i->level1);
-		p->in_frame = false;
-		return -1;
-	} else if (p->in_frame) {
-		/* Bit received in frame, shift in data */
-		p->data = (p->data >> 1) | (pi == PANA_BIT_1 ? 1 << 7 : 0);
-
-		if (++p->bitcount == 8) {
-			p->bitcount = 0;
-			if (p->bytecount < p->bufsize) {
-				//ESP_LOGI(TAG, "RMT RCV --- %02x", p->data);
-				p->buf[p->bytecount] = p->data;
-			} else {
-				//ESP_LOGI(TAG, "RMT OVF --- %02x", p->data);
-				p->in_frame = false;
-				return -1;
-			}
-			p->bytecount++;
-		}
-	} else {
-		//ESP_LOGW(TAG, "RMT Not in frame %5u %u %5u %u", i->duration0, i->level0, i->duration1, i->level1);
-	}
+	stats->frames = __atomic_load_n(&tx_stats.frames, __ATOMIC_RELAXED);
+	stats->build_us = __atomic_load_n(&tx_stats.build_us, __ATOMIC_RELAXED);
+	stats->air_us = __atomic_load_n(&tx_stats.air_us, __ATOMIC_RELAXED);
+}
 
-	return 0;
+#if CONFIG_IR_LEARN
+static void ir_status(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+static void ir_status(const char *fmt, ...)
+{
+	char s[100];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(s, sizeof(s), fmt, ap);
+	va_end(ap);
+
+	ESP_LOGI(TAG, "%s", s);
+	mqtt_pub(IR_STATUS_TOPIC, s, len < (int)sizeof(s) ? len : (int)sizeof(s) - 1, 0, 0);
 }
 
-static void panasonic_transmit_frame(const uint8_t *data, int len)
+/*
+ * @brief Record the next burst under the name given, or stop learning
+ * if name is empty
+ */
+void panasonic_ir_learn(const char *name, int len)
 {
-	rmt_item32_t *item = calloc(2 + sizeof(header)*8 + 2 + len * 8 + 1, sizeof(*item));
-	int n = 0;
+	learning = false;
+	if (len <= 0) {
+		return;
+	} else if (len >= (int)sizeof(learn_name)) {
+		ir_status("learn: name longer than %d characters", (int)sizeof(learn_name) - 1);
+		return;
+	}
+	snprintf(learn_name, sizeof(learn_name), "%.*s", len, name);
+	learning = true;
+	ESP_LOGI(TAG, "Learning %s", learn_name);
+}
 
-	if (item == NULL) {
-		ESP_LOGE(TAG, "Not enough heap");
+/*
+ * @brief Compress a received burst and store it in NVS
+ *
+ * Called from the receive task. A burst ends where the receiver has been
+ * idle for RMT_ITEM32_TIMEOUT_US, so codes that repeat a frame after a
+ * longer gap are learned as a single frame.
+ */
+static void learn_receive(const rmt_item32_t *items, size_t n)
+{
+	static struct panasonic_pulse pulses[IR_CODE_PAIRS_MAX];
+	static uint8_t code[IR_CODE_MAXLEN];
+	nvs_handle_t nvs;
+	esp_err_t err;
+	int len;
+
+	/* With two receivers, the first to see the burst records it */
+	if (n < IR_LEARN_MIN_PULSES || !__atomic_exchange_n(&learning, false, __ATOMIC_RELAXED)) {
 		return;
 	}
 
-	fill_item_header1(&item[n++]);
-	fill_item_header2(&item[n++]);
+	if (n > IR_CODE_PAIRS_MAX) {
+		n = IR_CODE_PAIRS_MAX;
+	}
+	for (size_t i = 0; i < n; i++) {
+		pulses[i].mark = mark_ticks(&items[i]);
+		pulses[i].space = space_ticks(&items[i]);
+	}
+	pulses[n - 1].space = 0;
 
-	for (int i = 0; i < sizeof(header); i++) {
-		uint8_t d = header[i];
-		for (int b = 0; b < 8; b++) {
-			if (d & 1) {
-				fill_item_bit_one(&item[n++]);
-			} else {
-				fill_item_bit_zero(&item[n++]);
-			}
-			d >>= 1;
+	len = ir_code_encode(code, sizeof(code), pulses, n);
+	if (len < 0) {
+		ir_status("learn %s: more than %d distinct durations", learn_name, IR_CODE_DURATIONS);
+		return;
+	}
+
+	err = nvs_open(IR_NVS_NAMESPACE, NVS_READWRITE, &nvs);
+	if (err == ESP_OK) {
+		err = nvs_set_blob(nvs, learn_name, code, len);
+		if (err == ESP_OK) {
+			err = nvs_commit(nvs);
 		}
+		nvs_close(nvs);
+	}
+	if (err != ESP_OK) {
+		ir_status("learn %s: %s", learn_name, esp_err_to_name(err));
+		return;
 	}
 
-	fill_item_header1(&item[n++]);
-	fill_item_header2(&item[n++]);
+	/* A blob takes an index entry, a data header and 32 byte entries */
+	ir_status("learned %s: %u pulses in %d bytes, %d bytes of flash",
+	          learn_name, (unsigned int)n, len, 32 * (2 + (len + 31) / 32));
+}
 
-	for (int i = 0; i < len; i++) {
-		uint8_t d = data[i];
-		for (int b = 0; b < 8; b++) {
-			if (d & 1) {
-				fill_item_bit_one(&item[n++]);
-			} else {
-				fill_item_bit_zero(&item[n++]);
-			}
-			d >>= 1;
-		}
+/*
+ * @brief RMT translator: one code byte to one item
+ *
+ * Runs from the RMT interrupt as the driver needs more items, so a code
+ * is never expanded into an item buffer.
+ */
+static void IRAM_ATTR play_translate(const void *src, rmt_item32_t *dest, size_t src_size,
+                                     size_t wanted_num, size_t *translated_size, size_t *item_num)
+{
+	const uint8_t *pairs = src;
+	size_t n = src_size < wanted_num ? src_size : wanted_num;
+
+	for (size_t i = 0; i < n; i++) {
+		dest[i].level0 = RMT_TX_ACTIVE_LEVEL;
+		dest[i].duration0 = ir_code_mark(&play_code, pairs[i]);
+		dest[i].level1 = !RMT_TX_ACTIVE_LEVEL;
+		dest[i].duration1 = ir_code_space(&play_code, pairs[i]);
 	}
+	*translated_size = n;
+	*item_num = n;
+}
 
-	fill_item_end(&item[n++]);
+/*
+ * @brief Send a learned code
+ *
+ * Reports how long it took from the request until the first pulse went
+ * out, and how much of that was reading NVS.
+ */
+int panasonic_ir_play(const char *name, int len)
+{
+	static uint8_t code[IR_CODE_MAXLEN];
+	char key[NVS_KEY_NAME_MAX_SIZE];
+	size_t code_len = sizeof(code);
+	int64_t start = esp_timer_get_time();
+	int64_t loaded, started;
+	nvs_handle_t nvs;
+	esp_err_t err;
+
+	if (len <= 0 || len >= (int)sizeof(key)) {
+		return -1;
+	}
+	snprintf(key, sizeof(key), "%.*s", len, name);
 
-	rmt_write_items(RMT_TX_CHANNEL, item, n, true);
-	//rmt_fill_tx_items(RMT_TX_CHANNEL, item, n, 0);
-	//rmt_tx_start(RMT_TX_CHANNEL, true);
+	xSemaphoreTake(tx_lock, portMAX_DELAY);
+	err = nvs_open(IR_NVS_NAMESPACE, NVS_READONLY, &nvs);
+	if (err == ESP_OK) {
+		err = nvs_get_blob(nvs, key, code, &code_len);
+		nvs_close(nvs);
+	}
+	if (err != ESP_OK || ir_code_parse(&play_code, code, code_len) < 0) {
+		xSemaphoreGive(tx_lock);
+		ir_status("send %s: no such code", key);
+		return -1;
+	}
+	loaded = esp_timer_get_time();
+
+	rmt_write_sample(RMT_TX_CHANNEL, play_code.pairs, play_code.count, false);
+	started = esp_timer_get_time();
 	rmt_wait_tx_done(RMT_TX_CHANNEL, portMAX_DELAY);
-	//rmt_tx_stop(RMT_TX_CHANNEL);
-	free(item);
+	xSemaphoreGive(tx_lock);
 
+	ir_status("sent %s: %u pulses, on air after %d us (%d us loading), %d ms long",
+	          key, (unsigned int)play_code.count, (int)(started - start), (int)(loaded - start),
+	          (int)((esp_timer_get_time() - started) / 1000));
+	return 0;
 }
+#endif /* CONFIG_IR_LEARN */
 
-void panasonic_transmit(const struct panasonic_command *cmd)
+/*
+ * @brief Whether a frame is new rather than a copy from the other receiver
+ *
+ * Both receivers' tasks call this, on either core.
+ */
+static bool rx_first(const uint8_t *data, int len)
 {
-	uint8_t data[19];
-	int ret;
-	char s[sizeof(data) * 3 + 1];
-	size_t len = 0;
-
-	ret = panasonic_build_frame(cmd, data, sizeof(data));
-	if (ret < 0) {
-		return;
+	int64_t now = esp_timer_get_time();
+	bool first;
+
+	portENTER_CRITICAL(&rx_last_mux);
+	first = len != rx_last.len || now - rx_last.time >= RX_DUP_WINDOW_US || memcmp(data, rx_last.data, len) != 0;
+	if (first) {
+		memcpy(rx_last.data, data, len);
+		rx_last.len = len;
+		rx_last.time = now;
 	}
+	portEXIT_CRITICAL(&rx_last_mux);
+	return first;
+}
+
+static void rx_frame(struct ir_receiver *rx, struct panasonic_parser *p, int len)
+{
+	const uint8_t *data = p->buf;
+	struct panasonic_command cmd;
+	char s[PANASONIC_FRAME_MAXLEN * 3 + 1];
+	size_t n = 0;
+	bool corrected;
 
-	for (int i = 0; i < ret; i++) {
-		len += snprintf(s + len, sizeof(s) - len, "%02x ", data[i]);
+	for (int i = 0; i < len; i++) {
+		n += snprintf(s + n, sizeof(s) - n, "%02x ", data[i]);
 	}
-	ESP_LOGI(TAG, "XMT %s", s);
+	ESP_LOGI(TAG, "RCV%d %s", (int)(rx - receivers), s);
 
-	panasonic_transmit_frame(data, ret);
+	if (panasonic_parse_received(&cmd, p, len, &corrected) <= 0) {
+		return;
+	}
+	__atomic_add_fetch(&rx->stats.frames, 1, __ATOMIC_RELAXED);
+	if (corrected) {
+		__atomic_add_fetch(&rx->stats.corrected, 1, __ATOMIC_RELAXED);
+	}
+	if (!rx_first(data, len)) {
+		ESP_LOGD(TAG, "Duplicate dropped");
+		return;
+	}
+	__atomic_add_fetch(&rx->stats.used, 1, __ATOMIC_RELAXED);
+	ESP_LOGI(TAG, "Call receive");
+	receive_cb(&cmd, receive_priv);
 }
 
 /**
- * @brief RMT receiver task.
+ * @brief RMT receiver task, one per receiver
  *
  */
-static void panasonic_rx_task()
+static void panasonic_rx_task(void *arg)
 {
-	int channel = RMT_RX_CHANNEL;
+	struct ir_receiver *rx = arg;
 	RingbufHandle_t rb = NULL;
 	//get RMT RX ringbuffer
-	rmt_get_ringbuf_handle(channel, &rb);
-	rmt_rx_start(channel, true);
+	rmt_get_ringbuf_handle(rx->channel, &rb);
+	rmt_rx_start(rx->channel, true);
 
-	uint8_t data[19];
-	struct panasonic_parser p = { .buf = data, .bufsize = sizeof(data) };
-	struct panasonic_command cmd;
+	struct panasonic_parser p = { 0 };
 
 	while(1) {
 		size_t rx_size = 0;
@@ -315,25 +452,28 @@ static void panasonic_rx_task()
 		const rmt_item32_t* item = (const rmt_item32_t*) xRingbufferReceive(rb, &rx_size, 1000);
 		if (item) {
 			int ret = 0;
+#if CONFIG_IR_LEARN
+			if (learning) {
+				learn_receive(item, rx_size / sizeof(*item));
+			}
+#endif
 			for (const rmt_item32_t* i = item; rx_size >= sizeof(*i); i++, rx_size -= 4) {
+				uint16_t mark = mark_ticks(i);
+				uint16_t space = space_ticks(i);
+
 				//parse data value from ringbuffer.
-				ret = panasonic_parse_items(&p, i);
-
-				if (ret > 0 && ret <= sizeof(data)) {
-					char s[sizeof(data) * 3 + 1];
-					size_t len = 0;
-
-					for (int i = 0; i < ret; i++) {
-						len += snprintf(s + len, sizeof(s) - len, "%02x ", data[i]);
-					}
-					ESP_LOGI(TAG, "RCV %s", s);
-
-					ret = panasonic_parse_frame(&cmd, data, ret);
-					if (ret > 0) {
-						ESP_LOGI(TAG, "Call receive");
-						receive_cb(&cmd, receive_priv);
-					}
+				ret = panasonic_pulse_parse(&p, mark, space);
+#if CONFIG_IR_HISTOGRAM
+				/* Not shared, so that the receivers need no lock for it */
+				if (rx == &receivers[0]) {
+					ir_histogram_add(&histogram, p.item, mark, space);
+				}
+#endif
+
+				if (ret > 0) {
+					rx_frame(rx, &p, ret);
 				} else if (ret < 0) {
+					__atomic_add_fetch(&rx->stats.errors, 1, __ATOMIC_RELAXED);
 					ESP_LOGE(TAG, "Error");
 				}
 			}
@@ -346,6 +486,37 @@ static void panasonic_rx_task()
 	vTaskDelete(NULL);
 }
 
+/*
+ * @brief Read the receive totals of one receiver, for task_stats.c
+ */
+void panasonic_ir_rx_stats(int receiver, struct panasonic_rx_stats *stats)
+{
+	const struct panasonic_rx_stats *s = &receivers[receiver].stats;
+
+	stats->frames = __atomic_load_n(&s->frames, __ATOMIC_RELAXED);
+	stats->used = __atomic_load_n(&s->used, __ATOMIC_RELAXED);
+	stats->errors = __atomic_load_n(&s->errors, __ATOMIC_RELAXED);
+	stats->corrected = __atomic_load_n(&s->corrected, __ATOMIC_RELAXED);
+}
+
+#if CONFIG_IR_HISTOGRAM
+/*
+ * @brief One line of the receive histogram, see ir_histogram_dump()
+ *
+ * Read while the receive task keeps counting, so the series are not a
+ * consistent snapshot of each other.
+ */
+int panasonic_ir_histogram(int series, char *buf, size_t size)
+{
+	return ir_histogram_dump(&histogram, series, buf, size);
+}
+
+void panasonic_ir_histogram_reset(void)
+{
+	memset(&histogram, 0, sizeof(histogram));
+}
+#endif
+
 /*
  * @brief RMT transmitter initialization
  */
@@ -366,31 +537,55 @@ static void tx_init()
 	rmt_tx.rmt_mode = RMT_MODE_TX;
 	rmt_config(&rmt_tx);
 	rmt_driver_install(rmt_tx.channel, 0, 0);
+#if CONFIG_IR_LEARN
+	rmt_translator_init(rmt_tx.channel, play_translate);
+#endif
 }
 
 /*
  * @brief RMT receiver initialization
  */
-static void rx_init()
+static void rx_init(const struct ir_receiver *rx)
 {
 	rmt_config_t rmt_rx;
-	rmt_rx.channel = RMT_RX_CHANNEL;
-	rmt_rx.gpio_num = RMT_RX_GPIO_NUM;
+	rmt_rx.channel = rx->channel;
+	rmt_rx.gpio_num = rx->gpio_num;
 	rmt_rx.clk_div = RMT_CLK_DIV;
-	rmt_rx.mem_block_num = 4;
+	rmt_rx.mem_block_num = rx->mem_blocks;
 	rmt_rx.rmt_mode = RMT_MODE_RX;
 	rmt_rx.rx_config.filter_en = true;
 	rmt_rx.rx_config.filter_ticks_thresh = 255;
 	rmt_rx.rx_config.idle_threshold = RMT_ITEM32_TIMEOUT_US;
 	rmt_config(&rmt_rx);
-	rmt_driver_install(rmt_rx.channel, 4000, 0);
+	rmt_driver_install(rmt_rx.channel, IR_RX_RINGBUF_SIZE, 0);
 }
 
 void panasonic_ir_init(void (*receiver)(const struct panasonic_command *cmd, void *priv), void *priv)
 {
 	receive_cb = receiver;
 	receive_priv = priv;
+#if CONFIG_STATIC_MEMORY
+	static StaticSemaphore_t tx_lock_buf;
+
+	tx_lock = xSemaphoreCreateMutexStatic(&tx_lock_buf);
+#else
+	tx_lock = xSemaphoreCreateMutex();
+#endif
 	tx_init();
-	rx_init();
-	xTaskCreate(panasonic_rx_task, "rmt_rx_task", 2048, NULL, 10, NULL);
+
+	for (int i = 0; i < IR_RX_TASKS; i++) {
+		struct ir_receiver *rx = &receivers[i];
+		TaskHandle_t task;
+
+		rx_init(rx);
+#if CONFIG_STATIC_MEMORY
+		static StackType_t stack[IR_RX_TASKS][IR_RX_TASK_STACK];
+		static StaticTask_t task_buf[IR_RX_TASKS];
+
+		task = xTaskCreateStatic(panasonic_rx_task, rx->task_name, IR_RX_TASK_STACK, rx, 10, stack[i], &task_buf[i]);
+#else
+		xTaskCreate(panasonic_rx_task, rx->task_name, IR_RX_TASK_STACK, rx, 10, &task);
+#endif
+		mem_register_task(task, IR_RX_TASK_STACK);
+	}
 }
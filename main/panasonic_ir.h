@@ -2,8 +2,41 @@
 #define PANASONIC_IR_H
 
 #include "panasonic_frame.h"
+#include <stddef.h>
+#include <stdint.h>
 
 void panasonic_ir_init(void (*receiver)(const struct panasonic_command *cmd, void *priv), void *priv);
-void panasonic_transmit(const struct panasonic_command *cmd);
+/* Most commands panasonic_transmit_list() sends in one go */
+#define PANASONIC_COMMANDS_MAX 4
+
+int panasonic_transmit(const struct panasonic_command *cmd);
+int panasonic_transmit_list(const struct panasonic_command *cmds, int count);
+
+/* Running totals of panasonic_transmit_list(), wrapping; take differences */
+struct panasonic_tx_stats {
+	uint32_t frames;
+	uint32_t build_us;      /*!< Building frames and RMT items */
+	uint32_t air_us;        /*!< From rmt_write_items() to rmt_wait_tx_done() */
+};
+
+void panasonic_ir_tx_stats(struct panasonic_tx_stats *stats);
+
+/* Running totals of one receiver, wrapping; take differences */
+struct panasonic_rx_stats {
+	uint32_t frames;        /*!< Valid frames decoded */
+	uint32_t used;          /*!< Of those, passed on first; the rest were the other receiver's */
+	uint32_t errors;        /*!< Pairs the decoder could not classify */
+	uint32_t corrected;     /*!< Valid frames that needed one bit corrected */
+};
+
+void panasonic_ir_rx_stats(int receiver, struct panasonic_rx_stats *stats);
+
+/* With CONFIG_IR_LEARN */
+void panasonic_ir_learn(const char *name, int len);
+int panasonic_ir_play(const char *name, int len);
+
+/* With CONFIG_IR_HISTOGRAM */
+int panasonic_ir_histogram(int series, char *buf, size_t size);
+void panasonic_ir_histogram_reset(void);
 
 #endif /* PANASONIC_IR_H */
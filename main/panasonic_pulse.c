@@ -0,0 +1,131 @@
+#include "panasonic_pulse.h"
+
+static const uint8_t header[PANASONIC_HEADER_LEN] = {0x02, 0x20, 0xE0, 0x04, 0x00, 0x00, 0x00, 0x06};
+
+/*
+ * @brief Decode a mark/space pair into the corresponding symbol
+ */
+static enum pana_item decode_item(uint16_t mark, uint16_t space)
+{
+	if (space == 0) {
+		return PANA_END;
+	}
+
+	if ((mark > HEADER_MARK_MIN_US && space < mark) || (space > HEADER_SPACE_MIN_US && mark < space)) {
+		return PANA_HEADER;
+	}
+
+	if (mark < MARK_US - BIT_MARGIN || mark > MARK_US + BIT_MARGIN) {
+		return PANA_INVALID;
+	}
+
+	if (space < mark * 2) {
+		return PANA_BIT_0;
+	} else {
+		return PANA_BIT_1;
+	}
+}
+
+/*
+ * @brief Remember a bit close to the threshold, keeping the weakest
+ */
+static void weak_add(struct panasonic_parser *p, int bit, uint16_t margin)
+{
+	int i = p->weak_count < PANASONIC_WEAK_BITS ? p->weak_count++ : PANASONIC_WEAK_BITS;
+
+	for (; i > 0 && p->weak[i - 1].margin > margin; i--) {
+		if (i < PANASONIC_WEAK_BITS) {
+			p->weak[i] = p->weak[i - 1];
+		}
+	}
+	if (i < PANASONIC_WEAK_BITS) {
+		p->weak[i] = (struct panasonic_weak_bit){ bit, margin };
+	}
+}
+
+/*
+ * @brief Feed one mark and the following space to the frame parser
+ *
+ * A space of 0 means the line went idle. Returns the length of the frame
+ * in p->buf when one is complete, 0 while in progress and -1 on a
+ * malformed frame.
+ */
+int panasonic_pulse_parse(struct panasonic_parser *p, uint16_t mark, uint16_t space)
+{
+	enum pana_item pi = decode_item(mark, space);
+
+	p->item = pi;
+	if (pi == PANA_HEADER) {
+		p->bitcount = 0;
+		p->bytecount = 0;
+		p->in_frame = true;
+		p->weak_count = 0;
+		return 0;
+	} else if (pi == PANA_END) {
+		int ret = p->bitcount == 0 ? p->bytecount : -1;
+		p->bitcount = 0;
+		p->bytecount = 0;
+		p->in_frame = false;
+		return ret;
+	} else if (pi == PANA_INVALID) {
+		p->in_frame = false;
+		return -1;
+	} else if (p->in_frame) {
+		/* How sure the bit is, as space < mark * 2 in decode_item() */
+		int margin = space > mark * 2 ? space - mark * 2 : mark * 2 - space;
+
+		if (margin < WEAK_BIT_MARGIN_US && p->bytecount < sizeof(p->buf)) {
+			weak_add(p, p->bytecount * 8 + p->bitcount, margin);
+		}
+
+		/* Bit received in frame, shift in data */
+		p->data = (p->data >> 1) | (pi == PANA_BIT_1 ? 1 << 7 : 0);
+
+		if (++p->bitcount == 8) {
+			p->bitcount = 0;
+			if (p->bytecount < sizeof(p->buf)) {
+				p->buf[p->bytecount] = p->data;
+			} else {
+				p->in_frame = false;
+				return -1;
+			}
+			p->bytecount++;
+		}
+	}
+
+	return 0;
+}
+
+static int encode_frame(struct panasonic_pulse *pulses, int n, const uint8_t *data, size_t len, uint16_t gap)
+{
+	pulses[n++] = (struct panasonic_pulse){ HEADER_MARK_US, HEADER_SPACE_US };
+
+	for (size_t i = 0; i < len; i++) {
+		uint8_t d = data[i];
+		for (int b = 0; b < 8; b++) {
+			pulses[n++] = (struct panasonic_pulse){ MARK_US, d & 1 ? BIT_ONE_SPACE_US : BIT_ZERO_SPACE_US };
+			d >>= 1;
+		}
+	}
+
+	pulses[n++] = (struct panasonic_pulse){ MARK_US, gap };
+	return n;
+}
+
+/*
+ * @brief Timing of a complete transmission: header frame, gap, data frame
+ *
+ * Returns the number of pulses, or -1 if max is too small.
+ */
+int panasonic_pulse_encode(struct panasonic_pulse *pulses, size_t max, const uint8_t *data, size_t len)
+{
+	int n = 0;
+
+	if (len > PANASONIC_FRAME_MAXLEN || max < 2 + sizeof(header) * 8 + 2 + len * 8) {
+		return -1;
+	}
+
+	n = encode_frame(pulses, n, header, sizeof(header), IDLE_US);
+	n = encode_frame(pulses, n, data, len, 0);
+	return n;
+}
@@ -0,0 +1,73 @@
+#ifndef PANASONIC_PULSE_H
+#define PANASONIC_PULSE_H
+
+/* Panasonic IR timing: frames to mark/space durations and back
+
+   A command goes out as two frames, the constant eight byte header frame
+   and the data frame, separated by IDLE_US. Every frame starts with a
+   long header mark and space, and each bit is a short mark followed by a
+   short (0) or long (1) space, least significant bit first. A final mark
+   closes the frame.
+
+   Durations are in microseconds. No ESP-IDF dependencies, so that the RMT
+   driver and the Linux daemon share one encoder and one decoder.
+*/
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define HEADER_MARK_US    3543          /*!< Panasonic protocol header */
+#define HEADER_SPACE_US   1700          /*!< Panasonic protocol header */
+#define MARK_US            400          /*!< Panasonic protocol mark */
+#define BIT_ONE_SPACE_US  1340          /*!< Panasonic protocol space bit 1 */
+#define BIT_ZERO_SPACE_US  470          /*!< Panasonic protocol space bit 0 */
+#define IDLE_US          10400          /*!< Panasonic protocol interframe spacing */
+#define BIT_MARGIN         150          /*!< Panasonic parse margin time */
+#define HEADER_MARK_MIN_US  2700        /*!< Shortest mark taken as a header */
+#define HEADER_SPACE_MIN_US 1600        /*!< Shortest space taken as a header */
+#define WEAK_BIT_MARGIN_US  200         /*!< Bits closer to the 0/1 threshold may be corrected */
+#define PANASONIC_WEAK_BITS 4           /*!< Weak bits remembered per frame */
+
+#define PANASONIC_FRAME_MAXLEN   19     /*!< Longest frame sent or received */
+#define PANASONIC_HEADER_LEN      8     /*!< Length of the constant first frame */
+
+/* Most pulses panasonic_pulse_encode() produces */
+#define PANASONIC_PULSES_MAX  (2 + PANASONIC_HEADER_LEN * 8 + 2 + PANASONIC_FRAME_MAXLEN * 8)
+
+/* A mark and the space that follows it; space 0 ends the transmission */
+struct panasonic_pulse {
+	uint16_t mark;
+	uint16_t space;
+};
+
+/* How a mark/space pair was classified */
+enum pana_item {
+	PANA_INVALID = -1,
+	PANA_BIT_0,
+	PANA_BIT_1,
+	PANA_HEADER,
+	PANA_END
+};
+
+/* A bit whose space was close to the 0/1 threshold, see panasonic_parse_received() */
+struct panasonic_weak_bit {
+	uint8_t bit;            /*!< Bit number in the frame, LSB of byte 0 first */
+	uint16_t margin;        /*!< Distance of the space from the threshold, us */
+};
+
+struct panasonic_parser {
+	enum pana_item item;    /*!< Class of the last pair fed in */
+	uint8_t data;
+	uint8_t buf[PANASONIC_FRAME_MAXLEN];
+	int bitcount;
+	size_t bytecount;
+	bool in_frame;
+	struct panasonic_weak_bit weak[PANASONIC_WEAK_BITS];    /*!< Of the current frame, weakest first */
+	int weak_count;
+};
+
+int panasonic_pulse_encode(struct panasonic_pulse *pulses, size_t max, const uint8_t *data, size_t len);
+int panasonic_pulse_parse(struct panasonic_parser *p, uint16_t mark, uint16_t space);
+
+#endif /* PANASONIC_PULSE_H */
@@ -3,13 +3,31 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/semphr.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "history.h"
 #include "mqtt.h"
+#include "mqtt_topics.h"
+#include "mem_budget.h"
 #include <stdbool.h>
 
 static const char TAG[] = "PANA";
 
 static struct panasonic_command state;
 static SemaphoreHandle_t state_mutex;
+/* False until the state is set locally or restored from the broker */
+static bool state_known;
+
+/*
+ * Copy of state for readers that must not wait for state_mutex, which is
+ * held for the whole IR transmission. The only writer is whoever holds
+ * state_mutex, and readers retry while seq is odd or has changed.
+ */
+static struct {
+	uint32_t seq;
+	struct panasonic_command cmd;
+} snapshot;
+static portMUX_TYPE snapshot_mux = portMUX_INITIALIZER_UNLOCKED;
+static void (*state_listener)(void);
 
 static const char *mode_to_string(enum mode mode)
 {
@@ -95,8 +113,8 @@ const char *command_to_string(enum cmd cmd)
 
 static int panasonic_send_mqtt(const struct panasonic_command *cmd)
 {
-	const int maxlen = 100;
-	char *s = malloc(maxlen);
+	const int maxlen = STATE_JSON_MAXLEN;
+	char s[STATE_JSON_MAXLEN];
 	int ret;
 	int len;
 
@@ -108,66 +126,245 @@ static int panasonic_send_mqtt(const struct panasonic_command *cmd)
 
 	if (len > 0 && len < maxlen) {
 		ESP_LOGI(TAG, "Publish \"%s\"", s);
-		ret = mqtt_pub(cmd->cmd == CMD_STATE ? "" : "/command", s, len, 0, 0);
+		if (cmd->cmd == CMD_STATE) {
+			ret = mqtt_pub_state(s, len);
+		} else {
+			ret = mqtt_pub("/command", s, len, 0, 0);
+		}
 	} else {
 		ESP_LOGE(TAG, "Buffer too small, needed %d bytes", len);
 		ret = -1;
 	}
 
-	free(s);
-
 	return ret;
 }
 
-static void panasonic_send_state(void)
+/*
+ * @brief Publish state to the snapshot; call with state_mutex held
+ *
+ * The critical section keeps a reader on the same core from preempting
+ * the writer halfway, where it would spin forever. It lasts for one copy
+ * of a small struct.
+ */
+static void snapshot_update(void)
+{
+	portENTER_CRITICAL(&snapshot_mux);
+	__atomic_store_n(&snapshot.seq, snapshot.seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	snapshot.cmd = state;
+	__atomic_store_n(&snapshot.seq, snapshot.seq + 1, __ATOMIC_RELEASE);
+	portEXIT_CRITICAL(&snapshot_mux);
+}
+
+/*
+ * @brief Current state, never blocking behind an IR transmission
+ */
+void panasonic_get_state(struct panasonic_command *cmd)
+{
+	uint32_t seq;
+
+	do {
+		seq = __atomic_load_n(&snapshot.seq, __ATOMIC_ACQUIRE);
+		*cmd = snapshot.cmd;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) != 0 || seq != __atomic_load_n(&snapshot.seq, __ATOMIC_RELAXED));
+}
+
+/*
+ * @brief Be told about every state change
+ *
+ * The listener is called with state_mutex held, before the IR frame goes
+ * out, so it must not block; it should read panasonic_get_state() later.
+ */
+void panasonic_state_listen(void (*listener)(void))
+{
+	state_listener = listener;
+}
+
+/*
+ * @brief Transmit, noting in tx (if not NULL) when and how it went
+ */
+static void transmit_timed(const struct panasonic_command *cmds, int count, struct panasonic_tx *tx)
+{
+	int64_t start = esp_timer_get_time();
+	int err;
+
+	err = panasonic_transmit_list(cmds, count);
+	if (tx != NULL) {
+		tx->start = start;
+		tx->done = esp_timer_get_time();
+		tx->err = err;
+	}
+}
+
+/*
+ * @brief Record a change in the history log; only queues it
+ */
+static void state_log(enum state_source source, const struct panasonic_command *old,
+                      const struct panasonic_command *cmd)
+{
+#if CONFIG_HISTORY_LOG
+	history_log(source, old, cmd);
+#endif
+}
+
+static void panasonic_send_state(struct panasonic_tx *tx)
 {
-	panasonic_transmit(&state);
+	state_known = true;
+	snapshot_update();
+	if (state_listener != NULL) {
+		state_listener();
+	}
+	transmit_timed(&state, 1, tx);
 	panasonic_send_mqtt(&state);
 }
 
 void panasonic_set_state(const struct panasonic_command *cmd)
 {
 	xSemaphoreTake(state_mutex, portMAX_DELAY);
-	state = *cmd;
-	panasonic_send_state();
+	state_log(SOURCE_IR, state_known ? &state : NULL, cmd);
+	if (cmd->cmd == CMD_STATE) {
+		state = *cmd;
+		panasonic_send_state(NULL);
+	} else {
+		/* Special commands are relayed but are not a state */
+		panasonic_transmit(cmd);
+		panasonic_send_mqtt(cmd);
+	}
 	xSemaphoreGive(state_mutex);
 }
 
-void panasonic_set_temperature(int temperature)
+/*
+ * @brief Transmit a list of commands back to back
+ *
+ * CMD_STATE entries stand for the current state, so that for example
+ * state followed by Powerful switches the unit on and boosts it. Until a
+ * state is known there is none to stand for, and a list with CMD_STATE
+ * is refused with -1 rather than sending an all-zero frame.
+ */
+int panasonic_send_commands(struct panasonic_command *cmds, int count, enum state_source source,
+                            struct panasonic_tx *tx)
 {
 	xSemaphoreTake(state_mutex, portMAX_DELAY);
-	state.temp = temperature < 0 ? 0 : temperature > 31 ? 31 : temperature;
-	state.no_time = true;
-	panasonic_send_state();
+	for (int i = 0; i < count; i++) {
+		if (cmds[i].cmd == CMD_STATE && !state_known) {
+			xSemaphoreGive(state_mutex);
+			return -1;
+		}
+	}
+	for (int i = 0; i < count; i++) {
+		if (cmds[i].cmd == CMD_STATE) {
+			cmds[i] = state;
+		}
+		state_log(source, &state, &cmds[i]);
+	}
+	transmit_timed(cmds, count, tx);
+	for (int i = 0; i < count; i++) {
+		panasonic_send_mqtt(&cmds[i]);
+	}
 	xSemaphoreGive(state_mutex);
+	return 0;
 }
 
-void panasonic_set_mode(bool power, enum mode mode)
+/*
+ * @brief Apply one field change to a state, as the panasonic_set_* calls do
+ *
+ * Pure; the Linux daemon uses it for each unit it drives.
+ */
+void panasonic_apply_set(struct panasonic_command *s, const struct mqtt_set_request *req)
+{
+	switch (req->field) {
+	case SET_MODE:
+		s->on = req->power;
+		s->mode = req->mode;
+		break;
+	case SET_TEMPERATURE:
+		s->temp = req->temperature < 0 ? 0 : req->temperature > 31 ? 31 : req->temperature;
+		break;
+	case SET_FAN:
+		s->fan = req->fan;
+		break;
+	case SET_SWING:
+		s->swing = req->swing;
+		break;
+	}
+	s->no_time = true;
+}
+
+/*
+ * @brief Adopt a state published before a restart, if none is known yet
+ *
+ * Nothing is transmitted or published: the unit and the retained state
+ * topic already agree on it. Returns whether the state was taken over.
+ */
+bool panasonic_state_restore(const struct panasonic_command *cmd)
 {
+	bool restored = false;
+
 	xSemaphoreTake(state_mutex, portMAX_DELAY);
-	state.on = power;
-	state.mode = mode;
-	state.no_time = true;
-	panasonic_send_state();
+	if (!state_known) {
+		state_log(SOURCE_RESTORE, NULL, cmd);
+		state = *cmd;
+		state_known = true;
+		snapshot_update();
+		if (state_listener != NULL) {
+			state_listener();
+		}
+		restored = true;
+	}
 	xSemaphoreGive(state_mutex);
+
+	return restored;
 }
 
-void panasonic_set_fan(enum fan fan)
+bool panasonic_state_known(void)
 {
+	return __atomic_load_n(&state_known, __ATOMIC_RELAXED);
+}
+
+/*
+ * @brief Change several fields at once, with a single transmission
+ *
+ * tx, if not NULL, receives the timing of the transmission.
+ */
+void panasonic_set_fields(const struct mqtt_set_request *reqs, int count, enum state_source source,
+                          struct panasonic_tx *tx)
+{
+	struct panasonic_command old;
+
 	xSemaphoreTake(state_mutex, portMAX_DELAY);
-	state.fan = fan;
-	state.no_time = true;
-	panasonic_send_state();
+	old = state;
+	for (int i = 0; i < count; i++) {
+		panasonic_apply_set(&state, &reqs[i]);
+	}
+	state_log(source, state_known ? &old : NULL, &state);
+	panasonic_send_state(tx);
 	xSemaphoreGive(state_mutex);
 }
 
+static void panasonic_set(const struct mqtt_set_request *req)
+{
+	panasonic_set_fields(req, 1, SOURCE_MQTT, NULL);
+}
+
+void panasonic_set_temperature(int temperature)
+{
+	panasonic_set(&(struct mqtt_set_request){ .field = SET_TEMPERATURE, .temperature = temperature });
+}
+
+void panasonic_set_mode(bool power, enum mode mode)
+{
+	panasonic_set(&(struct mqtt_set_request){ .field = SET_MODE, .power = power, .mode = mode });
+}
+
+void panasonic_set_fan(enum fan fan)
+{
+	panasonic_set(&(struct mqtt_set_request){ .field = SET_FAN, .fan = fan });
+}
+
 void panasonic_set_swing(enum swing swing)
 {
-	xSemaphoreTake(state_mutex, portMAX_DELAY);
-	state.swing = swing;
-	state.no_time = true;
-	panasonic_send_state();
-	xSemaphoreGive(state_mutex);
+	panasonic_set(&(struct mqtt_set_request){ .field = SET_SWING, .swing = swing });
 }
 
 int panasonic_state_to_json(char *str, size_t size, const struct panasonic_command *cmd)
@@ -185,5 +382,12 @@ int panasonic_state_to_json(char *str, size_t size, const struct panasonic_comma
 
 void panasonic_state_init(void)
 {
+#if CONFIG_STATIC_MEMORY
+	static StaticSemaphore_t mutex_buf;
+
+	state_mutex = xSemaphoreCreateMutexStatic(&mutex_buf);
+#else
 	state_mutex = xSemaphoreCreateMutex();
+#endif
+	snapshot_update();
 }
@@ -4,14 +4,43 @@
 #include "panasonic_frame.h"
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+
+struct mqtt_set_request;
+
+/* Where a change came from, as recorded in the history log */
+enum state_source {
+	SOURCE_BOOT,
+	SOURCE_IR,              /*!< The unit's own remote */
+	SOURCE_MQTT,
+	SOURCE_HTTP,
+	SOURCE_RESTORE,         /*!< Retained state read back from the broker */
+};
+
+/* When a change went out on IR, for acknowledging it; esp_timer_get_time() */
+struct panasonic_tx {
+	int64_t start;          /*!< State lock taken, transmission begins */
+	int64_t done;           /*!< rmt_wait_tx_done() returned */
+	int err;                /*!< 0, or -1 if no frame was sent */
+};
 
 void panasonic_state_init(void);
+void panasonic_get_state(struct panasonic_command *cmd);
 void panasonic_set_state(const struct panasonic_command *cmd);
 void panasonic_set_temperature(int temperature);
 void panasonic_set_mode(bool power, enum mode mode);
 void panasonic_set_power(bool on);
 void panasonic_set_fan(enum fan fan);
 void panasonic_set_swing(enum swing swing);
+void panasonic_set_fields(const struct mqtt_set_request *reqs, int count, enum state_source source,
+                          struct panasonic_tx *tx);
+bool panasonic_state_restore(const struct panasonic_command *cmd);
+bool panasonic_state_known(void);
+void panasonic_state_listen(void (*listener)(void));
+int panasonic_send_commands(struct panasonic_command *cmds, int count, enum state_source source,
+                            struct panasonic_tx *tx);
+void panasonic_apply_set(struct panasonic_command *state, const struct mqtt_set_request *req);
+const char *command_to_string(enum cmd cmd);
 int panasonic_state_to_json(char *str, size_t maxlen, const struct panasonic_command *cmd);
 
 #endif /* PANASONIC_STATE_H */
@@ -0,0 +1,131 @@
+/* Per-task CPU and stack use, see task_stats.h
+
+   Runs in its own task rather than from a timer: the publish may wait
+   for the MQTT client and write through TLS, which must not hold up the
+   timer service task or run on its small stack. Everything sizeable is
+   static all the same.
+*/
+
+#include "task_stats.h"
+
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_system.h"
+
+#include "mem_budget.h"
+#include "mqtt.h"
+#include "mqtt_topics.h"
+#include "panasonic_ir.h"
+
+static const char TAG[] = "STATS";
+
+#if CONFIG_TASK_STATS_INTERVAL > 0
+/* Counters at the last report; both wrap, only differences count */
+static struct {
+	TaskHandle_t task;
+	uint32_t run_time;
+} last[TASK_STATS_MAX];
+static int last_count;
+static uint32_t last_total;
+static struct panasonic_tx_stats last_tx;
+static struct panasonic_rx_stats last_rx[IR_RX_TASKS];
+
+static uint32_t last_run_time(TaskHandle_t task)
+{
+	for (int i = 0; i < last_count; i++) {
+		if (last[i].task == task) {
+			return last[i].run_time;
+		}
+	}
+	return 0;
+}
+
+static void task_stats_report(void)
+{
+	static TaskStatus_t status[TASK_STATS_MAX];
+	static char buf[TASK_STATS_MAXLEN];
+	struct panasonic_tx_stats tx;
+	struct panasonic_rx_stats rx[IR_RX_TASKS];
+	uint32_t total;
+	uint32_t elapsed;
+	size_t len;
+	int n;
+
+	n = uxTaskGetSystemState(status, TASK_STATS_MAX, &total);
+	if (n == 0) {
+		/* More tasks than TASK_STATS_MAX; FreeRTOS fills in nothing then */
+		ESP_LOGW(TAG, "More than %d tasks", TASK_STATS_MAX);
+		return;
+	}
+	elapsed = total - last_total;
+	panasonic_ir_tx_stats(&tx);
+
+	len = snprintf(buf, sizeof(buf), "{\"ms\":%u,\"heap\":[%u,%u,%u],\"ir_tx\":[%u,%u,%u],\"ir_rx\":[",
+	               elapsed / 1000, esp_get_free_heap_size(), esp_get_minimum_free_heap_size(),
+	               (unsigned int)heap_caps_get_largest_free_block(MALLOC_CAP_8BIT), tx.frames - last_tx.frames,
+	               tx.build_us - last_tx.build_us, (tx.air_us - last_tx.air_us) / 1000);
+	for (int i = 0; i < IR_RX_TASKS; i++) {
+		panasonic_ir_rx_stats(i, &rx[i]);
+		len += snprintf(buf + len, sizeof(buf) - len, "%s[%u,%u,%u,%u]", i > 0 ? "," : "",
+		                rx[i].frames - last_rx[i].frames, rx[i].used - last_rx[i].used,
+		                rx[i].errors - last_rx[i].errors, rx[i].corrected - last_rx[i].corrected);
+	}
+	len += snprintf(buf + len, sizeof(buf) - len, "],\"tasks\":[");
+
+	/* Tasks that do not fit, keeping room for the closing "]}", are left out */
+	for (int i = 0; i < n; i++) {
+		uint32_t used = status[i].ulRunTimeCounter - last_run_time(status[i].xHandle);
+		int ret;
+
+		/* High-water marks are in bytes on ESP-IDF */
+		ret = snprintf(buf + len, sizeof(buf) - len - 2, "%s[\"%s\",%u,%u,%u]", i > 0 ? "," : "",
+		               status[i].pcTaskName, elapsed > 0 ? (uint32_t)((uint64_t)used * 1000 / elapsed) : 0,
+		               status[i].usStackHighWaterMark, mem_task_stack_size(status[i].xHandle));
+		if (ret >= (int)(sizeof(buf) - len - 2)) {
+			ESP_LOGW(TAG, "Report full, %d tasks left out", n - i);
+			break;
+		}
+		len += ret;
+	}
+	len += snprintf(buf + len, sizeof(buf) - len, "]}");
+
+	mqtt_pub(STATS_TASKS_TOPIC, buf, len, 0, 0);
+
+	for (int i = 0; i < n; i++) {
+		last[i].task = status[i].xHandle;
+		last[i].run_time = status[i].ulRunTimeCounter;
+	}
+	last_count = n;
+	last_total = total;
+	last_tx = tx;
+	memcpy(last_rx, rx, sizeof(last_rx));
+}
+
+static void task_stats_task(void *arg)
+{
+	for (;;) {
+		vTaskDelay(pdMS_TO_TICKS(CONFIG_TASK_STATS_INTERVAL * 1000));
+		task_stats_report();
+	}
+}
+#endif /* CONFIG_TASK_STATS_INTERVAL > 0 */
+
+void task_stats_init(void)
+{
+#if CONFIG_TASK_STATS_INTERVAL > 0
+	TaskHandle_t task;
+#if CONFIG_STATIC_MEMORY
+	static StackType_t stack[STATS_TASK_STACK];
+	static StaticTask_t task_buf;
+
+	task = xTaskCreateStatic(task_stats_task, "task_stats", STATS_TASK_STACK, NULL, 1, stack, &task_buf);
+#else
+	xTaskCreate(task_stats_task, "task_stats", STATS_TASK_STACK, NULL, 1, &task);
+#endif
+	mem_register_task(task, STATS_TASK_STACK);
+#endif
+}
@@ -0,0 +1,32 @@
+#ifndef TASK_STATS_H
+#define TASK_STATS_H
+
+/* CPU use and stack headroom of every task, published over MQTT
+
+   Every CONFIG_TASK_STATS_INTERVAL seconds one message goes to
+   panasonic/<id>/stats/tasks:
+
+     {"ms":60000,"heap":[free,min,largest],"ir_tx":[frames,build_us,air_ms],
+      "ir_rx":[[frames,used,errors,corrected],...],"tasks":[["name",cpu,stack_free,stack_size],...]}
+
+   cpu is the share of one core the task used since the last message, in
+   tenths of a percent, from the FreeRTOS run time counters; the IDLE
+   tasks make up the rest. stack_free is the high-water mark in bytes,
+   stack_size is 0 for tasks not created by the application. ir_tx
+   counts the AC frames sent in the interval, the CPU time spent building
+   them and their time on air; sending runs in whichever task asked for
+   it, so that CPU time is also part of the caller's share. ir_rx has one
+   entry per receiver: valid frames it decoded, how many of them it
+   delivered before the other receiver, pairs it could not decode and
+   frames it recovered by correcting a bit.
+
+   Needs CONFIG_FREERTOS_USE_TRACE_FACILITY and
+   CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS.
+*/
+
+#define TASK_STATS_MAX    24            /*!< Tasks reported; any more are left out */
+#define TASK_STATS_MAXLEN 1024
+
+void task_stats_init(void);
+
+#endif /* TASK_STATS_H */
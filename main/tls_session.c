@@ -0,0 +1,237 @@
+/* TLS session cache, see tls_session.h
+
+   Only the OTA task connects through here, so there is no locking.
+*/
+
+#include "tls_session.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "nvs.h"
+
+static const char TAG[] = "TLS";
+
+/* Connection times so far, full handshakes [0] and resumed [1] */
+static struct {
+	uint32_t count;
+	uint32_t total_ms;
+} connects[2];
+
+#ifdef CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+#include "mbedtls/ssl.h"
+
+#define TLS_NVS_NAMESPACE "tls"
+#define TLS_NVS_BLOB_MAX  2048          /*!< Session with the server certificate */
+
+static struct {
+	char host[TLS_SESSION_HOST_MAX];
+	esp_tls_client_session_t *session;
+	uint32_t used;
+} slots[TLS_SESSION_SLOTS];
+static uint32_t use_count;
+
+#if CONFIG_TLS_SESSION_NVS
+/*
+ * @brief Store slot i, unless NVS already holds the same
+ *
+ * A resumed connection usually hands back the stored session unchanged,
+ * and rewriting it on every check would only wear the flash.
+ */
+static void session_save(int i)
+{
+	static uint8_t buf[TLS_NVS_BLOB_MAX];
+	static uint8_t stored[TLS_NVS_BLOB_MAX];
+	char host[TLS_SESSION_HOST_MAX];
+	size_t host_len = sizeof(host);
+	size_t stored_len = sizeof(stored);
+	bool changed = false;
+	char key[4];
+	size_t len = 0;
+	nvs_handle_t nvs;
+
+	if (nvs_open(TLS_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) {
+		return;
+	}
+
+	snprintf(key, sizeof(key), "h%d", i);
+	if (nvs_get_str(nvs, key, host, &host_len) != ESP_OK || strcmp(host, slots[i].host) != 0) {
+		nvs_set_str(nvs, key, slots[i].host);
+		changed = true;
+	}
+	snprintf(key, sizeof(key), "s%d", i);
+	if (nvs_get_blob(nvs, key, stored, &stored_len) != ESP_OK) {
+		stored_len = 0;
+	}
+	if (slots[i].session != NULL &&
+	    mbedtls_ssl_session_save(&slots[i].session->saved_session, buf, sizeof(buf), &len) == 0) {
+		if (len != stored_len || memcmp(buf, stored, len) != 0) {
+			nvs_set_blob(nvs, key, buf, len);
+			changed = true;
+		}
+	} else if (stored_len > 0) {
+		nvs_erase_key(nvs, key);
+		changed = true;
+	}
+	if (changed) {
+		nvs_commit(nvs);
+	}
+	nvs_close(nvs);
+}
+
+static void session_load_all(void)
+{
+	static uint8_t buf[TLS_NVS_BLOB_MAX];
+	nvs_handle_t nvs;
+
+	if (nvs_open(TLS_NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) {
+		return;
+	}
+
+	for (int i = 0; i < TLS_SESSION_SLOTS; i++) {
+		esp_tls_client_session_t *session;
+		size_t host_len = sizeof(slots[i].host);
+		size_t len = sizeof(buf);
+		char key[4];
+
+		snprintf(key, sizeof(key), "h%d", i);
+		if (nvs_get_str(nvs, key, slots[i].host, &host_len) != ESP_OK) {
+			continue;
+		}
+		snprintf(key, sizeof(key), "s%d", i);
+		if (nvs_get_blob(nvs, key, buf, &len) != ESP_OK) {
+			continue;
+		}
+
+		session = calloc(1, sizeof(*session));
+		if (session == NULL) {
+			break;
+		}
+		mbedtls_ssl_session_init(&session->saved_session);
+		if (mbedtls_ssl_session_load(&session->saved_session, buf, len) != 0) {
+			esp_tls_free_client_session(session);
+			continue;
+		}
+		slots[i].session = session;
+		ESP_LOGI(TAG, "Loaded session for %s", slots[i].host);
+	}
+	nvs_close(nvs);
+}
+#else
+static void session_save(int i)
+{
+}
+
+static void session_load_all(void)
+{
+}
+#endif /* CONFIG_TLS_SESSION_NVS */
+
+static int slot_find(const char *host)
+{
+	for (int i = 0; i < TLS_SESSION_SLOTS; i++) {
+		if (slots[i].session != NULL && strcmp(slots[i].host, host) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static void slot_set(int i, const char *host, esp_tls_client_session_t *session)
+{
+	if (slots[i].session != NULL) {
+		esp_tls_free_client_session(slots[i].session);
+	}
+	snprintf(slots[i].host, sizeof(slots[i].host), "%s", host);
+	slots[i].session = session;
+	slots[i].used = ++use_count;
+	session_save(i);
+}
+
+/*
+ * @brief Remember the session of a new connection, replacing the one for
+ * the same server or else the least recently used
+ */
+static void session_store(const char *host, esp_tls_t *tls)
+{
+	esp_tls_client_session_t *session = esp_tls_get_client_session(tls);
+	int i = slot_find(host);
+
+	if (session == NULL) {
+		return;
+	}
+	if (i < 0) {
+		i = 0;
+		for (int j = 1; j < TLS_SESSION_SLOTS && slots[i].session != NULL; j++) {
+			if (slots[j].session == NULL || slots[j].used < slots[i].used) {
+				i = j;
+			}
+		}
+	}
+	slot_set(i, host, session);
+}
+#endif /* CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS */
+
+/*
+ * @brief Connect to url, resuming the last session with host if there is one
+ *
+ * The time the connection took is logged, with the average over all full
+ * and all resumed handshakes so far. A session that fails to resume is
+ * dropped. "Resumed" means a session was offered; a server that turns it
+ * down does a full handshake, which shows up as a higher average.
+ */
+esp_tls_t *tls_session_connect(const char *url, const char *host, esp_tls_cfg_t *cfg)
+{
+	int64_t start = esp_timer_get_time();
+	bool offered = false;
+	esp_tls_t *tls;
+
+#ifdef CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+	int i = cfg->is_plain_tcp ? -1 : slot_find(host);
+
+	if (i >= 0) {
+		cfg->client_session = slots[i].session;
+		slots[i].used = ++use_count;
+		offered = true;
+	}
+#endif
+
+	tls = esp_tls_conn_http_new(url, cfg);
+	if (tls == NULL) {
+		ESP_LOGE(TAG, "Connection to %s failed", host);
+#ifdef CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+		if (i >= 0) {
+			slot_set(i, "", NULL);
+		}
+#endif
+		return NULL;
+	}
+
+	uint32_t ms = (esp_timer_get_time() - start) / 1000;
+
+	if (cfg->is_plain_tcp) {
+		ESP_LOGI(TAG, "Connected to %s in %u ms (plain)", host, ms);
+		return tls;
+	}
+	connects[offered].count++;
+	connects[offered].total_ms += ms;
+	ESP_LOGI(TAG, "Connected to %s in %u ms (%s); average full %u ms over %u, resumed %u ms over %u",
+	         host, ms, offered ? "session offered" : "full handshake",
+	         connects[0].count ? connects[0].total_ms / connects[0].count : 0, connects[0].count,
+	         connects[1].count ? connects[1].total_ms / connects[1].count : 0, connects[1].count);
+
+#ifdef CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+	session_store(host, tls);
+#endif
+	return tls;
+}
+
+void tls_session_init(void)
+{
+#ifdef CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+	session_load_all();
+#endif
+}
@@ -0,0 +1,23 @@
+#ifndef TLS_SESSION_H
+#define TLS_SESSION_H
+
+/* TLS session resumption for the connections the proxy opens itself
+
+   A resumed handshake skips the certificate chain check and the key
+   exchange, which take seconds of CPU on an ESP32. One session is kept
+   per server in RAM and, with CONFIG_TLS_SESSION_NVS, in NVS so that the
+   first connection after a reboot resumes as well.
+
+   Needs CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS. Without it, every
+   connection does a full handshake.
+*/
+
+#include "esp_tls.h"
+
+#define TLS_SESSION_SLOTS    2          /*!< Servers remembered at a time */
+#define TLS_SESSION_HOST_MAX 64
+
+esp_tls_t *tls_session_connect(const char *url, const char *host, esp_tls_cfg_t *cfg);
+void tls_session_init(void);
+
+#endif /* TLS_SESSION_H */